@@ -0,0 +1,169 @@
+#include "broadcast_benchmark.h"
+#include "../../StreamLib/include/streamer.h"
+#include <websocketpp/config/asio_no_tls_client.hpp>
+#include <websocketpp/client.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using client = websocketpp::client<websocketpp::config::asio_client>;
+
+namespace {
+	const char *server_uri = "ws://127.0.0.1:54321";
+	const int viewer_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+	// About the size of a 1080p P frame at 8 Mbps.
+	constexpr int payload_size = 32 * 1024;
+	constexpr int wait_timeout_s = 10;
+	// Frames are sent at 60 fps, as the encoder would, not back to back.
+	constexpr auto frame_interval = std::chrono::microseconds(16667);
+
+	// Preemptions of the encoder thread by the websocket thread make the mean noisy.
+	double median(std::vector<double> &samples)
+	{
+		std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		return samples[samples.size() / 2];
+	}
+
+	// The streamer lists a connection once its "open" message is handled.
+	bool wait_for_connections(const Streamer &streamer, int count)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(wait_timeout_s);
+		while ((int)streamer.connection_count() != count) {
+			if (std::chrono::steady_clock::now() > deadline)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	// Viewers of the stream, every connection counts the messages it receives.
+	class Viewers
+	{
+	public:
+		Viewers()
+			: _opened(0)
+			, _received(0)
+		{
+			_client.clear_access_channels(websocketpp::log::alevel::all);
+			_client.clear_error_channels(websocketpp::log::elevel::all);
+			_client.init_asio();
+			_client.start_perpetual();
+			_client.set_open_handler([this](websocketpp::connection_hdl hdl)
+			{
+				_client.send(hdl, "open", websocketpp::frame::opcode::TEXT);
+				++_opened;
+				notify();
+			});
+			_client.set_message_handler([this](websocketpp::connection_hdl, client::message_ptr)
+			{
+				++_received;
+				notify();
+			});
+			_thread = std::thread([this]() { _client.run(); });
+		}
+
+		~Viewers()
+		{
+			_client.stop_perpetual();
+			_client.get_io_service().post([this]() {
+				for (auto &hdl : _connections) {
+					websocketpp::lib::error_code ec;
+					_client.close(hdl, websocketpp::close::status::going_away, "", ec);
+				}
+			});
+			_thread.join();
+		}
+
+		// Viewers join one at a time, as they would on a live stream.
+		bool connect(int count)
+		{
+			while ((int)_connections.size() < count) {
+				websocketpp::lib::error_code ec;
+				auto con = _client.get_connection(server_uri, ec);
+				if (ec)
+					return false;
+				_connections.push_back(con->get_handle());
+				// The endpoint is not thread safe, connections are started from its own thread.
+				_client.get_io_service().post([this, con]() { _client.connect(con); });
+				const auto opened = (int)_connections.size();
+				if (!wait([this, opened]() { return _opened == opened; }))
+					return false;
+			}
+			return true;
+		}
+
+		int64_t received() const { return _received; }
+
+		template <typename Predicate>
+		bool wait(Predicate predicate)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			return _changed.wait_for(lock, std::chrono::seconds(wait_timeout_s), predicate);
+		}
+	private:
+		void notify()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+			}
+			_changed.notify_all();
+		}
+
+		client _client;
+		std::thread _thread;
+		std::vector<websocketpp::connection_hdl> _connections;
+		std::atomic<int> _opened;
+		std::atomic<int64_t> _received;
+		std::mutex _mutex;
+		std::condition_variable _changed;
+	};
+}
+
+void run_broadcast_benchmark(int frames)
+{
+	Streamer streamer;
+	if (!streamer.init()) {
+		printf("Could not initialize the streamer\n");
+		return;
+	}
+
+	std::vector<uint8_t> payload(payload_size, 0x5a);
+	{
+		Viewers viewers;
+		printf("Broadcast of %d byte messages, median microseconds per frame over %d frames\n", payload_size, frames);
+		printf("%8s %12s %12s\n", "viewers", "send", "delivery");
+		for (auto count : viewer_counts) {
+			if (!viewers.connect(count) || !wait_for_connections(streamer, count)) {
+				printf("Could not open %d connections\n", count);
+				break;
+			}
+
+			// send is the time spent on the encoder thread, delivery the time until every viewer received the frame.
+			std::vector<double> send_us;
+			std::vector<double> delivery_us;
+			auto next_frame = std::chrono::steady_clock::now();
+			for (auto i = 0; i < frames; ++i) {
+				std::this_thread::sleep_until(next_frame);
+				next_frame += frame_interval;
+				const auto expected = viewers.received() + count;
+				const auto start = std::chrono::steady_clock::now();
+				streamer.send_packet_buffer(payload.data(), payload_size);
+				const auto sent = std::chrono::steady_clock::now();
+				if (!viewers.wait([&]() { return viewers.received() >= expected; })) {
+					printf("Frames were not delivered to %d viewers\n", count);
+					return;
+				}
+				const auto delivered = std::chrono::steady_clock::now();
+				send_us.push_back(std::chrono::duration<double, std::micro>(sent - start).count());
+				delivery_us.push_back(std::chrono::duration<double, std::micro>(delivered - start).count());
+			}
+			printf("%8d %12.1f %12.1f\n", count, median(send_us), median(delivery_us));
+		}
+	}
+	streamer.shutdown();
+}
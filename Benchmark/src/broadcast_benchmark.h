@@ -0,0 +1,5 @@
+#pragma once
+
+// Times Streamer::send_packet_buffer, which broadcasts one prepared message, from 1 to 64
+// websocket connections opened on the loopback interface.
+void run_broadcast_benchmark(int frames);
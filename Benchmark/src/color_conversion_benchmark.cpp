@@ -0,0 +1,146 @@
+#include "color_conversion_benchmark.h"
+#include "color_conversion.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+}
+
+namespace {
+	struct Resolution
+	{
+		const char *name;
+		int width;
+		int height;
+	};
+
+	const Resolution resolutions[] = { { "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4K", 3840, 2160 } };
+
+	struct Format
+	{
+		const char *name;
+		SourceFormat format;
+		AVPixelFormat pixel_format;
+		int bpp;
+	};
+
+	const Format formats[] = {
+		{ "RGB24", SourceFormat::RGB24, AV_PIX_FMT_RGB24, 3 },
+		{ "RGBA", SourceFormat::RGBA, AV_PIX_FMT_RGBA, 4 },
+		{ "BGRA", SourceFormat::BGRA, AV_PIX_FMT_BGRA, 4 }
+	};
+
+	struct YuvBuffer
+	{
+		std::vector<uint8_t> planes[3];
+		YuvImage image;
+
+		YuvBuffer(int width, int height)
+		{
+			planes[0].resize((size_t)width * height);
+			planes[1].resize((size_t)width * height / 4);
+			planes[2].resize((size_t)width * height / 4);
+			for (auto i = 0; i < 3; ++i) {
+				image.data[i] = planes[i].data();
+				image.linesize[i] = i == 0 ? width : width / 2;
+			}
+			image.width = width;
+			image.height = height;
+		}
+	};
+
+	// Smooth gradients: SWS_FAST_BILINEAR filters neighbouring pixels even when not scaling,
+	// so only smooth images can be compared pixel to pixel.
+	std::vector<uint8_t> make_image(int width, int height, int bpp)
+	{
+		std::vector<uint8_t> image((size_t)width * height * bpp);
+		for (auto y = 0; y < height; ++y) {
+			for (auto x = 0; x < width; ++x) {
+				auto *pixel = image.data() + ((size_t)y * width + x) * bpp;
+				pixel[0] = (uint8_t)(x * 255 / width);
+				pixel[1] = (uint8_t)(y * 255 / height);
+				pixel[2] = (uint8_t)((x + y) * 255 / (width + height));
+				if (bpp == 4)
+					pixel[3] = 0xff;
+			}
+		}
+		return image;
+	}
+
+	template <typename Function>
+	double milliseconds_per_frame(int frames, Function function)
+	{
+		// One untimed frame to fault the buffers in and fill the caches of the scaler.
+		function();
+		const auto start = std::chrono::steady_clock::now();
+		for (auto i = 0; i < frames; ++i) {
+			function();
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		return std::chrono::duration<double, std::milli>(elapsed).count() / frames;
+	}
+
+	int max_difference(const std::vector<uint8_t> &lhs, const std::vector<uint8_t> &rhs)
+	{
+		auto difference = 0;
+		for (size_t i = 0; i < lhs.size(); ++i) {
+			difference = std::max(difference, abs(lhs[i] - rhs[i]));
+		}
+		return difference;
+	}
+}
+
+void run_color_conversion_benchmark(int frames)
+{
+	const auto functions = supported_rgb_to_yuv420p();
+	printf("RGB to YUV420P, milliseconds per frame over %d frames, speedup against sws_scale\n", frames);
+	printf("%-6s %-6s %10s", "size", "format", "sws_scale");
+	for (auto function : functions) {
+		printf(" %16s", rgb_to_yuv420p_name(function));
+	}
+	printf(" %6s %6s\n", "Y diff", "UV diff");
+
+	for (const auto &resolution : resolutions) {
+		for (const auto &format : formats) {
+			const auto width = resolution.width;
+			const auto height = resolution.height;
+			const auto image = make_image(width, height, format.bpp);
+			const SourceImage source = { image.data(), width * format.bpp, width, height, format.format };
+
+			// The context open_stream created for every stream before the dedicated converters.
+			auto *scale_context = sws_getContext(width, height, format.pixel_format, width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+			if (scale_context == nullptr) {
+				printf("Failed to allocate scale context\n");
+				return;
+			}
+			YuvBuffer scaled(width, height);
+			const uint8_t *source_planes[1] = { image.data() };
+			const int source_strides[1] = { source.stride };
+			auto sws_ms = milliseconds_per_frame(frames, [&]() {
+				sws_scale(scale_context, source_planes, source_strides, 0, height, scaled.image.data, scaled.image.linesize);
+			});
+			sws_freeContext(scale_context);
+			printf("%-6s %-6s %10.2f", resolution.name, format.name, sws_ms);
+
+			// Largest difference to the sws_scale output, chroma differs more as sws_scale does not average the 2x2 blocks.
+			int difference[2] = { 0, 0 };
+			for (auto function : functions) {
+				YuvBuffer converted(width, height);
+				auto ms = milliseconds_per_frame(frames, [&]() {
+					function(source, converted.image, 0, height);
+				});
+				printf(" %8.2f (%4.1fx)", ms, sws_ms / ms);
+				for (auto i = 0; i < 3; ++i) {
+					auto &plane_difference = difference[i == 0 ? 0 : 1];
+					plane_difference = std::max(plane_difference, max_difference(scaled.planes[i], converted.planes[i]));
+				}
+			}
+			printf(" %6d %6d\n", difference[0], difference[1]);
+		}
+	}
+}
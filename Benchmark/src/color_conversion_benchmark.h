@@ -0,0 +1,5 @@
+#pragma once
+
+// Times the RGB to YUV420P converters of the plugin against sws_scale, the path they replace,
+// at 720p, 1080p and 4K for every source format.
+void run_color_conversion_benchmark(int frames);
@@ -0,0 +1,29 @@
+#include "broadcast_benchmark.h"
+#include "color_conversion_benchmark.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+constexpr int default_frames = 100;
+
+static void usage()
+{
+	printf("Benchmark [color|broadcast] [frames]\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char *benchmark = argc > 1 ? argv[1] : "color";
+	const auto frames = argc > 2 ? std::max(1, atoi(argv[2])) : default_frames;
+
+	if (strcmp(benchmark, "color") == 0) {
+		run_color_conversion_benchmark(frames);
+	} else if (strcmp(benchmark, "broadcast") == 0) {
+		run_broadcast_benchmark(frames);
+	} else {
+		usage();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
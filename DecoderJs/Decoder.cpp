@@ -2,6 +2,9 @@
 // Created by sebastien on 11/28/16.
 //
 #include "Decoder.h"
+#include "../ViewportServerPlugin/src/frame_header.h"
+
+#include <cstring>
 
 extern "C"
 {
@@ -29,6 +32,11 @@ Decoder::Decoder(CODEC codec)
     : _scaling_context(nullptr)
     , _has_frame(false)
     , _scaling_context_opened(false)
+    , _frame_number(0)
+    , _key_frame(false)
+    , _capture_time_ms(0)
+    , _encode_duration_ms(0)
+    , _send_time_us(0)
     , _decoded_frame(nullptr)
     , _decoded_frame_size(0)
 {
@@ -52,7 +60,23 @@ Decoder::~Decoder()
 
 void Decoder::decode(uintptr_t data, size_t length)
 {
-    parse_nal(reinterpret_cast<uint8_t*>(data), length);
+    uint8_t *bytes = reinterpret_cast<uint8_t*>(data);
+
+    FrameHeader header;
+    if (length >= sizeof(header)) {
+        memcpy(&header, bytes, sizeof(header));
+        if (header.magic == FRAME_HEADER_MAGIC && header.header_size <= length) {
+            _frame_number = header.frame_number;
+            _key_frame = (header.flags & FRAME_FLAG_KEY_FRAME) != 0;
+            _capture_time_ms = header.capture_time_us / 1000.0;
+            _encode_duration_ms = header.encode_duration_us / 1000.0;
+            _send_time_us = (double)header.send_time_us;
+            frame_decode(bytes + header.header_size, length - header.header_size);
+            return;
+        }
+    }
+
+    parse_nal(bytes, length);
 }
 
 void Decoder::parse_nal(uint8_t *data, size_t length)
@@ -25,8 +25,16 @@ public:
     Decoder(CODEC codec);
     ~Decoder();
 
+    // Framed access units (see frame_header.h) go straight to the decoder, anything else is scanned for NAL units.
     void decode(uintptr_t data, size_t length);
     bool get_hasFrame() const { return _has_frame; }
+    // Header of the last framed access unit.
+    unsigned get_frameNumber() const { return _frame_number; }
+    bool get_keyFrame() const { return _key_frame; }
+    double get_captureTime() const { return _capture_time_ms; }
+    double get_encodeDuration() const { return _encode_duration_ms; }
+    // Server clock, only meaningful echoed back to the server.
+    double get_sendTime() const { return _send_time_us; }
     emscripten::val get_frame() { return emscripten::val(emscripten::typed_memory_view(_decoded_frame_size, _decoded_frame)); }
 
     int get_width() const;
@@ -48,6 +56,12 @@ private:
     bool _has_frame;
     bool _scaling_context_opened;
 
+    unsigned _frame_number;
+    bool _key_frame;
+    double _capture_time_ms;
+    double _encode_duration_ms;
+    double _send_time_us;
+
     uint8_t *_decoded_frame;
     size_t _decoded_frame_size;
 };
@@ -17,6 +17,11 @@ EMSCRIPTEN_BINDINGS(decoder)
         .property("hasFrame", &Decoder::get_hasFrame)
         .property("width", &Decoder::get_width)
         .property("height", &Decoder::get_height)
+        .property("frameNumber", &Decoder::get_frameNumber)
+        .property("keyFrame", &Decoder::get_keyFrame)
+        .property("captureTime", &Decoder::get_captureTime)
+        .property("encodeDuration", &Decoder::get_encodeDuration)
+        .property("sendTime", &Decoder::get_sendTime)
         ;
 }
 
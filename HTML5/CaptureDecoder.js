@@ -0,0 +1,281 @@
+/*
+
+Decodes the frames of the captured modes of the viewport server, see viewport_client.h.
+
+usage:
+
+d = new CaptureDecoder();
+frame = d.decode(<binary>, mode); // null for malformed frames
+frame.width, frame.height, frame.bpp, frame.pixels
+
+The delta tile frames of STREAMED_COMPRESSED apply to the previous one, which the decoder keeps.
+After a malformed frame, frames are dropped until the next key frame.
+
+*/
+
+// universal module definition
+(function (root, factory) {
+    if (typeof define === 'function' && define.amd) {
+        define([], factory);
+    } else if (typeof exports === 'object') {
+        module.exports = factory();
+    } else {
+        root.CaptureDecoder = factory();
+    }
+}(this, function () {
+    "use strict";
+
+    var STREAMED_UNCOMPRESSED = 1;
+    var STREAMED_COMPRESSED = 2;
+    var STREAMED_COMPRESSED_LZ4 = 3;
+
+    // BinaryDataHeader, seven uint32.
+    var BINARY_DATA_HEADER_SIZE = 28;
+
+    // Same as BlockCompressor::stored_block_flag and delta_tiles::stored_tile_flag.
+    var STORED_FLAG = 0x80000000;
+    var KEY_FRAME_FLAG = 0x01;
+    var LZ4_MIN_MATCH = 4;
+
+    // LZ4 block format, as lz4_decompress_block. Returns the decompressed size, or -1 for
+    // malformed input or output larger than capacity.
+    function lz4DecompressBlock(source, start, end, destination, outputStart, capacity) {
+        var ip = start;
+        var op = outputStart;
+        var oend = outputStart + capacity;
+
+        var readLength = function (length) {
+            var b;
+            do {
+                if (ip >= end) {
+                    return -1;
+                }
+                b = source[ip++];
+                length += b;
+            } while (b === 255);
+            return length;
+        };
+
+        while (ip < end) {
+            var token = source[ip++];
+
+            var literalLength = token >> 4;
+            if (literalLength === 15 && (literalLength = readLength(literalLength)) < 0) {
+                return -1;
+            }
+            if (literalLength > end - ip || literalLength > oend - op) {
+                return -1;
+            }
+            destination.set(source.subarray(ip, ip + literalLength), op);
+            ip += literalLength;
+            op += literalLength;
+
+            // The last sequence has no match.
+            if (ip === end) {
+                break;
+            }
+
+            if (end - ip < 2) {
+                return -1;
+            }
+            var offset = source[ip] | (source[ip + 1] << 8);
+            ip += 2;
+            if (offset === 0 || offset > op - outputStart) {
+                return -1;
+            }
+
+            var matchLength = token & 15;
+            if (matchLength === 15 && (matchLength = readLength(matchLength)) < 0) {
+                return -1;
+            }
+            matchLength += LZ4_MIN_MATCH;
+            if (matchLength > oend - op) {
+                return -1;
+            }
+
+            // Overlapping matches repeat the bytes just written.
+            var match = op - offset;
+            if (offset >= matchLength) {
+                destination.copyWithin(op, match, match + matchLength);
+                op += matchLength;
+            } else {
+                for (var i = 0; i < matchLength; ++i) {
+                    destination[op++] = destination[match++];
+                }
+            }
+        }
+        return op - outputStart;
+    }
+
+    // Output of BlockCompressor::compress, into output. Returns false for malformed input.
+    function decompressBlocks(data, output) {
+        if (data.byteLength < 8) {
+            return false;
+        }
+        var view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+        var blockCount = view.getUint32(0, true);
+        var blockSize = view.getUint32(4, true);
+        var size = output.length;
+        if (blockSize === 0 || blockCount !== Math.ceil(size / blockSize)) {
+            return false;
+        }
+
+        var tableSize = (2 + blockCount) * 4;
+        if (data.byteLength < tableSize) {
+            return false;
+        }
+        var offset = tableSize;
+        for (var i = 0; i < blockCount; ++i) {
+            var block = view.getUint32(8 + i * 4, true);
+            var length = (block & ~STORED_FLAG) >>> 0;
+            var destination = i * blockSize;
+            var expected = Math.min(blockSize, size - destination);
+            if (length > data.byteLength - offset) {
+                return false;
+            }
+            if (block & STORED_FLAG) {
+                if (length !== expected) {
+                    return false;
+                }
+                output.set(data.subarray(offset, offset + length), destination);
+            } else if (lz4DecompressBlock(data, offset, offset + length, output, destination, expected) !== expected) {
+                return false;
+            }
+            offset += length;
+        }
+        return offset === data.byteLength;
+    }
+
+    // Frames of a DeltaTileEncoder, as DeltaTileDecoder::decode.
+    function DeltaTileDecoder() {
+        this.frame = null;
+        this.residual = null;
+        this.width = 0;
+        this.height = 0;
+        this.depth = 0;
+        this.valid = false;
+    }
+
+    DeltaTileDecoder.prototype.decode = function (data, width, height, depth) {
+        if (data.byteLength < 12 || width <= 0 || height <= 0 || depth <= 0) {
+            return false;
+        }
+        var view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+        var flags = view.getUint32(0, true);
+        var tileSize = view.getUint32(4, true);
+        if (tileSize === 0) {
+            return this.valid = false;
+        }
+        if (flags & KEY_FRAME_FLAG) {
+            this.width = width;
+            this.height = height;
+            this.depth = depth;
+            this.frame = new Uint8Array(width * height * depth);
+            this.residual = new Uint8Array(tileSize * tileSize * depth);
+            this.valid = true;
+        }
+        if (!this.valid || width !== this.width || height !== this.height || depth !== this.depth ||
+            this.residual.length !== tileSize * tileSize * depth) {
+            return this.valid = false;
+        }
+
+        var columns = Math.ceil(width / tileSize);
+        var tileCount = columns * Math.ceil(height / tileSize);
+        var changedTiles = view.getUint32(8, true);
+        var tableSize = (3 + 2 * changedTiles) * 4;
+        if (changedTiles > tileCount || tableSize > data.byteLength) {
+            return this.valid = false;
+        }
+
+        var stride = width * depth;
+        var offset = tableSize;
+        for (var i = 0; i < changedTiles; ++i) {
+            var index = view.getUint32(12 + i * 8, true);
+            var entry = view.getUint32(16 + i * 8, true);
+            var length = (entry & ~STORED_FLAG) >>> 0;
+            if (index >= tileCount || length > data.byteLength - offset) {
+                return this.valid = false;
+            }
+
+            var x = (index % columns) * tileSize;
+            var y = Math.floor(index / columns) * tileSize;
+            var rowBytes = Math.min(tileSize, width - x) * depth;
+            var rows = Math.min(tileSize, height - y);
+            var tileBytes = rowBytes * rows;
+            var residual = this.residual;
+            if (entry & STORED_FLAG) {
+                if (length !== tileBytes) {
+                    return this.valid = false;
+                }
+                residual = data.subarray(offset, offset + length);
+            } else if (lz4DecompressBlock(data, offset, offset + length, residual, 0, tileBytes) !== tileBytes) {
+                return this.valid = false;
+            }
+            offset += length;
+
+            var firstByte = y * stride + x * depth;
+            for (var row = 0; row < rows; ++row) {
+                var destination = firstByte + row * stride;
+                var source = row * rowBytes;
+                for (var b = 0; b < rowBytes; ++b) {
+                    this.frame[destination + b] ^= residual[source + b];
+                }
+            }
+        }
+        return this.valid = offset === data.byteLength;
+    };
+
+    function CaptureDecoder() {
+        this.deltaTiles = new DeltaTileDecoder();
+    }
+
+    CaptureDecoder.prototype.decode = function (data, mode) {
+        if (data.byteLength < BINARY_DATA_HEADER_SIZE) {
+            return null;
+        }
+        var view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+        var headerSize = view.getUint32(0, true);
+        var frame = {
+            width: view.getUint32(4, true),
+            height: view.getUint32(8, true),
+            bpp: view.getUint32(12, true),
+            pixels: null
+        };
+        var colorSize = view.getUint32(16, true);
+        var compressedSize = view.getUint32(20, true);
+        if (headerSize < BINARY_DATA_HEADER_SIZE || compressedSize > data.byteLength - headerSize ||
+            colorSize !== frame.width * frame.height * frame.bpp) {
+            return null;
+        }
+        var color = data.subarray(headerSize, headerSize + compressedSize);
+
+        switch (mode) {
+        case STREAMED_UNCOMPRESSED:
+            frame.pixels = color;
+            break;
+        case STREAMED_COMPRESSED:
+            if (!this.deltaTiles.decode(color, frame.width, frame.height, frame.bpp)) {
+                return null;
+            }
+            frame.pixels = this.deltaTiles.frame;
+            break;
+        case STREAMED_COMPRESSED_LZ4:
+            frame.pixels = new Uint8Array(colorSize);
+            if (!decompressBlocks(color, frame.pixels)) {
+                return null;
+            }
+            break;
+        default:
+            return null;
+        }
+        return frame;
+    };
+
+    CaptureDecoder.STREAMED_UNCOMPRESSED = STREAMED_UNCOMPRESSED;
+    CaptureDecoder.STREAMED_COMPRESSED = STREAMED_COMPRESSED;
+    CaptureDecoder.STREAMED_COMPRESSED_LZ4 = STREAMED_COMPRESSED_LZ4;
+    CaptureDecoder.lz4DecompressBlock = lz4DecompressBlock;
+    CaptureDecoder.decompressBlocks = decompressBlocks;
+    CaptureDecoder.DeltaTileDecoder = DeltaTileDecoder;
+    return CaptureDecoder;
+}));
@@ -145,19 +145,73 @@ var _utf8Decoder = new TextDecoder("utf-8");
 // look up the elements we want to affect
 var bwElement = document.getElementById("bandwidth");
 var dpsElement = document.getElementById("decode");
+var latencyElement = document.getElementById("latency");
 
 // Create text nodes to save some time for the browser.
 var bwNode = document.createTextNode("");
 var dpsNode = document.createTextNode("");
+var latencyNode = document.createTextNode("");
 
 // Add those text nodes where they need to go
 bwElement.appendChild(bwNode);
 dpsElement.appendChild(dpsNode);
+latencyElement.appendChild(latencyNode);
 
 var lastFrameTime = null;
 var startTime = null;
 var timesToDecode = [];
 var bufferLengths = [];
+
+// Header prefixed to every access unit by the viewport server, see frame_header.h.
+var FRAME_HEADER_MAGIC = 0x31465056;
+var FRAME_FLAG_KEY_FRAME = 0x01;
+function readFrameHeader(data) {
+    if (data.byteLength < 32) {
+        return null;
+    }
+    var view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+    if (view.getUint32(0, true) !== FRAME_HEADER_MAGIC) {
+        return null;
+    }
+    var headerSize = view.getUint16(4, true);
+    if (headerSize > data.byteLength) {
+        return null;
+    }
+    var readUint64 = function (offset) {
+        return view.getUint32(offset + 4, true) * 4294967296 + view.getUint32(offset, true);
+    };
+    var captureTimeUs = readUint64(24);
+    return {
+        headerSize: headerSize,
+        keyFrame: (view.getUint16(6, true) & FRAME_FLAG_KEY_FRAME) !== 0,
+        frameNumber: view.getUint32(8, true),
+        encodeDuration: view.getUint32(12, true) / 1000,
+        // Microseconds since the epoch, exact enough as a double for a latency in milliseconds.
+        captureTime: captureTimeUs / 1000,
+        // Echoed back as strings, both are exact below 2^53 microseconds.
+        captureTimeUs: captureTimeUs.toFixed(0),
+        sendTimeUs: headerSize >= 56 ? readUint64(32).toFixed(0) : null
+    };
+}
+
+// Tells the server when a frame was decoded and shown, relative to its reception.
+function sendFrameTiming(header, receivedAt, decodedAt) {
+    if (!header.sendTimeUs || _ws.readyState !== WebSocket.OPEN) {
+        return;
+    }
+    requestAnimationFrame(function () {
+        var presentedAt = performance.now();
+        _ws.send(JSON.stringify({
+            message: "frame_timing",
+            frame_number: header.frameNumber,
+            send_us: header.sendTimeUs,
+            capture_time_us: header.captureTimeUs,
+            decode_us: Math.round((decodedAt - receivedAt) * 1000),
+            present_us: Math.round((presentedAt - receivedAt) * 1000)
+        }));
+    });
+}
+
 function H264Player(){
     console.log('using', this);
     var p = new Player({
@@ -167,6 +221,13 @@ function H264Player(){
 
     p.onPictureDecoded = function (buffer, width, height, infos) {
         var now = Date.now();
+        var header = infos && infos.length ? infos[0] : null;
+        if (header && header.captureTime) {
+            latencyNode.nodeValue = (now - header.captureTime).toFixed(0);
+        }
+        if (header && header.receivedAt) {
+            sendFrameTiming(header, header.receivedAt, performance.now());
+        }
         if (startTime) {
             timesToDecode.push(now - startTime);
             if (timesToDecode.length > 10) {
@@ -187,7 +248,50 @@ function H264Player(){
     this.play = function(buffer){
         if (!startTime)
             startTime = Date.now();
-        parser.parse(buffer);
+        // Framed access units are complete, they skip the NAL scanning.
+        var header = readFrameHeader(buffer);
+        if (header) {
+            header.receivedAt = performance.now();
+            p.decode(buffer.subarray(header.headerSize), header);
+        } else {
+            parser.parse(buffer);
+        }
+    };
+}
+
+// Frames of the captured modes, drawn as they come.
+function CapturePlayer(mode) {
+    var decoder = new CaptureDecoder();
+    var canvas = document.createElement("canvas");
+    var context = canvas.getContext("2d");
+    var image = null;
+    document.body.appendChild(canvas);
+
+    this.play = function (buffer) {
+        var start = Date.now();
+        var frame = decoder.decode(buffer, mode);
+        if (!frame) {
+            console.log("Invalid frame for mode", mode);
+            return;
+        }
+        if (!image || image.width !== frame.width || image.height !== frame.height) {
+            canvas.width = frame.width;
+            canvas.height = frame.height;
+            image = context.createImageData(frame.width, frame.height);
+        }
+        if (frame.bpp === 4) {
+            image.data.set(frame.pixels);
+        } else {
+            var pixelCount = frame.width * frame.height;
+            for (var i = 0; i < pixelCount; ++i) {
+                for (var c = 0; c < 3; ++c) {
+                    image.data[i * 4 + c] = frame.pixels[i * frame.bpp + c];
+                }
+                image.data[i * 4 + 3] = 255;
+            }
+        }
+        context.putImageData(image, 0, 0);
+        dpsNode.nodeValue = (Date.now() - start).toFixed(0);
     };
 }
 
@@ -200,7 +304,9 @@ setInterval(function () {
     bwNode.nodeValue = (total / 1024).toFixed(0);
 }, 1000);
 
-var h264p = new H264Player();
+// A captured mode is requested with ?type=<CaptureMode>, see viewport_client.h.
+var captureMode = parseInt(new URLSearchParams(window.location.search).get("type"), 10) || 0;
+var player = captureMode ? new CapturePlayer(captureMode) : new H264Player();
 
 function nalParser(player){
     var bufferAr = [];
@@ -279,7 +385,7 @@ function onMessage(evt) {
         binaryData = new Uint8Array(evt.data);
         bufferLengths.push(binaryData.length);
         //avc.decode(binaryData);
-        h264p.play(binaryData);
+        player.play(binaryData);
     } else {
         message = JSON.parse(evt.data);
         console.log(JSON.stringify(evt.data));
@@ -302,7 +408,11 @@ var testWindowOpenCommand = "open";
 
 function onOpen() {
     console.log("onOpen");
-    _ws.send(testWindowOpenCommand);
+    if (captureMode) {
+        _ws.send(JSON.stringify({ id: 1, type: captureMode, handle: 1 }));
+    } else {
+        _ws.send(testWindowOpenCommand);
+    }
 }
 
 function onClose() {
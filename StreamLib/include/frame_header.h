@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+
+// Prefix of every websocket message carrying one encoded access unit, all fields little endian.
+// The magic never starts with a zero byte, clients can tell framed messages from a raw Annex-B stream.
+struct FrameHeader
+{
+	uint32_t magic;
+	uint16_t header_size;			// offset of the access unit in the message
+	uint16_t flags;
+	uint32_t frame_number;			// captured frames, gaps are frames that were skipped or dropped
+	uint32_t encode_duration_us;	// from the start of the color conversion to the encoded packet
+	int64_t pts;
+	int64_t capture_time_us;		// system clock, microseconds since the Unix epoch
+	// Server steady clock in microseconds when the message was queued, echoed back by clients
+	// with their decode and present times to measure the rest of the way.
+	int64_t send_time_us;
+	// Time spent by the frame in each stage on the server, in microseconds.
+	uint32_t queue_us;				// capture to the start of the color conversion
+	uint32_t conversion_us;
+	uint32_t encode_us;				// end of the conversion to the encoded packet
+	uint32_t mux_us;				// encoded packet to sending
+};
+
+constexpr uint32_t FRAME_HEADER_MAGIC = 0x31465056;	// "VPF1"
+constexpr uint16_t FRAME_FLAG_KEY_FRAME = 0x01;
+
+static_assert(sizeof(FrameHeader) == 56, "FrameHeader is part of the wire protocol");
@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct AVFrame;
+
+// Set of refcounted frames owned by a stream. A frame is handed out again once
+// the encoder released its reference, so image buffers are only allocated when
+// the pool is built or when every frame is still in use.
+class FramePool
+{
+public:
+	FramePool();
+	~FramePool();
+
+	bool init(int width, int height, int format, int size);
+	void release();
+
+	AVFrame* acquire();
+
+	bool initialized() const { return !_frames.empty(); }
+	int width() const { return _width; }
+	int height() const { return _height; }
+	int format() const { return _format; }
+
+	// Number of image buffers allocated since init. Stays constant in steady state.
+	int64_t allocations() const { return _allocations; }
+private:
+	AVFrame* allocate_frame();
+
+	std::vector<AVFrame*> _frames;
+	size_t _next;
+
+	int _width;
+	int _height;
+	int _format;
+	int64_t _allocations;
+};
@@ -4,7 +4,13 @@
 #include <atomic>
 #include <mutex>
 #include <vector>
+#include <chrono>
+#include <memory>
 #include <websocketpp/transport/base/connection.hpp>
+#include <websocketpp/message_buffer/message.hpp>
+#include <websocketpp/message_buffer/alloc.hpp>
+#include "frame_pool.h"
+#include "frame_header.h"
 
 struct AVFrame;
 struct SwsContext;
@@ -30,6 +36,24 @@ struct FrameInfo
 
 bool operator != (const StreamingInfo &lhs, const StreamingInfo rhs);
 
+// A joining connection is sent the last key frame, then skips the stream until the next one.
+struct JoinState
+{
+	std::atomic<bool> waiting_for_key_frame;
+	std::chrono::steady_clock::time_point joined;
+};
+
+struct StreamConnection
+{
+	websocketpp::connection_hdl hdl;
+	// RFC 6455 framing, the connection can be given a message prepared for every connection.
+	bool rfc6455;
+	std::shared_ptr<JoinState> join;
+};
+
+// Replaced as a whole when a connection opens or closes, senders keep using the list they loaded.
+using ConnectionList = std::vector<StreamConnection>;
+
 class Streamer
 {
 public:
@@ -49,9 +73,33 @@ public:
 
 	const StreamingInfo& streaming_info() const { return _streaming_info; }
 
+	// Number of image buffers allocated by the frame pool since the stream was opened.
+	int64_t frame_allocations() const { return _frame_pool.allocations(); }
+	// Time the last joining connection waited for its first live frame in milliseconds, -1 before one did.
+	int64_t time_to_first_frame_ms() const { return _time_to_first_frame_ms; }
+	// Number of connections the frames are broadcast to.
+	size_t connection_count() const { return std::atomic_load(&_connections)->size(); }
+
+	// Sends the packet as one framed access unit, see frame_header.h.
 	void send_frame_ws(AVPacket *pkt);
 	void send_packet_buffer(void* buffer, int size);
 private:
+	// Sends header then data to every connection as one message, framed once and queued by reference.
+	void broadcast(const void *header, size_t header_size, const void *data, size_t size, bool key_frame);
+	void add_connection(websocketpp::connection_hdl hdl, bool rfc6455);
+	void remove_connection(websocketpp::connection_hdl hdl);
+
+	static constexpr size_t timing_history_size = 8;
+
+	struct FrameTiming
+	{
+		int64_t pts;
+		uint32_t frame_number;
+		int64_t capture_time_us;
+		std::chrono::steady_clock::time_point encode_start;
+		std::chrono::steady_clock::time_point conversion_end;
+	};
+
 	bool initialize_codec_context(AVCodecContext *codec_context, AVStream *stream, int width, int height) const;
 	int encode_frame(AVFrame *frame, AVCodecContext *context);
 	void run_websocket_thread();
@@ -63,12 +111,26 @@ private:
 	AVFormatContext *_format_context;
 	AVStream *_video_stream;
 
+	AVFrame *_input_frame;
+	FramePool _frame_pool;
+
 	StreamingInfo _streaming_info;
 	bool _initialized;
 	bool _stream_opened;
 	int64_t _frame_counter;
+	// Raw H.264 is sent one access unit per message instead of through the muxer.
+	bool _framed_output;
+	FrameTiming _frame_timings[timing_history_size];
+	// Set when a connection joins, the next frame is encoded as an IDR frame. Joins before it is
+	// encoded share the same frame.
+	std::atomic<bool> _key_frame_requested;
+	std::atomic<int64_t> _time_to_first_frame_ms;
+	// Last IDR access unit with its in-band SPS and PPS, prepared for sending.
+	std::mutex _key_frame_mutex;
+	websocketpp::message_buffer::message<websocketpp::message_buffer::alloc::con_msg_manager>::ptr _key_frame_message;
 
 	std::thread *_ws_thread;
+	// Serializes the writers of _connections, readers only load the pointer.
 	std::mutex _connection_mutex;
-	std::vector<websocketpp::connection_hdl> _connections;
+	std::shared_ptr<const ConnectionList> _connections;
 };
\ No newline at end of file
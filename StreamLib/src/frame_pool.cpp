@@ -0,0 +1,88 @@
+#include "../include/frame_pool.h"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+FramePool::FramePool()
+	: _next(0)
+	, _width(0)
+	, _height(0)
+	, _format(-1)
+	, _allocations(0)
+{
+}
+
+FramePool::~FramePool()
+{
+	release();
+}
+
+bool FramePool::init(int width, int height, int format, int size)
+{
+	release();
+
+	_width = width;
+	_height = height;
+	_format = format;
+
+	for (auto i = 0; i < size; ++i) {
+		auto *frame = allocate_frame();
+		if (frame == nullptr) {
+			release();
+			return false;
+		}
+		_frames.push_back(frame);
+	}
+
+	return true;
+}
+
+void FramePool::release()
+{
+	for (auto *frame : _frames) {
+		av_frame_free(&frame);
+	}
+	_frames.clear();
+	_next = 0;
+	_allocations = 0;
+}
+
+AVFrame* FramePool::acquire()
+{
+	const auto count = _frames.size();
+	for (size_t i = 0; i < count; ++i) {
+		auto *frame = _frames[(_next + i) % count];
+		if (av_frame_is_writable(frame)) {
+			_next = (_next + i + 1) % count;
+			return frame;
+		}
+	}
+
+	// Every frame is still referenced downstream, grow the pool.
+	auto *frame = allocate_frame();
+	if (frame != nullptr) {
+		_frames.push_back(frame);
+	}
+	return frame;
+}
+
+AVFrame* FramePool::allocate_frame()
+{
+	auto *frame = av_frame_alloc();
+	if (frame == nullptr) {
+		return nullptr;
+	}
+
+	frame->format = _format;
+	frame->width = _width;
+	frame->height = _height;
+	if (av_frame_get_buffer(frame, 32) < 0) {
+		av_frame_free(&frame);
+		return nullptr;
+	}
+
+	++_allocations;
+	return frame;
+}
@@ -12,6 +12,7 @@ extern "C"
 }
 
 #include <iostream>
+#include <cstring>
 
 using critical_section_holder = std::lock_guard<std::mutex>;
 using server = websocketpp::server<websocketpp::config::asio>;
@@ -22,6 +23,7 @@ constexpr short server_port = 54321;
 
 unsigned char *io_buffer = nullptr;
 constexpr int io_buffer_size = 4 * 1024;
+constexpr int frame_pool_size = 3;
 
 server serv;
 
@@ -65,10 +67,15 @@ Streamer::Streamer()
 	, _codec(nullptr)
 	, _format_context(nullptr)
 	, _video_stream(nullptr)
+	, _input_frame(nullptr)
 	, _initialized(false)
 	, _stream_opened(false)
 	, _frame_counter(0)
+	, _framed_output(false)
+	, _key_frame_requested(false)
+	, _time_to_first_frame_ms(-1)
 	, _ws_thread(nullptr)
+	, _connections(std::make_shared<ConnectionList>())
 {
 }
 
@@ -130,6 +137,11 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 		return false;
 	}
 
+	_framed_output = strcmp(_format_context->oformat->name, "h264") == 0;
+	for (auto &timing : _frame_timings) {
+		timing.pts = AV_NOPTS_VALUE;
+	}
+
 	_video_stream = avformat_new_stream(_format_context, _codec);
 	if (_video_stream == nullptr) {
 		std::cout << "Failed to open video stream for " << path << " with format " << format << std::endl;
@@ -173,6 +185,22 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 		return false;
 	}
 
+	_input_frame = av_frame_alloc();
+	if (_input_frame == nullptr || !_frame_pool.init(codec_context->width, codec_context->height, AV_PIX_FMT_YUV420P, frame_pool_size)) {
+		std::cout << "Failed to allocate frame pool" << std::endl;
+		av_frame_free(&_input_frame);
+		_frame_pool.release();
+		sws_freeContext(_scale_context);
+		_scale_context = nullptr;
+		av_free(_format_context->pb);
+		av_free(io_buffer);
+		io_buffer = nullptr;
+		avcodec_close(_video_stream->codec);
+		avformat_free_context(_format_context);
+		_format_context = nullptr;
+		return false;
+	}
+
 #ifdef WRITE_FILE
 	fopen_s(&test_file, "zeVideo.mp4", "wb");
 #endif
@@ -203,49 +231,46 @@ void Streamer::close_stream()
 		sws_freeContext(_scale_context);
 		_scale_context = nullptr;
 	}
+
+	av_frame_free(&_input_frame);
+	_frame_pool.release();
 }
 
 void Streamer::stream_frame(const uint8_t* frame, int width, int height, short depth)
 {
-	if (_connections.size() == 0) {
+	if (std::atomic_load(&_connections)->empty()) {
 		return;
 	}
 
-	AVFrame* inpic = av_frame_alloc(); // mandatory frame allocation
-
 	auto input_format = depth == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA;
-	inpic->format = input_format;
-	inpic->width = _video_stream->codec->width;
-	inpic->height = _video_stream->codec->height;
-	auto success = av_image_fill_arrays(inpic->data, inpic->linesize, frame, input_format, width, height, 32);
+	_input_frame->format = input_format;
+	_input_frame->width = width;
+	_input_frame->height = height;
+	auto success = av_image_fill_arrays(_input_frame->data, _input_frame->linesize, frame, input_format, width, height, 32);
 	if (success < 0) {
 		std::cout << "Error transforming data into frame" << std::endl;
-		av_frame_free(&inpic);
 		return;
 	}
 
-	AVFrame* outpic = av_frame_alloc();
-	outpic->format = AV_PIX_FMT_YUV420P;
-	outpic->width = _video_stream->codec->width;
-	outpic->height = _video_stream->codec->height;
-	//outpic->pts = (int64_t)((float)i * (1000.0 / ((float)(_codec_context->time_base.den))) * 90);                              // setting frame pts
-	//outpic->pts = av_frame_get_best_effort_timestamp(outpic);
-	outpic->pts = _frame_counter++;
-	success = av_image_alloc(outpic->data, outpic->linesize, _video_stream->codec->width, _video_stream->codec->height, _video_stream->codec->pix_fmt, 32);
-	if (success < 0) {
+	// Frames come back to the pool once the encoder is done with them.
+	auto *outpic = _frame_pool.acquire();
+	if (outpic == nullptr) {
 		std::cout << "Error allocating new frame" << std::endl;
-		av_frame_free(&inpic);
-		av_frame_free(&outpic);
 		return;
 	}
+	outpic->pts = _frame_counter++;
+	outpic->pict_type = _key_frame_requested.exchange(false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 
-	sws_scale(_scale_context, inpic->data, inpic->linesize, 0, height, outpic->data, outpic->linesize);          // converting frame size and format
+	auto &timing = _frame_timings[outpic->pts % timing_history_size];
+	timing.pts = outpic->pts;
+	timing.frame_number = (uint32_t)outpic->pts;
+	timing.capture_time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	timing.encode_start = std::chrono::steady_clock::now();
 
-	encode_frame(outpic, _video_stream->codec);
+	sws_scale(_scale_context, _input_frame->data, _input_frame->linesize, 0, height, outpic->data, outpic->linesize);          // converting frame size and format
+	timing.conversion_end = std::chrono::steady_clock::now();
 
-	av_freep(&outpic->data[0]);
-	av_frame_free(&inpic);
-	av_frame_free(&outpic);
+	encode_frame(outpic, _video_stream->codec);
 }
 
 bool Streamer::initialize_codec_context(AVCodecContext* codec_context, AVStream *stream, int width, int height) const
@@ -290,6 +315,8 @@ bool Streamer::initialize_codec_context(AVCodecContext* codec_context, AVStream
 	av_dict_set(&dict, "profile", "baseline", 0);
 	av_dict_set(&dict, "level", "3.0", 0);
 	av_dict_set(&dict, "tune", "zerolatency", 0);
+	// Frames forced to I for joining connections must be IDR frames to start decoding on.
+	av_dict_set(&dict, "forced-idr", "1", 0);
 	//av_dict_set(&dict, "movflags", "frag_keyframe+empty_moov+default_base_moof+faststart+dash", 0);
 
 	if (avcodec_open2(codec_context, _codec, &dict) < 0) {
@@ -313,7 +340,11 @@ int Streamer::encode_frame(AVFrame *frame, AVCodecContext *context)
 		std::cout << "Error encoding frame" << std::endl;
 	}
 
-	if (got_packet != 0) {
+	if (got_packet != 0 && _framed_output) {
+		send_frame_ws(&packet);
+		av_packet_unref(&packet);
+	}
+	else if (got_packet != 0) {
 		success = write_frame(_format_context, &_video_stream->time_base, _video_stream, &packet);
 		if (success < 0) {
 			std::cout << "Error streaming frame" << std::endl;
@@ -326,21 +357,6 @@ int Streamer::encode_frame(AVFrame *frame, AVCodecContext *context)
 
 void Streamer::run_websocket_thread()
 {
-	auto hdl_equal = [](websocketpp::connection_hdl u, websocketpp::connection_hdl t) -> auto {
-		return !t.owner_before(u) && !u.owner_before(t);
-	};
-
-	auto remove_connection = [this, &hdl_equal](websocketpp::connection_hdl hdl)
-	{
-		critical_section_holder csh(_connection_mutex);
-		for (auto it = _connections.begin(), end = _connections.end(); it != end; ++it) {
-			if (hdl_equal(hdl, *it)) {
-				_connections.erase(it);
-				break;
-			}
-		}
-	};
-
 	try {
 		// Set logging settings
 		serv.set_access_channels(websocketpp::log::alevel::none);
@@ -362,8 +378,9 @@ void Streamer::run_websocket_thread()
 
 				auto request = msg->get_payload();
 				if (request == "open") {
-					critical_section_holder csh(_connection_mutex);
-					_connections.push_back(hdl);
+					// hybi00 clients do not send a version, later drafts frame data like RFC 6455.
+					auto con = serv.get_con_from_hdl(hdl);
+					add_connection(hdl, !con->get_request_header("Sec-WebSocket-Version").empty());
 				}
 			}
 			else if (opcode == websocketpp::frame::opcode::BINARY) {
@@ -383,13 +400,13 @@ void Streamer::run_websocket_thread()
 			con->set_body(ss.str());
 			con->set_status(websocketpp::http::status_code::ok);
 		});
-		serv.set_fail_handler([&remove_connection](websocketpp::connection_hdl hdl)
+		serv.set_fail_handler([this](websocketpp::connection_hdl hdl)
 		{
 			server::connection_ptr con = serv.get_con_from_hdl(hdl);
 			std::cout << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
 			remove_connection(hdl);
 		});
-		serv.set_close_handler([&remove_connection](websocketpp::connection_hdl hdl)
+		serv.set_close_handler([this](websocketpp::connection_hdl hdl)
 		{
 			std::cout << "Close handler" << std::endl;
 			remove_connection(hdl);
@@ -422,16 +439,126 @@ void Streamer::run_websocket_thread()
 
 void Streamer::send_frame_ws(AVPacket *pkt)
 {
-	send_packet_buffer(pkt->data, pkt->size);
+	FrameHeader header = {};
+	header.magic = FRAME_HEADER_MAGIC;
+	header.header_size = sizeof(FrameHeader);
+	header.flags = (pkt->flags & AV_PKT_FLAG_KEY) ? FRAME_FLAG_KEY_FRAME : 0;
+	header.pts = pkt->pts;
+	const auto *timing = pkt->pts >= 0 ? &_frame_timings[pkt->pts % timing_history_size] : nullptr;
+	const auto now = std::chrono::steady_clock::now();
+	auto microseconds = [](std::chrono::steady_clock::duration duration) { return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); };
+	if (timing != nullptr && timing->pts == pkt->pts) {
+		header.frame_number = timing->frame_number;
+		header.capture_time_us = timing->capture_time_us;
+		header.encode_duration_us = microseconds(now - timing->encode_start);
+		header.conversion_us = microseconds(timing->conversion_end - timing->encode_start);
+		header.encode_us = microseconds(now - timing->conversion_end);
+	}
+	// Frames are converted as they are captured and sent as they are encoded, queue_us and mux_us stay 0.
+	header.send_time_us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+
+	broadcast(&header, sizeof(header), pkt->data, pkt->size, (header.flags & FRAME_FLAG_KEY_FRAME) != 0);
 }
 
 void Streamer::send_packet_buffer(void* buffer, int size)
 {
+	// Muxed output has no access unit boundaries, joining connections take it as it comes.
+	broadcast(nullptr, 0, buffer, size, true);
+}
+
+void Streamer::broadcast(const void *header, size_t header_size, const void *data, size_t size, bool key_frame)
+{
+	auto connections = std::atomic_load(&_connections);
+	if (connections->empty())
+		return;
+
+	// Server frames are not masked, the same prepared frame is valid on every RFC 6455 connection
+	// and websocketpp queues prepared messages as they are instead of copying them.
+	const auto payload_size = header_size + size;
+	auto msg = websocketpp::lib::make_shared<websocketpp::config::asio::message_type>(nullptr, websocketpp::frame::opcode::BINARY, payload_size);
+	msg->append_payload(header, header_size);
+	msg->append_payload(data, size);
+	websocketpp::frame::basic_header basic_header(websocketpp::frame::opcode::BINARY, payload_size, true, false, false);
+	websocketpp::frame::extended_header extended_header(payload_size);
+	msg->set_header(websocketpp::frame::prepare_header(basic_header, extended_header));
+	msg->set_prepared(true);
+
+	if (key_frame && _framed_output) {
+		critical_section_holder csh(_key_frame_mutex);
+		_key_frame_message = msg;
+	}
+
+	// Queued to every connection from the websocket thread, the encoder thread only pays for one post
+	// whatever the number of connections.
+	serv.get_io_service().post([this, connections, msg, payload_size, key_frame]()
+	{
+		for (const auto &connection : *connections) {
+			auto &join = *connection.join;
+			if (join.waiting_for_key_frame) {
+				if (!key_frame)
+					continue;
+				join.waiting_for_key_frame = false;
+				auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - join.joined);
+				_time_to_first_frame_ms = elapsed.count();
+			}
+
+			websocketpp::lib::error_code ec;
+			auto con = serv.get_con_from_hdl(connection.hdl, ec);
+			if (ec)
+				continue;
+			if (connection.rfc6455) {
+				con->send(msg);
+			} else {
+				con->send(msg->get_payload().data(), payload_size, websocketpp::frame::opcode::BINARY);
+			}
+		}
+	});
+}
+
+void Streamer::add_connection(websocketpp::connection_hdl hdl, bool rfc6455)
+{
+	auto join = std::make_shared<JoinState>();
+	join->waiting_for_key_frame = true;
+	join->joined = std::chrono::steady_clock::now();
+
+	// The cached key frame shows the stream at once, the connection then waits for the IDR frame
+	// requested here as it did not receive the frames following the cached one.
+	{
+		critical_section_holder csh(_key_frame_mutex);
+		websocketpp::lib::error_code ec;
+		auto con = serv.get_con_from_hdl(hdl, ec);
+		if (_key_frame_message != nullptr && !ec) {
+			if (rfc6455) {
+				con->send(_key_frame_message);
+			} else {
+				con->send(_key_frame_message->get_payload(), websocketpp::frame::opcode::BINARY);
+			}
+		}
+	}
+
 	critical_section_holder csh(_connection_mutex);
-	for (auto h : _connections) {
-		//std::cout << "sending packet of size " << size << std::endl;
-		serv.send(h, buffer, size, websocketpp::frame::opcode::BINARY);
+	auto connections = std::make_shared<ConnectionList>(*_connections);
+	connections->push_back({ hdl, rfc6455, join });
+	std::atomic_store(&_connections, std::shared_ptr<const ConnectionList>(connections));
+	// Requested once the connection is listed, so the IDR frame cannot be sent before it joins.
+	_key_frame_requested = true;
+}
+
+void Streamer::remove_connection(websocketpp::connection_hdl hdl)
+{
+	auto hdl_equal = [](websocketpp::connection_hdl u, websocketpp::connection_hdl t) {
+		return !t.owner_before(u) && !u.owner_before(t);
+	};
+
+	critical_section_holder csh(_connection_mutex);
+	auto connections = std::make_shared<ConnectionList>(*_connections);
+	for (auto it = connections->begin(), end = connections->end(); it != end; ++it) {
+		if (hdl_equal(hdl, it->hdl)) {
+			connections->erase(it);
+			break;
+		}
 	}
+	std::atomic_store(&_connections, std::shared_ptr<const ConnectionList>(connections));
 }
 
 
@@ -0,0 +1,190 @@
+#include "asset_cache.h"
+#include "gzip.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+namespace {
+	// Compressed variants are only kept when they save at least this share of the file.
+	constexpr double min_gzip_saving = 0.1;
+
+	std::string lower(std::string value)
+	{
+		std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return (char)tolower(c); });
+		return value;
+	}
+
+	std::string trim(const std::string &value)
+	{
+		auto begin = value.find_first_not_of(" \t");
+		if (begin == std::string::npos)
+			return std::string();
+		auto end = value.find_last_not_of(" \t");
+		return value.substr(begin, end - begin + 1);
+	}
+
+	std::vector<std::string> split(const std::string &value, char separator)
+	{
+		std::vector<std::string> items;
+		std::stringstream ss(value);
+		std::string item;
+		while (std::getline(ss, item, separator)) {
+			items.push_back(trim(item));
+		}
+		return items;
+	}
+
+	// Content type and whether the content is worth compressing.
+	std::pair<const char*, bool> content_type(const std::string &name)
+	{
+		auto dot = name.find_last_of('.');
+		auto extension = dot == std::string::npos ? std::string() : lower(name.substr(dot + 1));
+		if (extension == "html")
+			return { "text/html; charset=utf-8", true };
+		if (extension == "js")
+			return { "application/javascript", true };
+		if (extension == "css")
+			return { "text/css", true };
+		if (extension == "json")
+			return { "application/json", true };
+		if (extension == "png")
+			return { "image/png", false };
+		if (extension == "jpg" || extension == "jpeg")
+			return { "image/jpeg", false };
+		if (extension == "mp4")
+			return { "video/mp4", false };
+		// Emscripten memory images and the shaders.
+		if (extension == "mem")
+			return { "application/octet-stream", true };
+		return { "text/plain", true };
+	}
+
+	std::string make_etag(const std::string &data, const char *suffix)
+	{
+		char etag[48];
+		snprintf(etag, sizeof(etag), "\"%08x-%zx%s\"", crc32((const uint8_t*)data.data(), data.size()), data.size(), suffix);
+		return etag;
+	}
+
+	std::vector<std::string> list_files(const std::string &directory)
+	{
+		std::vector<std::string> names;
+#ifdef _WIN32
+		WIN32_FIND_DATAA data;
+		auto find = FindFirstFileA((directory + "\\*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE)
+			return names;
+		do {
+			if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+				names.push_back(data.cFileName);
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+#else
+		auto *dir = opendir(directory.c_str());
+		if (dir == nullptr)
+			return names;
+		while (auto *entry = readdir(dir)) {
+			if (entry->d_type == DT_REG)
+				names.push_back(entry->d_name);
+		}
+		closedir(dir);
+#endif
+		return names;
+	}
+}
+
+AssetCache::AssetCache()
+	: _bytes(0)
+	, _gzip_bytes(0)
+{
+}
+
+int AssetCache::load(const std::string &directory)
+{
+	auto loaded = 0;
+	for (const auto &name : list_files(directory)) {
+		if (load_file(directory, name))
+			++loaded;
+	}
+	return loaded;
+}
+
+bool AssetCache::load_file(const std::string &directory, const std::string &name)
+{
+	std::ifstream file(directory + "/" + name, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Could not load asset " << name << std::endl;
+		return false;
+	}
+
+	std::stringstream ss;
+	ss << file.rdbuf();
+
+	Asset asset;
+	auto type = content_type(name);
+	asset.content_type = type.first;
+	asset.data = ss.str();
+	asset.etag = make_etag(asset.data, "");
+	if (type.second && !asset.data.empty()) {
+		auto compressed = gzip_compress(asset.data);
+		if (compressed.size() <= asset.data.size() * (1.0 - min_gzip_saving)) {
+			asset.gzip_data.swap(compressed);
+			asset.gzip_etag = make_etag(asset.data, "-gzip");
+		}
+	}
+
+	_bytes += asset.data.size();
+	_gzip_bytes += asset.gzip_data.size();
+	_assets[lower(name)] = std::move(asset);
+	return true;
+}
+
+const AssetCache::Asset* AssetCache::find(const std::string &path) const
+{
+	auto begin = path.find_first_not_of('/');
+	auto name = begin == std::string::npos ? std::string() : path.substr(begin);
+	auto query = name.find('?');
+	if (query != std::string::npos)
+		name.resize(query);
+	if (name.empty())
+		name = default_page;
+
+	auto it = _assets.find(lower(name));
+	return it == _assets.end() ? nullptr : &it->second;
+}
+
+bool AssetCache::matches(const std::string &if_none_match, const std::string &etag)
+{
+	for (auto &tag : split(if_none_match, ',')) {
+		// Weak comparison, as required for If-None-Match.
+		if (tag == "*" || (tag.compare(0, 2, "W/") == 0 ? tag.substr(2) : tag) == etag)
+			return true;
+	}
+	return false;
+}
+
+bool AssetCache::accepts_gzip(const std::string &accept_encoding)
+{
+	for (auto &coding : split(accept_encoding, ',')) {
+		auto parameters = coding.find(';');
+		auto name = lower(trim(coding.substr(0, parameters)));
+		if (name != "gzip" && name != "*")
+			continue;
+
+		auto q = parameters == std::string::npos ? std::string::npos : coding.find("q=", parameters);
+		return q == std::string::npos || atof(coding.c_str() + q + 2) > 0.0;
+	}
+	return false;
+}
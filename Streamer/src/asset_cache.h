@@ -0,0 +1,45 @@
+#pragma once
+#include <map>
+#include <string>
+
+// Files of the viewer page preloaded in memory, with their ETag and gzip variant computed once.
+// Only read once loaded, so requests are served from any thread without a lock.
+class AssetCache
+{
+public:
+	AssetCache();
+
+	struct Asset
+	{
+		std::string content_type;
+		std::string data;
+		std::string etag;
+		// Empty when compression does not pay off for the content type or the file.
+		std::string gzip_data;
+		std::string gzip_etag;
+	};
+
+	// Loads the files of the directory, not its subdirectories. Returns the number of files loaded.
+	int load(const std::string &directory);
+
+	// The asset of a request path such as "/test2.html", "/" is the default page. Names are not
+	// case sensitive, as with the file server the page was served by on Windows.
+	const Asset* find(const std::string &path) const;
+
+	size_t size() const { return _assets.size(); }
+	size_t bytes() const { return _bytes; }
+	size_t gzip_bytes() const { return _gzip_bytes; }
+
+	// True when the If-None-Match header lists the ETag, or is "*".
+	static bool matches(const std::string &if_none_match, const std::string &etag);
+	// True when the Accept-Encoding header accepts gzip.
+	static bool accepts_gzip(const std::string &accept_encoding);
+private:
+	static constexpr const char *default_page = "test2.html";
+
+	bool load_file(const std::string &directory, const std::string &name);
+
+	std::map<std::string, Asset> _assets;
+	size_t _bytes;
+	size_t _gzip_bytes;
+};
@@ -0,0 +1,435 @@
+#include "cmaf_segmenter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+
+namespace {
+	// The SPS and PPS NAL units of an Annex-B access unit, each after a four byte start code.
+	std::string in_band_parameter_sets(const uint8_t *data, int size)
+	{
+		std::string parameter_sets;
+		auto begin = -1;
+		for (auto i = 0; i <= size; ++i) {
+			auto start_code = i + 2 < size && data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1;
+			if (!start_code && i < size)
+				continue;
+
+			if (begin >= 0) {
+				// The zero byte of a four byte start code belongs to the next NAL unit.
+				auto end = i;
+				while (end > begin && data[end - 1] == 0 && i < size)
+					--end;
+				auto type = end > begin ? data[begin] & 0x1f : 0;
+				if (type == 7 || type == 8) {
+					parameter_sets.append("\0\0\0\1", 4);
+					parameter_sets.append((const char*)data + begin, end - begin);
+				}
+			}
+			begin = i + 3;
+			i += 2;
+		}
+		return parameter_sets;
+	}
+
+	// Value of a query parameter, -1 when it is missing.
+	int64_t query_value(const std::string &query, const std::string &name)
+	{
+		auto position = query.find(name + "=");
+		while (position != std::string::npos && position != 0 && query[position - 1] != '&')
+			position = query.find(name + "=", position + 1);
+		if (position == std::string::npos)
+			return -1;
+		return atoll(query.c_str() + position + name.size() + 1);
+	}
+}
+
+CmafSegmenter::CmafSegmenter()
+	: _format_context(nullptr)
+	, _video_stream(nullptr)
+	, _init_version(0)
+	, _segment_open(false)
+	, _next_msn(0)
+	, _discontinuity_sequence(0)
+	, _discontinuity(false)
+	, _target_duration((int)std::ceil(segment_target_s))
+	, _part_ticks(0)
+	, _part_frames(0)
+	, _part_independent(false)
+{
+}
+
+CmafSegmenter::~CmafSegmenter()
+{
+	std::vector<PendingRequest> pending;
+	{
+		critical_section_holder csh(_mutex);
+		free_muxer();
+		pending.swap(_pending);
+	}
+	for (auto &request : pending) {
+		request.respond(404, "text/plain", "Stream closed");
+	}
+}
+
+void CmafSegmenter::write(const AVPacket *packet, const AVRational &time_base, const AVCodecContext *context)
+{
+	std::vector<HttpResponder> ready;
+	std::string body;
+	{
+		critical_section_holder csh(_mutex);
+		auto key_frame = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+		// The initialization segment needs the SPS and PPS of the first IDR frame.
+		if (_format_context == nullptr && (!key_frame || !open_muxer(packet, context)))
+			return;
+
+		// A segment starts on an IDR frame once the open one is long enough.
+		if (key_frame && (!_segment_open || _segments.back().duration + (double)_part_ticks / timescale >= segment_target_s)) {
+			flush_part();
+			close_segment();
+
+			Segment segment;
+			segment.msn = _next_msn++;
+			segment.duration = 0.0;
+			segment.discontinuity = _discontinuity;
+			_discontinuity = false;
+			_segments.push_back(std::move(segment));
+			_segment_open = true;
+			while (_segments.size() > window_segments + 1) {
+				if (_segments.front().discontinuity)
+					++_discontinuity_sequence;
+				_segments.pop_front();
+			}
+		}
+
+		AVPacket output;
+		av_init_packet(&output);
+		if (av_packet_ref(&output, packet) < 0)
+			return;
+
+		auto duration = std::max<int64_t>(packet->duration, 1);
+		auto dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+		output.pts = av_rescale_q(packet->pts, time_base, _video_stream->time_base);
+		output.dts = av_rescale_q(dts, time_base, _video_stream->time_base);
+		output.duration = av_rescale_q(duration, time_base, _video_stream->time_base);
+		// Parts may not be longer than the advertised target, the frame goes to the next one if it does not fit.
+		auto ticks = av_rescale_q(duration, time_base, AVRational{ 1, timescale });
+		if (_part_ticks + ticks > part_target_ticks)
+			flush_part();
+		output.stream_index = _video_stream->index;
+		auto result = av_write_frame(_format_context, &output);
+		av_packet_unref(&output);
+		if (result < 0) {
+			std::cout << "Could not write packet to the CMAF segment" << std::endl;
+			return;
+		}
+
+		if (_part_frames == 0)
+			_part_independent = key_frame;
+		++_part_frames;
+		_part_ticks += ticks;
+		// Published as soon as it is full, not with the next frame.
+		if (_part_ticks >= part_target_ticks)
+			flush_part();
+
+		take_ready_requests(ready, body);
+	}
+
+	for (auto &respond : ready) {
+		respond(200, playlist_content_type, body);
+	}
+}
+
+void CmafSegmenter::reset()
+{
+	critical_section_holder csh(_mutex);
+	free_muxer();
+	_output.clear();
+	_init_segment.clear();
+	for (auto &segment : _segments) {
+		if (segment.discontinuity)
+			++_discontinuity_sequence;
+	}
+	_segments.clear();
+	_segment_open = false;
+	_part_ticks = 0;
+	_part_frames = 0;
+	// Waiting requests stay, the segment numbers go on with the next stream.
+	_discontinuity = _next_msn > 0;
+}
+
+void CmafSegmenter::handle_request(const std::string &file, const std::string &query, HttpResponder respond)
+{
+	if (file.empty() || file == "index.m3u8") {
+		auto msn = query_value(query, "_HLS_msn");
+		auto part = (int)query_value(query, "_HLS_part");
+		std::string body;
+		{
+			critical_section_holder csh(_mutex);
+			// Players may only block on the next two segments.
+			auto last = _segments.empty() ? _next_msn : _segments.back().msn;
+			if (msn > last + 2) {
+				body.clear();
+			} else if (msn >= 0 && !available(msn, part)) {
+				_pending.push_back({ msn, part, std::chrono::steady_clock::now() + blocking_timeout(), respond });
+				return;
+			} else {
+				body = playlist();
+			}
+		}
+		if (body.empty())
+			respond(400, "text/plain", "_HLS_msn is too far ahead");
+		else
+			respond(200, playlist_content_type, body);
+		return;
+	}
+
+	std::string data;
+	auto found = false;
+	const char *content_type = "video/iso.segment";
+	{
+		critical_section_holder csh(_mutex);
+		if (file.compare(0, 4, "init") == 0) {
+			content_type = "video/mp4";
+			found = !_init_segment.empty() && file == "init" + std::to_string(_init_version) + ".mp4";
+			if (found)
+				data = _init_segment;
+		} else if (!_segments.empty()) {
+			// "<msn>.m4s" or "<msn>.<part>.m4s"
+			auto dot = file.find('.');
+			auto msn = atoll(file.c_str());
+			auto index = msn - _segments.front().msn;
+			if (dot != std::string::npos && dot > 0 && index >= 0 && index < (int64_t)_segments.size()) {
+				const auto &segment = _segments[(size_t)index];
+				auto complete = !(_segment_open && index + 1 == (int64_t)_segments.size());
+				if (file.compare(dot, std::string::npos, ".m4s") == 0) {
+					found = complete;
+					if (found)
+						data = segment.data;
+				} else {
+					auto part = atoi(file.c_str() + dot + 1);
+					auto extension = file.find('.', dot + 1);
+					found = extension != std::string::npos && file.compare(extension, std::string::npos, ".m4s") == 0 &&
+						part >= 0 && part < (int)segment.parts.size();
+					if (found)
+						data = segment.parts[part].data;
+				}
+			}
+		}
+	}
+
+	if (found)
+		respond(200, content_type, data);
+	else
+		respond(404, "text/plain", "Not found");
+}
+
+void CmafSegmenter::expire_requests()
+{
+	std::vector<HttpResponder> expired;
+	{
+		critical_section_holder csh(_mutex);
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = _pending.begin(); it != _pending.end();) {
+			if (it->deadline <= now) {
+				expired.push_back(std::move(it->respond));
+				it = _pending.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	for (auto &respond : expired) {
+		respond(503, "text/plain", "Part not available");
+	}
+}
+
+std::chrono::milliseconds CmafSegmenter::blocking_timeout() const
+{
+	return std::chrono::milliseconds(3000 * _target_duration);
+}
+
+bool CmafSegmenter::open_muxer(const AVPacket *packet, const AVCodecContext *context)
+{
+	auto parameter_sets = in_band_parameter_sets(packet->data, packet->size);
+	if (parameter_sets.empty() && context->extradata_size > 0)
+		parameter_sets.assign((const char*)context->extradata, context->extradata_size);
+	if (parameter_sets.empty())
+		return false;
+
+	avformat_alloc_output_context2(&_format_context, nullptr, "mp4", nullptr);
+	if (_format_context == nullptr) {
+		std::cout << "Failed to allocate format context with format mp4" << std::endl;
+		return false;
+	}
+
+	_video_stream = avformat_new_stream(_format_context, nullptr);
+	auto *io_buffer = (unsigned char*)av_malloc(io_buffer_size);
+	if (_video_stream == nullptr || io_buffer == nullptr || avcodec_parameters_from_context(_video_stream->codecpar, context) < 0) {
+		std::cout << "Failed to open the video stream of the CMAF segments" << std::endl;
+		av_free(io_buffer);
+		free_muxer();
+		return false;
+	}
+
+	auto *codecpar = _video_stream->codecpar;
+	av_freep(&codecpar->extradata);
+	codecpar->extradata_size = 0;
+	codecpar->extradata = (uint8_t*)av_mallocz(parameter_sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (codecpar->extradata != nullptr) {
+		memcpy(codecpar->extradata, parameter_sets.data(), parameter_sets.size());
+		codecpar->extradata_size = (int)parameter_sets.size();
+	}
+	_video_stream->time_base = AVRational{ 1, timescale };
+
+	_format_context->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, (void*)this, nullptr, [](void *opaque, uint8_t *buf, int buf_size)
+	{
+		auto self = static_cast<CmafSegmenter*>(opaque);
+		self->_output.append((const char*)buf, buf_size);
+		return buf_size;
+	}, nullptr);
+	if (_format_context->pb == nullptr) {
+		std::cout << "Could not open the output of the CMAF segments" << std::endl;
+		av_free(io_buffer);
+		free_muxer();
+		return false;
+	}
+
+	// Fragments are only cut by flush_part, each one is a part of the playlist.
+	AVDictionary *options = nullptr;
+	av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+	auto result = avformat_write_header(_format_context, &options);
+	av_dict_free(&options);
+	if (result < 0) {
+		std::cout << "Could not write the CMAF initialization segment" << std::endl;
+		free_muxer();
+		return false;
+	}
+	avio_flush(_format_context->pb);
+
+	_init_segment.swap(_output);
+	_output.clear();
+	++_init_version;
+	return true;
+}
+
+void CmafSegmenter::free_muxer()
+{
+	if (_format_context == nullptr)
+		return;
+
+	if (_format_context->pb != nullptr) {
+		av_freep(&_format_context->pb->buffer);
+		av_freep(&_format_context->pb);
+	}
+	avformat_free_context(_format_context);
+	_format_context = nullptr;
+	_video_stream = nullptr;
+}
+
+void CmafSegmenter::flush_part()
+{
+	if (_part_frames == 0 || !_segment_open)
+		return;
+
+	// A null packet makes the muxer write the pending samples as one fragment.
+	av_write_frame(_format_context, nullptr);
+	avio_flush(_format_context->pb);
+
+	auto &segment = _segments.back();
+	Part part;
+	part.data.swap(_output);
+	part.duration = (double)_part_ticks / timescale;
+	part.independent = _part_independent;
+	segment.duration += part.duration;
+	segment.parts.push_back(std::move(part));
+	_output.clear();
+	_part_ticks = 0;
+	_part_frames = 0;
+}
+
+void CmafSegmenter::close_segment()
+{
+	if (!_segment_open)
+		return;
+
+	auto &segment = _segments.back();
+	for (const auto &part : segment.parts) {
+		segment.data += part.data;
+	}
+	_target_duration = std::max(_target_duration.load(), (int)std::ceil(segment.duration));
+	_segment_open = false;
+
+	// Only the last segments are listed with their parts.
+	if (_segments.size() > part_segments) {
+		auto &old = _segments[_segments.size() - part_segments - 1];
+		old.parts.clear();
+		old.parts.shrink_to_fit();
+	}
+}
+
+bool CmafSegmenter::available(int64_t msn, int part) const
+{
+	if (_segments.empty())
+		return false;
+
+	const auto &last = _segments.back();
+	auto complete_end = _segment_open ? last.msn : last.msn + 1;
+	if (msn < complete_end)
+		return true;
+	return part >= 0 && _segment_open && msn == last.msn && part < (int)last.parts.size();
+}
+
+std::string CmafSegmenter::playlist() const
+{
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(3)
+		<< "#EXTM3U\n"
+		<< "#EXT-X-VERSION:9\n"
+		<< "#EXT-X-TARGETDURATION:" << _target_duration << "\n"
+		<< "#EXT-X-PART-INF:PART-TARGET=" << part_target_s << "\n"
+		<< "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" << 3 * part_target_s << "\n"
+		<< "#EXT-X-MEDIA-SEQUENCE:" << (_segments.empty() ? _next_msn : _segments.front().msn) << "\n"
+		<< "#EXT-X-DISCONTINUITY-SEQUENCE:" << _discontinuity_sequence << "\n";
+	if (!_init_segment.empty())
+		ss << "#EXT-X-MAP:URI=\"init" << _init_version << ".mp4\"\n";
+
+	for (size_t s = 0; s < _segments.size(); ++s) {
+		const auto &segment = _segments[s];
+		if (segment.discontinuity)
+			ss << "#EXT-X-DISCONTINUITY\n";
+		for (size_t p = 0; p < segment.parts.size(); ++p) {
+			ss << "#EXT-X-PART:DURATION=" << segment.parts[p].duration
+				<< ",URI=\"" << segment.msn << "." << p << ".m4s\""
+				<< (segment.parts[p].independent ? ",INDEPENDENT=YES" : "") << "\n";
+		}
+		if (!_segment_open || s + 1 < _segments.size())
+			ss << "#EXTINF:" << segment.duration << ",\n" << segment.msn << ".m4s\n";
+	}
+	return ss.str();
+}
+
+void CmafSegmenter::take_ready_requests(std::vector<HttpResponder> &ready, std::string &body)
+{
+	for (auto it = _pending.begin(); it != _pending.end();) {
+		if (available(it->msn, it->part)) {
+			ready.push_back(std::move(it->respond));
+			it = _pending.erase(it);
+		} else {
+			++it;
+		}
+	}
+	if (!ready.empty())
+		body = playlist();
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+struct AVPacket;
+struct AVRational;
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVStream;
+
+// Answers an HTTP request, may be called from any thread.
+using HttpResponder = std::function<void(int status, const std::string &content_type, const std::string &body)>;
+
+// Low-latency HLS of one stream, served from memory. The encoded packets are muxed to CMAF fragments,
+// each fragment is a part of the playlist and the parts between two IDR frames make a segment.
+// A sliding window of segments is kept, older segments are dropped without touching the disk.
+class CmafSegmenter
+{
+public:
+	static constexpr const char *playlist_content_type = "application/vnd.apple.mpegurl";
+
+	CmafSegmenter();
+	~CmafSegmenter();
+
+	// Called by the encoder with every packet, time_base is the time base of its timestamps.
+	void write(const AVPacket *packet, const AVRational &time_base, const AVCodecContext *context);
+	// The stream was closed, the next one starts with a new initialization segment.
+	// Segment numbers go on, players only see a discontinuity.
+	void reset();
+
+	// Serves "index.m3u8", "init.mp4", "<msn>.m4s" and "<msn>.<part>.m4s". Playlist requests blocking on
+	// a part not published yet (_HLS_msn and _HLS_part) are answered when it is, or by expire_requests.
+	void handle_request(const std::string &file, const std::string &query, HttpResponder respond);
+	// Answers the blocking requests that waited for longer than three target durations.
+	void expire_requests();
+	// Time after which expire_requests answers a blocking request.
+	std::chrono::milliseconds blocking_timeout() const;
+private:
+	static constexpr double part_target_s = 0.2;
+	// Time scale of the muxed stream, parts are measured in its ticks so that they add up exactly.
+	static constexpr int timescale = 90000;
+	static constexpr int64_t part_target_ticks = (int64_t)(part_target_s * timescale);
+	static constexpr double segment_target_s = 2.0;
+	static constexpr size_t window_segments = 6;
+	// Complete segments whose parts are still listed, older ones are only served whole.
+	static constexpr size_t part_segments = 2;
+	static constexpr int io_buffer_size = 64 * 1024;
+
+	struct Part
+	{
+		std::string data;
+		double duration;
+		bool independent;
+	};
+
+	struct Segment
+	{
+		int64_t msn;
+		std::vector<Part> parts;
+		// Concatenated parts, once the segment is complete.
+		std::string data;
+		double duration;
+		bool discontinuity;
+	};
+
+	struct PendingRequest
+	{
+		int64_t msn;
+		int part;
+		std::chrono::steady_clock::time_point deadline;
+		HttpResponder respond;
+	};
+
+	bool open_muxer(const AVPacket *packet, const AVCodecContext *context);
+	void free_muxer();
+	void flush_part();
+	void close_segment();
+	bool available(int64_t msn, int part) const;
+	std::string playlist() const;
+	// Moves the requests that can be answered to ready, with the playlist they are answered with.
+	void take_ready_requests(std::vector<HttpResponder> &ready, std::string &body);
+
+	mutable std::mutex _mutex;
+	AVFormatContext *_format_context;
+	AVStream *_video_stream;
+	// Bytes written by the muxer since the last part.
+	std::string _output;
+
+	std::string _init_segment;
+	int _init_version;
+	std::deque<Segment> _segments;
+	// The segment being written is the last one of _segments, when open.
+	bool _segment_open;
+	int64_t _next_msn;
+	int64_t _discontinuity_sequence;
+	bool _discontinuity;
+	// Read without the lock for the blocking timeout.
+	std::atomic<int> _target_duration;
+
+	int64_t _part_ticks;
+	int _part_frames;
+	bool _part_independent;
+
+	std::vector<PendingRequest> _pending;
+};
@@ -0,0 +1,300 @@
+#include "frame_ring.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#endif
+
+// Both processes access the counters of the mapping, they must not be implemented with a lock.
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared memory atomics must be lock free");
+
+namespace {
+	constexpr uint32_t ring_magic = 0x474e5246; // "FRNG"
+	constexpr uint32_t ring_version = 1;
+	constexpr uint64_t page_size = 4096;
+
+	uint64_t align_up(uint64_t value, uint64_t alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+}
+
+struct FrameRing::Header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t reserved;
+	uint64_t slot_size;
+	uint64_t slot_stride;
+	uint64_t data_offset;
+	// Frames published by the producer, and released by the consumer. Slots of the sequences
+	// from read_sequence to write_sequence are not reused by the producer.
+	std::atomic<uint64_t> write_sequence;
+	std::atomic<uint64_t> read_sequence;
+	// Futex word, bumped for every published frame.
+	std::atomic<uint32_t> wake_count;
+};
+
+struct FrameRing::Slot
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t flags;
+};
+
+FrameRing::FrameRing()
+	: _header(nullptr)
+	, _base(nullptr)
+	, _mapping_size(0)
+	, _owner(false)
+#ifdef _WIN32
+	, _mapping(nullptr)
+	, _event(nullptr)
+#else
+	, _fd(-1)
+#endif
+	, _next_sequence(0)
+	, _skipped_frames(0)
+	, _dropped_frames(0)
+{
+}
+
+FrameRing::~FrameRing()
+{
+#ifdef _WIN32
+	if (_base != nullptr)
+		UnmapViewOfFile(_base);
+	if (_mapping != nullptr)
+		CloseHandle(_mapping);
+	if (_event != nullptr)
+		CloseHandle(_event);
+#else
+	if (_base != nullptr)
+		munmap(_base, _mapping_size);
+	if (_fd >= 0)
+		close(_fd);
+	if (_owner)
+		shm_unlink(_name.c_str());
+#endif
+}
+
+FrameRing* FrameRing::create(const std::string &name, uint32_t slot_count, uint64_t slot_size)
+{
+	if (slot_count < 2 || slot_size == 0)
+		return nullptr;
+
+	const auto slot_stride = align_up(slot_size, page_size);
+	const auto data_offset = align_up(sizeof(Header) + slot_count * sizeof(Slot), page_size);
+	auto *ring = new FrameRing();
+	ring->_owner = true;
+	if (!ring->map(name, data_offset + slot_count * slot_stride, true)) {
+		delete ring;
+		return nullptr;
+	}
+
+	// A ring left behind by a streamer that did not exit cleanly is started over.
+	auto *header = ring->_header;
+	header->magic = 0;
+	header->version = ring_version;
+	header->slot_count = slot_count;
+	header->reserved = 0;
+	header->slot_size = slot_size;
+	header->slot_stride = slot_stride;
+	header->data_offset = data_offset;
+	header->write_sequence = 0;
+	header->read_sequence = 0;
+	header->wake_count = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = ring_magic;
+	return ring;
+}
+
+FrameRing* FrameRing::open(const std::string &name)
+{
+	auto *ring = new FrameRing();
+	if (!ring->map(name, 0, false)) {
+		delete ring;
+		return nullptr;
+	}
+
+	const auto *header = ring->_header;
+	const auto expected_size = header->data_offset + header->slot_count * header->slot_stride;
+	if (header->magic != ring_magic || header->version != ring_version || expected_size > ring->_mapping_size) {
+		delete ring;
+		return nullptr;
+	}
+	return ring;
+}
+
+uint8_t* FrameRing::begin_write(uint64_t size)
+{
+	if (size > _header->slot_size)
+		return nullptr;
+
+	const auto sequence = _header->write_sequence.load(std::memory_order_relaxed);
+	if (sequence - _header->read_sequence.load(std::memory_order_acquire) >= _header->slot_count) {
+		++_dropped_frames;
+		return nullptr;
+	}
+	return slot_pixels(sequence);
+}
+
+void FrameRing::end_write(uint32_t width, uint32_t height, uint32_t depth, uint32_t flags)
+{
+	const auto sequence = _header->write_sequence.load(std::memory_order_relaxed);
+	auto &target = slot(sequence);
+	target.width = width;
+	target.height = height;
+	target.depth = depth;
+	target.flags = flags;
+	_header->write_sequence.store(sequence + 1, std::memory_order_release);
+	signal();
+}
+
+bool FrameRing::wait(int timeout_ms)
+{
+	const auto wake_count = _header->wake_count.load(std::memory_order_acquire);
+	if (_header->write_sequence.load(std::memory_order_acquire) > _next_sequence)
+		return true;
+
+#if defined(_WIN32)
+	WaitForSingleObject(_event, (DWORD)timeout_ms);
+#elif defined(__linux__)
+	// Returns at once when a frame was published since wake_count was read.
+	timespec timeout = { (time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000 };
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_header->wake_count), FUTEX_WAIT, wake_count, &timeout, nullptr, 0);
+#else
+	(void)wake_count;
+	std::this_thread::sleep_for(std::chrono::milliseconds(std::min(timeout_ms, 1)));
+#endif
+	return _header->write_sequence.load(std::memory_order_acquire) > _next_sequence;
+}
+
+bool FrameRing::acquire(Frame &frame)
+{
+	const auto published = _header->write_sequence.load(std::memory_order_acquire);
+	if (published <= _next_sequence)
+		return false;
+
+	const auto sequence = published - 1;
+	_skipped_frames += sequence - _next_sequence;
+	// The skipped slots go back to the producer right away.
+	_header->read_sequence.store(sequence, std::memory_order_release);
+
+	const auto &source = slot(sequence);
+	frame.pixels = slot_pixels(sequence);
+	frame.width = source.width;
+	frame.height = source.height;
+	frame.depth = source.depth;
+	frame.flags = source.flags;
+	frame.sequence = sequence;
+	_next_sequence = published;
+
+	// Only the producer can be blamed for a frame overflowing its slot.
+	if ((uint64_t)frame.width * frame.height * frame.depth > _header->slot_size) {
+		release(frame);
+		return false;
+	}
+	return true;
+}
+
+void FrameRing::release(const Frame &frame)
+{
+	_header->read_sequence.store(frame.sequence + 1, std::memory_order_release);
+}
+
+void FrameRing::wake()
+{
+	signal();
+}
+
+uint64_t FrameRing::slot_size() const
+{
+	return _header->slot_size;
+}
+
+FrameRing::Slot& FrameRing::slot(uint64_t sequence) const
+{
+	auto *slots = reinterpret_cast<Slot*>(_base + sizeof(Header));
+	return slots[sequence % _header->slot_count];
+}
+
+uint8_t* FrameRing::slot_pixels(uint64_t sequence) const
+{
+	return _base + _header->data_offset + (sequence % _header->slot_count) * _header->slot_stride;
+}
+
+void FrameRing::signal()
+{
+	_header->wake_count.fetch_add(1, std::memory_order_release);
+#if defined(_WIN32)
+	SetEvent(_event);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_header->wake_count), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+bool FrameRing::map(const std::string &name, uint64_t size, bool create)
+{
+#ifdef _WIN32
+	_name = "Local\\" + name;
+	if (create) {
+		_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE | SEC_COMMIT, (DWORD)(size >> 32), (DWORD)size, _name.c_str());
+		_event = CreateEventA(nullptr, FALSE, FALSE, (_name + ".event").c_str());
+	} else {
+		_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, _name.c_str());
+		_event = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (_name + ".event").c_str());
+	}
+	if (_mapping == nullptr || _event == nullptr)
+		return false;
+
+	_base = (uint8_t*)MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, create ? (SIZE_T)size : 0);
+	if (_base == nullptr)
+		return false;
+
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(_base, &info, sizeof(info));
+	_mapping_size = create ? size : info.RegionSize;
+#else
+	_name = "/" + name;
+	_fd = shm_open(_name.c_str(), create ? O_CREAT | O_RDWR : O_RDWR, 0600);
+	if (_fd < 0)
+		return false;
+
+	if (create) {
+		if (ftruncate(_fd, (off_t)size) != 0)
+			return false;
+	} else {
+		struct stat info;
+		if (fstat(_fd, &info) != 0)
+			return false;
+		size = (uint64_t)info.st_size;
+	}
+	if (size < sizeof(Header))
+		return false;
+
+	auto *base = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (base == MAP_FAILED)
+		return false;
+	_base = (uint8_t*)base;
+	_mapping_size = size;
+#endif
+	_header = reinterpret_cast<Header*>(_base);
+	return true;
+}
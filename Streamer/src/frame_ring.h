@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Raw frames handed from a producer on the same host to the streamer through shared memory.
+// The producer writes the pixels once, straight into a slot of the ring, and the encoder reads
+// them in place. A ring has one producer and one consumer. The consumer always takes the newest
+// published frame, the producer skips frames while the consumer holds on to the other slots.
+class FrameRing
+{
+public:
+	static constexpr const char *default_name = "streamer_frame_ring";
+	static constexpr uint32_t default_slot_count = 4;
+	// Room for an RGBA 4K frame, the mapping is only backed by memory where it is written.
+	static constexpr uint64_t default_slot_size = 3840ull * 2160ull * 4ull;
+
+	// Rows are tightly packed, bottom up frames come straight from glReadPixels.
+	static constexpr uint32_t flag_bottom_up = 0x01;
+
+	struct Frame
+	{
+		const uint8_t *pixels;
+		uint32_t width;
+		uint32_t height;
+		uint32_t depth;
+		uint32_t flags;
+		uint64_t sequence;
+	};
+
+	~FrameRing();
+
+	// Creates the ring, done by the streamer. Returns nullptr when the shared memory cannot be created.
+	static FrameRing* create(const std::string &name, uint32_t slot_count = default_slot_count, uint64_t slot_size = default_slot_size);
+	// Attaches to the ring of a running streamer, done by the producer. Returns nullptr without a streamer.
+	static FrameRing* open(const std::string &name);
+
+	// Producer side. Returns the pixels of the next slot, or nullptr when the frame is larger than a slot
+	// or every free slot is waiting for the consumer. end_write publishes the frame and wakes the consumer.
+	uint8_t* begin_write(uint64_t size);
+	void end_write(uint32_t width, uint32_t height, uint32_t depth, uint32_t flags);
+
+	// Consumer side. Waits up to timeout_ms for a frame that was not read yet, returns false
+	// without one, also when woken up by wake.
+	bool wait(int timeout_ms);
+	// Takes the newest published frame, older ones are skipped. It stays valid until released.
+	bool acquire(Frame &frame);
+	void release(const Frame &frame);
+	// Wakes a consumer blocked in wait, to shut it down.
+	void wake();
+
+	uint64_t slot_size() const;
+	uint64_t skipped_frames() const { return _skipped_frames; }
+	uint64_t dropped_frames() const { return _dropped_frames; }
+private:
+	struct Header;
+	struct Slot;
+
+	FrameRing();
+	bool map(const std::string &name, uint64_t size, bool create);
+	Slot& slot(uint64_t sequence) const;
+	uint8_t* slot_pixels(uint64_t sequence) const;
+	void signal();
+
+	Header *_header;
+	uint8_t *_base;
+	uint64_t _mapping_size;
+	std::string _name;
+	bool _owner;
+#ifdef _WIN32
+	void *_mapping;
+	void *_event;
+#else
+	int _fd;
+#endif
+
+	// Next sequence the consumer has not seen.
+	uint64_t _next_sequence;
+	uint64_t _skipped_frames;
+	uint64_t _dropped_frames;
+};
@@ -0,0 +1,186 @@
+#include "gzip.h"
+#include <vector>
+#include <algorithm>
+
+namespace {
+	constexpr int window_size = 32768;
+	constexpr int min_match = 3;
+	constexpr int max_match = 258;
+	constexpr int max_chain = 256;
+	constexpr int hash_bits = 15;
+
+	const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const uint8_t distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	// Deflate packs its bits from the least significant one, Huffman codes from their most significant bit.
+	class BitWriter
+	{
+	public:
+		explicit BitWriter(std::string &output) : _output(output), _buffer(0), _count(0) {}
+
+		void write(uint32_t bits, int count)
+		{
+			_buffer |= bits << _count;
+			_count += count;
+			while (_count >= 8) {
+				_output.push_back((char)(_buffer & 0xff));
+				_buffer >>= 8;
+				_count -= 8;
+			}
+		}
+
+		void write_code(uint32_t code, int length)
+		{
+			uint32_t reversed = 0;
+			for (auto i = 0; i < length; ++i) {
+				reversed = (reversed << 1) | ((code >> i) & 1);
+			}
+			write(reversed, length);
+		}
+
+		void flush()
+		{
+			if (_count > 0)
+				_output.push_back((char)(_buffer & 0xff));
+			_buffer = 0;
+			_count = 0;
+		}
+	private:
+		std::string &_output;
+		uint32_t _buffer;
+		int _count;
+	};
+
+	// Fixed literal/length codes of RFC 1951 3.2.6.
+	void write_literal(BitWriter &writer, int symbol)
+	{
+		if (symbol < 144)
+			writer.write_code(0x30 + symbol, 8);
+		else if (symbol < 256)
+			writer.write_code(0x190 + symbol - 144, 9);
+		else if (symbol < 280)
+			writer.write_code(symbol - 256, 7);
+		else
+			writer.write_code(0xc0 + symbol - 280, 8);
+	}
+
+	void write_match(BitWriter &writer, int length, int distance)
+	{
+		auto code = 28;
+		while (length_base[code] > length)
+			--code;
+		write_literal(writer, 257 + code);
+		writer.write(length - length_base[code], length_extra[code]);
+
+		code = 29;
+		while (distance_base[code] > distance)
+			--code;
+		writer.write_code(code, 5);
+		writer.write(distance - distance_base[code], distance_extra[code]);
+	}
+
+	uint32_t hash(const uint8_t *data)
+	{
+		return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & ((1 << hash_bits) - 1);
+	}
+
+	void append_le32(std::string &output, uint32_t value)
+	{
+		for (auto i = 0; i < 4; ++i) {
+			output.push_back((char)((value >> (i * 8)) & 0xff));
+		}
+	}
+}
+
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc)
+{
+	static uint32_t table[256];
+	static bool table_ready = [](){
+		for (uint32_t i = 0; i < 256; ++i) {
+			auto value = i;
+			for (auto bit = 0; bit < 8; ++bit) {
+				value = (value & 1) ? 0xedb88320 ^ (value >> 1) : value >> 1;
+			}
+			table[i] = value;
+		}
+		return true;
+	}();
+	(void)table_ready;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+std::string gzip_compress(const std::string &data)
+{
+	const auto *input = (const uint8_t*)data.data();
+	const auto size = (int)data.size();
+
+	std::string output;
+	output.reserve(data.size() / 2 + 32);
+	// Deflate, no file name and no modification time.
+	const char header[] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff' };
+	output.append(header, sizeof(header));
+
+	BitWriter writer(output);
+	// A single final block with the fixed codes.
+	writer.write(1, 1);
+	writer.write(1, 2);
+
+	std::vector<int> head(1 << hash_bits, -1);
+	std::vector<int> previous(window_size, -1);
+	auto insert = [&](int position)
+	{
+		auto h = hash(input + position);
+		previous[position & (window_size - 1)] = head[h];
+		head[h] = position;
+	};
+
+	auto position = 0;
+	while (position < size) {
+		auto best_length = 0;
+		auto best_distance = 0;
+		if (position + min_match <= size) {
+			auto limit = std::min(max_match, size - position);
+			auto candidate = head[hash(input + position)];
+			for (auto chain = 0; candidate >= 0 && position - candidate <= window_size && chain < max_chain; ++chain) {
+				if (input[candidate + best_length] == input[position + best_length]) {
+					auto length = 0;
+					while (length < limit && input[candidate + length] == input[position + length])
+						++length;
+					if (length > best_length) {
+						best_length = length;
+						best_distance = position - candidate;
+						if (length == limit)
+							break;
+					}
+				}
+				candidate = previous[candidate & (window_size - 1)];
+			}
+		}
+
+		if (best_length >= min_match) {
+			write_match(writer, best_length, best_distance);
+			for (auto end = position + best_length; position < end; ++position) {
+				if (position + min_match <= size)
+					insert(position);
+			}
+		} else {
+			write_literal(writer, input[position]);
+			if (position + min_match <= size)
+				insert(position);
+			++position;
+		}
+	}
+	write_literal(writer, 256);
+	writer.flush();
+
+	append_le32(output, crc32(input, data.size()));
+	append_le32(output, (uint32_t)data.size());
+	return output;
+}
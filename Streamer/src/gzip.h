@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// CRC-32 of the gzip trailer and of the asset ETags.
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
+
+// Compresses data to the gzip format with a single deflate block of fixed Huffman codes.
+// Meant to be run once per asset, the chains of the match search favour size over speed.
+std::string gzip_compress(const std::string &data);
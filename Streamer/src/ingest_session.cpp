@@ -0,0 +1,118 @@
+#include "ingest_session.h"
+#include <cstring>
+#include <iostream>
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+
+std::ostream& operator << (std::ostream &stream, const ImageInfo &image_info)
+{
+	stream << "(" << image_info.width << "x" << image_info.height << "x" << image_info.depth << ")";
+	return stream;
+}
+
+IngestSession::IngestSession(int id, WorkerPool &pool, const std::string &format, const std::string &path)
+	: _id(id)
+	, _pool(pool)
+	, _format(format)
+	, _path(path)
+	, _streamer(id)
+	, _scheduled(false)
+	, _closing(false)
+	, _replaced_frames(0)
+{
+	_streamer.init();
+}
+
+IngestSession::~IngestSession()
+{
+	if (_streamer.stream_opened())
+		_streamer.close_stream();
+	_streamer.shutdown();
+}
+
+bool IngestSession::push_frame(ingest_msg_ptr msg)
+{
+	auto &payload = msg->get_payload();
+	if (payload.size() <= sizeof(ImageInfo)) {
+		std::cout << "Error receiving frame: the size of the buffer is too small" << std::endl;
+		return false;
+	}
+
+	ImageInfo info;
+	memcpy(&info, payload.data(), sizeof(info));
+	const auto frame_size = (uint64_t)info.width * info.height * info.depth;
+	if (info.depth <= 0 || frame_size != payload.size() - sizeof(info)) {
+		std::cout << "Error receiving frame: " << info << " does not match " << payload.size() - sizeof(info) << " bytes" << std::endl;
+		return false;
+	}
+
+	critical_section_holder csh(_queue_mutex);
+	if (_pending != nullptr)
+		++_replaced_frames;
+	_pending = msg;
+	if (!_scheduled) {
+		_scheduled = true;
+		auto self = shared_from_this();
+		_pool.submit([self]() { self->run(); });
+	}
+	return true;
+}
+
+void IngestSession::stream_frame(const uint8_t *pixels, const ImageInfo &info, bool bottom_up)
+{
+	critical_section_holder csh(_streamer_mutex);
+	StreamingInfo stream_info;
+	stream_info.width = info.width;
+	stream_info.height = info.height;
+	if (_streamer.stream_opened() && stream_info != _streamer.streaming_info()) {
+		_streamer.close_stream();
+	}
+
+	if (!_streamer.stream_opened()) {
+		_streamer.open_stream(info.width, info.height, info.depth, _format, _path);
+	}
+
+	if (_streamer.stream_opened()) {
+		_streamer.stream_frame(pixels, info.width, info.height, info.depth, bottom_up);
+	}
+}
+
+void IngestSession::close()
+{
+	critical_section_holder csh(_queue_mutex);
+	_closing = true;
+	if (!_scheduled) {
+		_scheduled = true;
+		auto self = shared_from_this();
+		_pool.submit([self]() { self->run(); });
+	}
+}
+
+void IngestSession::run()
+{
+	for (;;) {
+		ingest_msg_ptr msg;
+		bool closing;
+		{
+			critical_section_holder csh(_queue_mutex);
+			msg.swap(_pending);
+			closing = _closing;
+			if (msg == nullptr)
+				_scheduled = false;
+		}
+
+		if (msg == nullptr) {
+			if (closing) {
+				critical_section_holder csh(_streamer_mutex);
+				if (_streamer.stream_opened())
+					_streamer.close_stream();
+			}
+			return;
+		}
+
+		// The pixels are converted from the payload, msg keeps it alive until stream_frame returns.
+		ImageInfo info;
+		memcpy(&info, msg->get_payload().data(), sizeof(info));
+		stream_frame((const uint8_t*)msg->get_payload().data() + sizeof(info), info, false);
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "streamer.h"
+#include "worker_pool.h"
+#include "recycling_msg_manager.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/server.hpp>
+
+// Incoming frames reuse the payload buffers of the previous ones.
+struct ingest_config : public websocketpp::config::asio
+{
+	typedef ingest_config type;
+	typedef websocketpp::config::asio base;
+
+	typedef websocketpp::message_buffer::message<recycling_con_msg_manager> message_type;
+	typedef recycling_con_msg_manager<message_type> con_msg_manager_type;
+	typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<con_msg_manager_type> endpoint_msg_manager_type;
+};
+
+using ingest_server = websocketpp::server<ingest_config>;
+using ingest_msg_ptr = ingest_server::message_ptr;
+
+// Prefixed to the pixels of the frames sent by the producers.
+struct ImageInfo
+{
+	unsigned width;
+	unsigned height;
+	short depth;
+};
+
+std::ostream& operator << (std::ostream &stream, const ImageInfo &image_info);
+
+// One producer and the Streamer encoding its frames. Frames are encoded one at a time on the
+// worker pool, so sessions are encoded in parallel. A frame arriving while another one is
+// still waiting for a worker replaces it, a slow encoder does not build up latency.
+class IngestSession : public std::enable_shared_from_this<IngestSession>
+{
+public:
+	IngestSession(int id, WorkerPool &pool, const std::string &format, const std::string &path);
+	~IngestSession();
+
+	int id() const { return _id; }
+
+	// Queues a frame message, it is kept alive until encoded. Returns false for malformed frames.
+	bool push_frame(ingest_msg_ptr msg);
+	// Encodes pixels owned by the caller on the calling thread.
+	void stream_frame(const uint8_t *pixels, const ImageInfo &info, bool bottom_up);
+	// The stream is closed by a worker once the queued frame is encoded.
+	void close();
+
+	int64_t replaced_frames() const { return _replaced_frames; }
+private:
+	void run();
+
+	int _id;
+	WorkerPool &_pool;
+	std::string _format;
+	std::string _path;
+
+	std::mutex _streamer_mutex;
+	Streamer _streamer;
+
+	std::mutex _queue_mutex;
+	ingest_msg_ptr _pending;
+	bool _scheduled;
+	bool _closing;
+	std::atomic<int64_t> _replaced_frames;
+};
@@ -1,4 +1,6 @@
 #include "streamer.h"
+#include "frame_ring.h"
+#include "ingest_session.h"
 
 #include <iostream>
 #include <vector>
@@ -6,6 +8,11 @@
 #include <string>
 #include <sstream>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <memory>
 
 // The ASIO_STANDALONE define is necessary to use the standalone version of Asio.
 // Remove if you are using Boost Asio.
@@ -19,10 +26,15 @@ constexpr const char* server_address = "127.0.0.1";
 constexpr short server_port = 12345;
 int count = 0;
 
-Streamer streamer;
+// The shared memory producer is session 0, websocket producers are numbered from 1.
+constexpr int frame_ring_session_id = 0;
+int next_session_id = 1;
 
-using server = websocketpp::server<websocketpp::config::asio>;
-using msg_ptr = server::message_ptr;
+std::atomic<bool> quit_ingest(false);
+
+using server = ingest_server;
+using msg_ptr = ingest_msg_ptr;
+using session_map = std::map<websocketpp::connection_hdl, std::shared_ptr<IngestSession>, std::owner_less<websocketpp::connection_hdl>>;
 
 struct StreamingStrategy
 {
@@ -44,19 +56,6 @@ StreamingStrategy dash_strategy("stream_segment", "../../HTML5/live/video.mp4");
 StreamingStrategy raw_h264_strategy("h264", "video.h264");
 auto &current_strategy = raw_h264_strategy;
 
-struct ImageInfo
-{
-	unsigned width;
-	unsigned height;
-	short depth;
-};
-
-std::ostream& operator << (std::ostream &stream, const ImageInfo &image_info)
-{
-	stream << "(" << image_info.width << "x" << image_info.height << "x" << image_info.depth << ")";
-	return stream;
-}
-
 std::ostream& operator << (std::ostream &stream, const std::vector<char> &vec)
 {
 	for (auto &c : vec) {
@@ -88,25 +87,57 @@ void on_http(server* s, websocketpp::connection_hdl hdl) {
 	con->set_status(websocketpp::http::status_code::ok);
 }
 
-void on_fail(server* s, websocketpp::connection_hdl hdl) {
+// Same host producers write their frames in the ring, they are encoded from the shared memory.
+void run_frame_ring_ingest(FrameRing *ring, WorkerPool *pool)
+{
+	std::shared_ptr<IngestSession> session;
+	FrameRing::Frame frame;
+	while (!quit_ingest) {
+		if (!ring->wait(100) || !ring->acquire(frame))
+			continue;
+
+		if (session == nullptr)
+			session = std::make_shared<IngestSession>(frame_ring_session_id, *pool, current_strategy.format, current_strategy.path);
+
+		ImageInfo info{ frame.width, frame.height, (short)frame.depth };
+		session->stream_frame(frame.pixels, info, (frame.flags & FrameRing::flag_bottom_up) != 0);
+		ring->release(frame);
+	}
+	std::cout << "Shared memory frames skipped: " << ring->skipped_frames() << std::endl;
+}
+
+// Every producer connection has its own session, handlers all run on the asio thread.
+void on_open(session_map *sessions, WorkerPool *pool, websocketpp::connection_hdl hdl) {
+	auto session = std::make_shared<IngestSession>(next_session_id++, *pool, current_strategy.format, current_strategy.path);
+	std::cout << "Open handler: session " << session->id() << std::endl;
+	(*sessions)[hdl] = session;
+}
+
+void close_session(session_map *sessions, websocketpp::connection_hdl hdl) {
+	auto it = sessions->find(hdl);
+	if (it == sessions->end())
+		return;
+
+	std::cout << "Closing session " << it->second->id() << ", frames replaced before encoding: " << it->second->replaced_frames() << std::endl;
+	it->second->close();
+	sessions->erase(it);
+}
+
+void on_fail(server* s, session_map *sessions, websocketpp::connection_hdl hdl) {
 	server::connection_ptr con = s->get_con_from_hdl(hdl);
 
 	std::cout << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
 
-	if (streamer.stream_opened()) {
-		streamer.close_stream();
-	}
+	close_session(sessions, hdl);
 }
 
-void on_close(websocketpp::connection_hdl) {
+void on_close(session_map *sessions, websocketpp::connection_hdl hdl) {
 	std::cout << "Close handler" << std::endl;
-	if (streamer.stream_opened()) {
-		streamer.close_stream();
-	}
+	close_session(sessions, hdl);
 }
 
 // Define a callback to handle incoming messages
-void on_message(server* s, websocketpp::connection_hdl hdl, msg_ptr msg) {
+void on_message(session_map *sessions, websocketpp::connection_hdl hdl, msg_ptr msg) {
 	auto opcode = msg->get_opcode();
 
 	if (opcode == websocketpp::frame::opcode::TEXT) {
@@ -114,33 +145,9 @@ void on_message(server* s, websocketpp::connection_hdl hdl, msg_ptr msg) {
 			<< " and message: " << msg->get_payload()
 			<< std::endl;*/
 	} else if (opcode == websocketpp::frame::opcode::BINARY) {
-		auto &payload = msg->get_payload();
-		if (payload.size() <= sizeof(ImageInfo)) {
-			std::cout << "Error receiving frame: the size of the buffer is too small" << std::endl;
-			return;
-		}
-
-		ImageInfo info;
-		memcpy_s((void*)&info, sizeof(info), payload.data(), sizeof(info));
-		auto frame_size = info.width * info.height * info.depth;
-		std::vector<uint8_t> frame;
-		frame.resize(frame_size);
-		memcpy_s(frame.data(), frame_size, payload.data() + sizeof(info), payload.size() - sizeof(info));
-
-		StreamingInfo stream_info;
-		stream_info.width = info.width;
-		stream_info.height = info.height;
-		if (streamer.stream_opened() && stream_info != streamer.streaming_info()) {
-			streamer.close_stream();
-		}
-
-		if (!streamer.stream_opened()) {
-			streamer.open_stream(info.width, info.height, info.depth, current_strategy.format, current_strategy.path);
-		}
-
-		if (streamer.stream_opened()) {
-			streamer.stream_frame(frame.data(), info.width, info.height, info.depth);
-		}
+		auto it = sessions->find(hdl);
+		if (it != sessions->end())
+			it->second->push_frame(msg);
 	}
 }
 
@@ -151,7 +158,21 @@ bool validate(server *, websocketpp::connection_hdl) {
 
 int main(int argc, char **argv)
 {
-	streamer.init();
+	Streamer::start_output_server();
+
+	// Sessions are encoded on the pool, the asio thread only receives the frames.
+	auto *pool = new WorkerPool();
+	std::cout << "Encoding on " << pool->thread_count() << " threads" << std::endl;
+	session_map sessions;
+
+	auto *frame_ring = FrameRing::create(FrameRing::default_name);
+	std::thread *ingest_thread = nullptr;
+	if (frame_ring != nullptr) {
+		std::cout << "Shared memory ingest: " << FrameRing::default_name << std::endl;
+		ingest_thread = new std::thread(&run_frame_ring_ingest, frame_ring, pool);
+	} else {
+		std::cout << "Shared memory ingest unavailable, frames are only received by websocket" << std::endl;
+	}
 
 	server serv;
 	try {
@@ -164,11 +185,12 @@ int main(int argc, char **argv)
 		serv.set_reuse_addr(true);
 
 		// Register our message handler
-		serv.set_message_handler(bind(&on_message, &serv, std::placeholders::_1, std::placeholders::_2));
+		serv.set_message_handler(bind(&on_message, &sessions, std::placeholders::_1, std::placeholders::_2));
 
 		serv.set_http_handler(bind(&on_http, &serv, std::placeholders::_1));
-		serv.set_fail_handler(bind(&on_fail, &serv, std::placeholders::_1));
-		serv.set_close_handler(&on_close);
+		serv.set_open_handler(bind(&on_open, &sessions, pool, std::placeholders::_1));
+		serv.set_fail_handler(bind(&on_fail, &serv, &sessions, std::placeholders::_1));
+		serv.set_close_handler(bind(&on_close, &sessions, std::placeholders::_1));
 
 		serv.set_validate_handler(bind(&validate, &serv, std::placeholders::_1));
 
@@ -191,9 +213,21 @@ int main(int argc, char **argv)
 		std::cout << "other exception" << std::endl;
 	}
 
-	if (streamer.stream_opened()) {
-		streamer.close_stream();
+	if (ingest_thread != nullptr) {
+		quit_ingest = true;
+		frame_ring->wake();
+		ingest_thread->join();
+		delete ingest_thread;
 	}
-	streamer.shutdown();
+	delete frame_ring;
+
+	for (auto &session : sessions) {
+		session.second->close();
+	}
+	sessions.clear();
+	// Runs the queued jobs, the last sessions are destroyed with them.
+	delete pool;
+
+	Streamer::stop_output_server();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+#include <websocketpp/common/memory.hpp>
+#include <websocketpp/frame.hpp>
+
+#include <mutex>
+#include <vector>
+
+// Connection message manager that keeps released messages for the next ones. Their payload keeps
+// its capacity, so frames of the same size are read without allocating a new buffer every time.
+template <typename message>
+class recycling_con_msg_manager
+	: public websocketpp::lib::enable_shared_from_this<recycling_con_msg_manager<message> >
+{
+public:
+	typedef recycling_con_msg_manager<message> type;
+	typedef websocketpp::lib::shared_ptr<recycling_con_msg_manager> ptr;
+	typedef websocketpp::lib::weak_ptr<recycling_con_msg_manager> weak_ptr;
+
+	typedef typename message::ptr message_ptr;
+
+	// Released messages held at most, a few full frames.
+	static constexpr size_t max_pooled_messages = 4;
+
+	~recycling_con_msg_manager()
+	{
+		for (auto *msg : _pool) {
+			delete msg;
+		}
+	}
+
+	message_ptr get_message()
+	{
+		return message_ptr(websocketpp::lib::make_shared<message>(type::shared_from_this()));
+	}
+
+	message_ptr get_message(websocketpp::frame::opcode::value op, size_t size)
+	{
+		message *msg = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_pool.empty()) {
+				msg = _pool.back();
+				_pool.pop_back();
+			}
+		}
+
+		if (msg == nullptr) {
+			msg = new message(type::shared_from_this(), op, size);
+		} else {
+			msg->set_opcode(op);
+			msg->set_header("");
+			msg->set_prepared(false);
+			msg->set_fin(true);
+			msg->set_terminal(false);
+			msg->set_compressed(false);
+			msg->get_raw_payload().clear();
+			msg->get_raw_payload().reserve(size);
+		}
+
+		// Messages can outlive their connection, they are then simply deleted.
+		weak_ptr manager = type::shared_from_this();
+		return message_ptr(msg, [manager](message *released) {
+			auto shared = manager.lock();
+			if (!shared || !shared->release(released))
+				delete released;
+		});
+	}
+
+	// Messages go back to the pool when their last message_ptr is released instead.
+	bool recycle(message *)
+	{
+		return false;
+	}
+private:
+	bool release(message *msg)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_pool.size() >= max_pooled_messages)
+			return false;
+		_pool.push_back(msg);
+		return true;
+	}
+
+	std::mutex _mutex;
+	std::vector<message*> _pool;
+};
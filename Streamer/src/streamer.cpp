@@ -1,4 +1,5 @@
 #include "streamer.h"
+#include "asset_cache.h"
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
@@ -12,25 +13,36 @@ extern "C"
 }
 
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <string>
+#include <cstring>
 
 using critical_section_holder = std::lock_guard<std::mutex>;
 using server = websocketpp::server<websocketpp::config::asio>;
 using msg_ptr = server::message_ptr;
 
 constexpr long long frame_rate = 1000;// (long long)(1.0f / 60.0f * 1000.0f);
+// Encoded frames are numbered at this rate, their timestamps are frame numbers.
+constexpr int frames_per_second = 60;
+constexpr const char* live_resource = "/live/";
+// Served by the output server, viewers load the page from the port of the stream.
+constexpr const char* asset_directory = "../../HTML5";
 constexpr int max_buffer_size = 63 * 1024;
 constexpr const char* server_address = "127.0.0.1";
 constexpr short server_port = 54321;
 
-unsigned char *io_buffer = nullptr;
 int io_buffer_size = 4 * 1024;
 
 server serv;
+std::thread *output_thread = nullptr;
+AssetCache assets;
+
+// Streamers viewers can watch, by id.
+std::mutex streamers_mutex;
+std::vector<Streamer*> streamers;
 
 #define WRITE_FILE
-#ifdef WRITE_FILE
-FILE *test_file;
-#endif
 
 int round_to_higher_multiple_of_two(int value)
 {
@@ -66,22 +78,251 @@ int write_packet(void *opaque, uint8_t *buf, int buf_size)
 	self->send_packet_buffer(buf, buf_size);
 
 #ifdef WRITE_FILE
-	fwrite(buf, 1, buf_size, test_file);
+	fwrite(buf, 1, buf_size, self->_test_file);
 #endif
 
 	return 0;
 }
 
-Streamer::Streamer()
+static bool hdl_equal(websocketpp::connection_hdl u, websocketpp::connection_hdl t)
+{
+	return !t.owner_before(u) && !u.owner_before(t);
+}
+
+static void run_output_server()
+{
+	try {
+		// Start the ASIO io_service run loop
+		serv.run();
+	}
+	catch (const std::exception & e) {
+		std::cout << e.what() << std::endl;
+	}
+	catch (websocketpp::lib::error_code e) {
+		std::cout << e.message() << std::endl;
+	}
+	catch (...) {
+		std::cout << "other exception" << std::endl;
+	}
+}
+
+// Answers on the asio thread, the response may be ready on an encoder thread.
+static HttpResponder http_responder(server::connection_ptr con)
+{
+	return [con](int status, const std::string &content_type, const std::string &body)
+	{
+		serv.get_io_service().post([con, status, content_type, body]()
+		{
+			con->set_status((websocketpp::http::status_code::value)status);
+			con->append_header("Content-Type", content_type);
+			con->append_header("Cache-Control", content_type == CmafSegmenter::playlist_content_type ? "no-cache" : "max-age=60");
+			con->append_header("Access-Control-Allow-Origin", "*");
+			con->set_body(body);
+			websocketpp::lib::error_code ec;
+			con->send_http_response(ec);
+		});
+	};
+}
+
+// "/live/<id>/<file>" is served by the segmenter of that session, "/live/<file>" by the session
+// with the lowest id, as with "open".
+static void serve_live(server::connection_ptr con)
+{
+	auto resource = con->get_resource();
+	auto query_start = resource.find('?');
+	auto query = query_start == std::string::npos ? std::string() : resource.substr(query_start + 1);
+	auto path = resource.substr(strlen(live_resource), query_start == std::string::npos ? std::string::npos : query_start - strlen(live_resource));
+
+	auto separator = path.find('/');
+	auto any_session = separator == std::string::npos;
+	auto id = any_session ? 0 : atoi(path.c_str());
+	auto file = any_session ? path : path.substr(separator + 1);
+
+	// Every response is sent later, from the responder.
+	con->defer_http_response();
+	auto respond = http_responder(con);
+
+	critical_section_holder csh(streamers_mutex);
+	Streamer *watched = nullptr;
+	for (auto *streamer : streamers) {
+		if (any_session ? (watched == nullptr || streamer->id() < watched->id()) : streamer->id() == id)
+			watched = streamer;
+	}
+	if (watched == nullptr) {
+		respond(404, "text/plain", "No stream for " + resource);
+		return;
+	}
+
+	watched->segmenter().handle_request(file, query, respond);
+	if (query.find("_HLS_msn=") != std::string::npos) {
+		// Blocking requests still waiting by then are answered.
+		auto watched_id = watched->id();
+		serv.set_timer(watched->segmenter().blocking_timeout().count(), [watched_id](const websocketpp::lib::error_code &)
+		{
+			critical_section_holder csh(streamers_mutex);
+			for (auto *streamer : streamers) {
+				if (streamer->id() == watched_id)
+					streamer->segmenter().expire_requests();
+			}
+		});
+	}
+}
+
+// Assets are sent compressed when the browser accepts it, and not at all when it already has them.
+static void serve_asset(server::connection_ptr con)
+{
+	const auto *asset = assets.find(con->get_resource());
+	if (asset == nullptr) {
+		con->set_body("Not found");
+		con->set_status(websocketpp::http::status_code::not_found);
+		return;
+	}
+
+	auto gzip = !asset->gzip_data.empty() && AssetCache::accepts_gzip(con->get_request_header("Accept-Encoding"));
+	const auto &etag = gzip ? asset->gzip_etag : asset->etag;
+	con->append_header("ETag", etag);
+	con->append_header("Cache-Control", "no-cache");
+	con->append_header("Vary", "Accept-Encoding");
+	if (AssetCache::matches(con->get_request_header("If-None-Match"), etag)) {
+		con->set_status(websocketpp::http::status_code::not_modified);
+		return;
+	}
+
+	con->append_header("Content-Type", asset->content_type);
+	if (gzip)
+		con->append_header("Content-Encoding", "gzip");
+	con->set_body(gzip ? asset->gzip_data : asset->data);
+	con->set_status(websocketpp::http::status_code::ok);
+}
+
+static void remove_viewer(websocketpp::connection_hdl hdl)
+{
+	critical_section_holder csh(streamers_mutex);
+	for (auto *streamer : streamers) {
+		streamer->remove_connection(hdl);
+	}
+}
+
+bool Streamer::start_output_server()
+{
+	// Loaded before the first request, only read afterwards.
+	auto loaded = assets.load(asset_directory);
+	std::cout << "Assets: " << loaded << " files, " << assets.bytes() << " bytes, " << assets.gzip_bytes() << " bytes compressed" << std::endl;
+
+	try {
+		// Set logging settings
+		serv.set_access_channels(websocketpp::log::alevel::none);
+		serv.clear_access_channels(websocketpp::log::alevel::frame_payload);
+
+		// Initialize ASIO
+		serv.init_asio();
+		serv.set_reuse_addr(true);
+
+		// Register our message handler
+		serv.set_message_handler([](websocketpp::connection_hdl hdl, msg_ptr msg)
+		{
+			auto opcode = msg->get_opcode();
+
+			if (opcode == websocketpp::frame::opcode::TEXT) {
+				std::cout << "on_message called with hdl: " << hdl.lock().get()
+				<< " and message: " << msg->get_payload()
+				<< std::endl;
+
+				auto request = msg->get_payload();
+				if (request.compare(0, 4, "open") == 0) {
+					// A viewer watches one stream at a time.
+					remove_viewer(hdl);
+
+					critical_section_holder csh(streamers_mutex);
+					auto any_session = request.size() <= 5;
+					auto id = any_session ? 0 : atoi(request.c_str() + 5);
+					Streamer *watched = nullptr;
+					for (auto *streamer : streamers) {
+						if (any_session ? (watched == nullptr || streamer->id() < watched->id()) : streamer->id() == id)
+							watched = streamer;
+					}
+					if (watched != nullptr)
+						watched->add_connection(hdl);
+					else
+						std::cout << "No stream to watch for: " << request << std::endl;
+				}
+			}
+			else if (opcode == websocketpp::frame::opcode::BINARY) {
+				auto &payload = msg->get_payload();
+			}
+		});
+
+		serv.set_http_handler([](websocketpp::connection_hdl hdl)
+		{
+			server::connection_ptr con = serv.get_con_from_hdl(hdl);
+			if (con->get_resource().compare(0, strlen(live_resource), live_resource) == 0) {
+				serve_live(con);
+				return;
+			}
+			serve_asset(con);
+		});
+		serv.set_fail_handler([](websocketpp::connection_hdl hdl)
+		{
+			server::connection_ptr con = serv.get_con_from_hdl(hdl);
+			std::cout << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
+			remove_viewer(hdl);
+		});
+		serv.set_close_handler([](websocketpp::connection_hdl hdl)
+		{
+			std::cout << "Close handler" << std::endl;
+			remove_viewer(hdl);
+		});
+		serv.set_validate_handler([](websocketpp::connection_hdl)
+		{
+			return true;
+		});
+
+		// Listen on port
+		serv.listen(server_port);
+
+		// Start the server accept loop
+		serv.start_accept();
+	}
+	catch (const std::exception & e) {
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+	catch (websocketpp::lib::error_code e) {
+		std::cout << e.message() << std::endl;
+		return false;
+	}
+	catch (...) {
+		std::cout << "other exception" << std::endl;
+		return false;
+	}
+
+	output_thread = new std::thread(&run_output_server);
+	return true;
+}
+
+void Streamer::stop_output_server()
+{
+	if (output_thread == nullptr)
+		return;
+
+	serv.stop();
+	output_thread->join();
+	delete output_thread;
+	output_thread = nullptr;
+}
+
+Streamer::Streamer(int id)
 	: _scale_context(nullptr)
 	, _codec(nullptr)
 	, _format_context(nullptr)
 	, _video_stream(nullptr)
+	, _id(id)
+	, _io_buffer(nullptr)
+	, _test_file(nullptr)
 	, _initialized(false)
 	, _stream_opened(false)
 	, _frame_counter(0)
 	, _streamer_thread(nullptr)
-	, _ws_thread(nullptr)
     , _quit_thread(false)
 {
 }
@@ -99,8 +340,6 @@ Streamer::~Streamer()
 
 bool Streamer::init()
 {
-	std::cout << "Starting thread" << std::endl;
-	_ws_thread = new std::thread(&Streamer::run_websocket_thread, this);
 	std::cout << "Registering formats" << std::endl;
 	av_register_all();
 	std::cout << "Registering codecs" << std::endl;
@@ -116,15 +355,21 @@ bool Streamer::init()
 	}
 	std::cout << "H264 codec found" << std::endl;
 
+	{
+		critical_section_holder csh(streamers_mutex);
+		streamers.push_back(this);
+	}
+
 	_initialized = true;
 	return true;
 }
 
 void Streamer::shutdown()
 {
-	serv.stop();
-	_ws_thread->join();
-	delete _ws_thread;
+	{
+		critical_section_holder csh(streamers_mutex);
+		streamers.erase(std::remove(streamers.begin(), streamers.end(), this), streamers.end());
+	}
 
 	avformat_network_deinit();
 	_initialized = false;
@@ -157,8 +402,8 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 	}
 
 	if ((_format_context->oformat->flags & AVFMT_NOFILE) == 0) {
-		io_buffer = (unsigned char*)av_malloc(io_buffer_size);
-		_format_context->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, (void*)this, nullptr, write_packet, nullptr);
+		_io_buffer = (unsigned char*)av_malloc(io_buffer_size);
+		_format_context->pb = avio_alloc_context(_io_buffer, io_buffer_size, 1, (void*)this, nullptr, write_packet, nullptr);
 		//auto ret = avio_open(&_format_context->pb, path.c_str(), AVIO_FLAG_WRITE);
 		if (_format_context->pb == nullptr) {
 			//char error_buff[80];
@@ -202,7 +447,9 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 	_quit_thread = false;
 
 #ifdef WRITE_FILE
-	fopen_s(&test_file, "zeVideo.mp4", "wb");
+	// One file per session.
+	auto file_name = _id == 0 ? std::string("zeVideo.mp4") : "zeVideo_" + std::to_string(_id) + ".mp4";
+	fopen_s(&_test_file, file_name.c_str(), "wb");
 #endif
 
 	//_streamer_thread = new std::thread(&Streamer::run_encoding_thread, this);
@@ -224,14 +471,18 @@ void Streamer::close_stream()
 	//delete _streamer_thread;
 
 #ifdef WRITE_FILE
-	fclose(test_file);
+	if (_test_file != nullptr)
+		fclose(_test_file);
+	_test_file = nullptr;
 #endif
 
 	av_free(_format_context->pb);
-	av_free(io_buffer);
+	av_free(_io_buffer);
+	_io_buffer = nullptr;
 	avformat_free_context(_format_context);
 	avcodec_close(_video_stream->codec);
 	_stream_opened = false;
+	_segmenter.reset();
 
 	if (_scale_context != nullptr) {
 		sws_freeContext(_scale_context);
@@ -239,7 +490,7 @@ void Streamer::close_stream()
 	}
 }
 
-void Streamer::stream_frame(const uint8_t* frame, int width, int height, short depth)
+void Streamer::stream_frame(const uint8_t* frame, int width, int height, short depth, bool bottom_up)
 {
 	//{
 	//	critical_section_holder holder(_frame_mutex);
@@ -257,6 +508,10 @@ void Streamer::stream_frame(const uint8_t* frame, int width, int height, short d
 		av_frame_free(&inpic);
 		return;
 	}
+	if (bottom_up) {
+		inpic->data[0] += inpic->linesize[0] * (height - 1);
+		inpic->linesize[0] = -inpic->linesize[0];
+	}
 
 	AVFrame* outpic = av_frame_alloc();
 	outpic->format = AV_PIX_FMT_YUV420P;
@@ -283,7 +538,7 @@ bool Streamer::initialize_codec_context(AVCodecContext* codec_context, AVStream
 
 	codec_context->bit_rate = 400000;
 	stream->time_base.num = 1;                                   // framerate numerator
-	stream->time_base.den = 60;                                  // framerate denominator
+	stream->time_base.den = frames_per_second;                   // framerate denominator
 	codec_context->gop_size = 10;                                       // emit one intra frame every ten frames
 	codec_context->max_b_frames = 2;                                    // maximum number of b-frames between non b-frames
 	codec_context->keyint_min = 1;                                      // minimum GOP size
@@ -342,6 +597,8 @@ int Streamer::encode_frame(AVFrame *frame, AVCodecContext *context)
 	}
 
 	if (got_packet != 0) {
+		// Before write_frame, which rescales the timestamps of the packet.
+		_segmenter.write(&packet, AVRational{ 1, frames_per_second }, context);
 		success = write_frame(_format_context, &_video_stream->time_base, _video_stream, &packet);
 		if (success < 0) {
 			std::cout << "Error streaming frame" << std::endl;
@@ -406,105 +663,26 @@ void Streamer::run_encoding_thread()
 
 }
 
-void Streamer::run_websocket_thread()
+void Streamer::send_frame_ws(AVPacket *pkt)
 {
-	auto hdl_equal = [](websocketpp::connection_hdl u, websocketpp::connection_hdl t) -> auto {
-		return !t.owner_before(u) && !u.owner_before(t);
-	};
-
-	auto remove_connection = [this, &hdl_equal](websocketpp::connection_hdl hdl)
-	{
-		critical_section_holder csh(_connection_mutex);
-		for (auto it = _connections.begin(), end = _connections.end(); it != end; ++it) {
-			if (hdl_equal(hdl, *it)) {
-				_connections.erase(it);
-				break;
-			}
-		}
-	};
-
-	try {
-		// Set logging settings
-		serv.set_access_channels(websocketpp::log::alevel::none);
-		serv.clear_access_channels(websocketpp::log::alevel::frame_payload);
-
-		// Initialize ASIO
-		serv.init_asio();
-		serv.set_reuse_addr(true);
-
-		// Register our message handler
-		serv.set_message_handler([this](websocketpp::connection_hdl hdl, msg_ptr msg)
-		{
-			auto opcode = msg->get_opcode();
-
-			if (opcode == websocketpp::frame::opcode::TEXT) {
-				std::cout << "on_message called with hdl: " << hdl.lock().get()
-				<< " and message: " << msg->get_payload()
-				<< std::endl;
-
-				auto request = msg->get_payload();
-				if (request == "open") {
-					critical_section_holder csh(_connection_mutex);
-					_connections.push_back(hdl);
-				}
-			}
-			else if (opcode == websocketpp::frame::opcode::BINARY) {
-				auto &payload = msg->get_payload();
-			}
-		});
-
-		serv.set_http_handler([](websocketpp::connection_hdl hdl)
-		{
-			server::connection_ptr con = serv.get_con_from_hdl(hdl);
-
-			std::string res = con->get_request_body();
-
-			std::stringstream ss;
-			ss << "got HTTP request with " << res.size() << " bytes of body data.";
-
-			con->set_body(ss.str());
-			con->set_status(websocketpp::http::status_code::ok);
-		});
-		serv.set_fail_handler([&remove_connection](websocketpp::connection_hdl hdl)
-		{
-			server::connection_ptr con = serv.get_con_from_hdl(hdl);
-			std::cout << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
-			remove_connection(hdl);
-		});
-		serv.set_close_handler([&remove_connection](websocketpp::connection_hdl hdl)
-		{
-			std::cout << "Close handler" << std::endl;
-			remove_connection(hdl);
-		});
-		//serv.set_validate_handler(bind(&validate, &serv, std::placeholders::_1));
-		serv.set_validate_handler([](websocketpp::connection_hdl)
-		{
-			return true;
-		});
-
-		// Listen on port
-		serv.listen(server_port);
-
-		// Start the server accept loop
-		serv.start_accept();
+	send_packet_buffer(pkt->data, pkt->size);
+}
 
-		// Start the ASIO io_service run loop
-		serv.run();
-	}
-	catch (const std::exception & e) {
-		std::cout << e.what() << std::endl;
-	}
-	catch (websocketpp::lib::error_code e) {
-		std::cout << e.message() << std::endl;
-	}
-	catch (...) {
-		std::cout << "other exception" << std::endl;
-	}
+void Streamer::add_connection(websocketpp::connection_hdl hdl)
+{
+	critical_section_holder csh(_connection_mutex);
+	_connections.push_back(hdl);
 }
 
-void Streamer::send_frame_ws(AVPacket *pkt)
+void Streamer::remove_connection(websocketpp::connection_hdl hdl)
 {
-	send_packet_buffer(pkt->data, pkt->size);
+	critical_section_holder csh(_connection_mutex);
+	for (auto it = _connections.begin(), end = _connections.end(); it != end; ++it) {
+		if (hdl_equal(hdl, *it)) {
+			_connections.erase(it);
+			break;
+		}
+	}
 }
 
 void Streamer::send_packet_buffer(void* buffer, int size)
@@ -4,7 +4,9 @@
 #include <atomic>
 #include <mutex>
 #include <vector>
+#include <cstdio>
 #include <websocketpp/transport/base/connection.hpp>
+#include "cmaf_segmenter.h"
 
 struct AVFrame;
 struct SwsContext;
@@ -30,19 +32,28 @@ struct FrameInfo
 
 bool operator != (const StreamingInfo &lhs, const StreamingInfo rhs);
 
+// Encodes the frames of one ingest session. Viewers of every session connect to the same output
+// server, "open" watches the session with the lowest id and "open <id>" the session of that id.
 class Streamer
 {
 public:
-	Streamer();
+	explicit Streamer(int id = 0);
 	~Streamer();
 
+	// The output server is shared by every Streamer, it runs from start to stop on a thread of its own.
+	static bool start_output_server();
+	static void stop_output_server();
+
 	bool init();
 	void shutdown();
 
+	int id() const { return _id; }
+
 	bool open_stream(int width, int height, short depth, const std::string &format, const std::string &path);
 	void close_stream();
 
-	void stream_frame(const uint8_t *frame, int width, int height, short depth);
+	// Bottom up frames are flipped by the conversion, without a copy.
+	void stream_frame(const uint8_t *frame, int width, int height, short depth, bool bottom_up = false);
 
 	bool initialized() const { return _initialized; }
 	bool stream_opened() const { return _stream_opened; }
@@ -51,11 +62,18 @@ public:
 
 	void send_frame_ws(AVPacket *pkt);
 	void send_packet_buffer(void* buffer, int size);
+
+	void add_connection(websocketpp::connection_hdl hdl);
+	void remove_connection(websocketpp::connection_hdl hdl);
+
+	// Low-latency HLS of the stream, served by the output server under /live/<id>/.
+	CmafSegmenter& segmenter() { return _segmenter; }
 private:
+	friend int write_packet(void *opaque, uint8_t *buf, int buf_size);
+
 	bool initialize_codec_context(AVCodecContext *codec_context, AVStream *stream, int width, int height) const;
 	int encode_frame(AVFrame *frame, AVCodecContext *context);
 	void run_encoding_thread();
-	void run_websocket_thread();
 
 	int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt);
 
@@ -64,6 +82,10 @@ private:
 	AVFormatContext *_format_context;
 	AVStream *_video_stream;
 
+	int _id;
+	unsigned char *_io_buffer;
+	FILE *_test_file;
+
 	StreamingInfo _streaming_info;
 	bool _initialized;
 	bool _stream_opened;
@@ -71,10 +93,11 @@ private:
 
 	FrameInfo _current_frame;
 	std::thread *_streamer_thread;
-	std::thread *_ws_thread;
 	std::mutex _frame_mutex;
 	std::atomic<bool> _quit_thread;
 
 	std::mutex _connection_mutex;
 	std::vector<websocketpp::connection_hdl> _connections;
+
+	CmafSegmenter _segmenter;
 };
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+
+WorkerPool::WorkerPool(int thread_count)
+	: _quit(false)
+{
+	for (auto i = 0; i < std::max(1, thread_count); ++i) {
+		_threads.emplace_back(&WorkerPool::run_worker, this);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		critical_section_holder csh(_mutex);
+		_quit = true;
+	}
+	_job_available.notify_all();
+	for (auto &thread : _threads) {
+		thread.join();
+	}
+}
+
+int WorkerPool::default_thread_count()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+	{
+		critical_section_holder csh(_mutex);
+		_jobs.push_back(std::move(job));
+	}
+	_job_available.notify_one();
+}
+
+void WorkerPool::run_worker()
+{
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_job_available.wait(lock, [this]() { return _quit || !_jobs.empty(); });
+			if (_jobs.empty())
+				return;
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+		}
+		job();
+	}
+}
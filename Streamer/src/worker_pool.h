@@ -0,0 +1,29 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads running queued jobs, one thread per core by default.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(int thread_count = default_thread_count());
+	// Jobs already queued are run before the threads exit.
+	~WorkerPool();
+
+	static int default_thread_count();
+
+	void submit(std::function<void()> job);
+	int thread_count() const { return (int)_threads.size(); }
+private:
+	void run_worker();
+
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _job_available;
+	std::deque<std::function<void()>> _jobs;
+	bool _quit;
+};
@@ -8,6 +8,7 @@
 #include <sstream>
 
 #include "freetype/freetype_utils.h"
+#include "../../Streamer/src/frame_ring.h"
 
 // The ASIO_STANDALONE define is necessary to use the standalone version of Asio.
 // Remove if you are using Boost Asio.
@@ -370,6 +371,11 @@ int main(void)
 	freetype::font_data our_font;
 	our_font.init("C:/Windows/Fonts/Arial.ttf", 16);
 
+	// A streamer on the same host reads the frames from shared memory, the websocket is the fallback.
+	auto *frame_ring = FrameRing::open(FrameRing::default_name);
+	if (frame_ring != nullptr)
+		std::cout << "Sending frames through shared memory" << std::endl;
+
 	// Main loop
 	std::vector<uint8_t> frame;
 	ImageInfo info;
@@ -433,11 +439,8 @@ int main(void)
 		glBindTexture(GL_TEXTURE_2D, 0);
 
 		glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer_id);
-		frame.clear();
-		frame.resize(width * height * bitdepth);
 		glPixelStorei(GL_PACK_ALIGNMENT, 1);
 		glReadBuffer(GL_COLOR_ATTACHMENT0);
-		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void*)frame.data());
 		info.width = width;
 		info.height = height;
 		info.depth = bitdepth;
@@ -446,7 +449,21 @@ int main(void)
 		sss << "Frame number : " << count++;
 		c.send_text(id, sss.str());
 
-		c.send_image(id, info, flip_frame(frame, width, height, bitdepth));
+		// Read straight into the ring, the streamer flips the rows while converting them.
+		// Frames are skipped while the streamer is busy with the other slots.
+		const auto frame_size = (uint64_t)width * height * bitdepth;
+		if (frame_ring != nullptr && frame_size <= frame_ring->slot_size()) {
+			auto *pixels = frame_ring->begin_write(frame_size);
+			if (pixels != nullptr) {
+				glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void*)pixels);
+				frame_ring->end_write(width, height, bitdepth, FrameRing::flag_bottom_up);
+			}
+		} else {
+			frame.clear();
+			frame.resize(width * height * bitdepth);
+			glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void*)frame.data());
+			c.send_image(id, info, flip_frame(frame, width, height, bitdepth));
+		}
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
@@ -456,6 +473,8 @@ int main(void)
 	glDeleteTextures(1, &texColorBuffer);
 	glDeleteBuffers(1, &frame_buffer_id);
 
+	delete frame_ring;
+
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
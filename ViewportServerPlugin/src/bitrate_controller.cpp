@@ -0,0 +1,109 @@
+#include "bitrate_controller.h"
+#include <algorithm>
+
+constexpr auto sample_period = std::chrono::milliseconds(250);
+// Congested periods at the minimum bitrate before the resolution is lowered.
+constexpr int periods_before_downscale = 4;
+// Clear periods before trying a higher resolution again, about five seconds.
+constexpr int periods_before_upscale = 20;
+constexpr int min_scale_percent = 50;
+constexpr int scale_step_percent = 25;
+
+constexpr double decrease_factor = 0.7;
+constexpr double increase_factor = 1.08;
+// Stay under what the link drained when backing off.
+constexpr double throughput_margin = 0.85;
+
+BitrateController::BitrateController()
+	: _settings(default_settings())
+	, _decision({ 400 * 1000, 100 })
+	, _has_sample(false)
+	, _last_buffered(0)
+	, _last_written(0)
+	, _throughput(0.0)
+	, _queue_delay_ms(0)
+	, _congested_periods(0)
+	, _clear_periods(0)
+{
+}
+
+void BitrateController::set_settings(const BitrateSettings &settings)
+{
+	_settings = settings;
+	_settings.min_bitrate = std::max<int64_t>(1000, _settings.min_bitrate);
+	_settings.max_bitrate = std::max(_settings.min_bitrate, _settings.max_bitrate);
+	_settings.target_latency_ms = std::max(1, _settings.target_latency_ms);
+	limit_to_settings();
+}
+
+void BitrateController::reset(int64_t bitrate)
+{
+	_decision.bitrate = bitrate;
+	_decision.scale_percent = 100;
+	_has_sample = false;
+	_congested_periods = 0;
+	_clear_periods = 0;
+	limit_to_settings();
+}
+
+bool BitrateController::update(size_t buffered_bytes, uint64_t written_bytes, clock::time_point now)
+{
+	if (!_has_sample) {
+		_has_sample = true;
+		_last_sample = now;
+		_last_buffered = buffered_bytes;
+		_last_written = written_bytes;
+		return false;
+	}
+
+	const auto elapsed = now - _last_sample;
+	if (elapsed < sample_period)
+		return false;
+
+	// What left the socket is what was written minus the growth of its queue.
+	const auto seconds = std::chrono::duration<double>(elapsed).count();
+	const auto written = (double)(written_bytes - _last_written);
+	const auto drained = written - ((double)buffered_bytes - (double)_last_buffered);
+	_throughput = std::max(0.0, drained) / seconds;
+	_last_sample = now;
+	_last_buffered = buffered_bytes;
+	_last_written = written_bytes;
+
+	// Without measurable throughput, assume the link drains at the current bitrate.
+	const auto drain_rate = std::max(_throughput, _decision.bitrate / 8.0);
+	_queue_delay_ms = (int64_t)(buffered_bytes * 1000.0 / drain_rate);
+
+	const auto previous = _decision;
+	if (_queue_delay_ms > _settings.target_latency_ms) {
+		_clear_periods = 0;
+		if (_decision.bitrate > _settings.min_bitrate) {
+			auto bitrate = (int64_t)(_decision.bitrate * decrease_factor);
+			if (_throughput > 0.0)
+				bitrate = std::min(bitrate, (int64_t)(_throughput * 8.0 * throughput_margin));
+			_decision.bitrate = bitrate;
+		} else if (++_congested_periods >= periods_before_downscale && _decision.scale_percent > min_scale_percent) {
+			_congested_periods = 0;
+			_decision.scale_percent -= scale_step_percent;
+		}
+	} else if (_queue_delay_ms * 4 < _settings.target_latency_ms) {
+		_congested_periods = 0;
+		// An idle viewport sends almost nothing, which says nothing about the link.
+		if (written * 8.0 / seconds >= _decision.bitrate / 2.0)
+			_decision.bitrate = (int64_t)(_decision.bitrate * increase_factor);
+		if (++_clear_periods >= periods_before_upscale && _decision.scale_percent < 100) {
+			_clear_periods = 0;
+			_decision.scale_percent += scale_step_percent;
+		}
+	} else {
+		_congested_periods = 0;
+		_clear_periods = 0;
+	}
+	limit_to_settings();
+
+	return previous.bitrate != _decision.bitrate || previous.scale_percent != _decision.scale_percent;
+}
+
+void BitrateController::limit_to_settings()
+{
+	_decision.bitrate = std::min(std::max(_decision.bitrate, _settings.min_bitrate), _settings.max_bitrate);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+
+// Per client limits of the bitrate controller.
+struct BitrateSettings
+{
+	int64_t min_bitrate;
+	int64_t max_bitrate;
+	// Time the bytes waiting in the socket may take to drain before the client is considered congested.
+	int target_latency_ms;
+};
+
+struct BitrateDecision
+{
+	int64_t bitrate;
+	// Output resolution in percent of the captured one.
+	int scale_percent;
+};
+
+// Closed loop controller that keeps the websocket send queue of one client under
+// its target latency. It is sampled regularly with the number of bytes buffered by
+// the connection and the number of bytes written to it so far, and lowers the
+// bitrate (then the resolution) when the queue grows, raising them back when it
+// stays empty.
+class BitrateController
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	BitrateController();
+
+	// Limits of a client that did not send any.
+	static BitrateSettings default_settings() { return { 100 * 1000, 8 * 1000 * 1000, 100 }; }
+
+	void set_settings(const BitrateSettings &settings);
+	const BitrateSettings& settings() const { return _settings; }
+
+	void reset(int64_t bitrate);
+
+	// Returns true when the bitrate or the scale changed since the last call.
+	bool update(size_t buffered_bytes, uint64_t written_bytes, clock::time_point now);
+
+	const BitrateDecision& decision() const { return _decision; }
+	// Bytes per second the connection drained during the last sampling period.
+	double throughput() const { return _throughput; }
+	int64_t queue_delay_ms() const { return _queue_delay_ms; }
+private:
+	void limit_to_settings();
+
+	BitrateSettings _settings;
+	BitrateDecision _decision;
+
+	bool _has_sample;
+	clock::time_point _last_sample;
+	size_t _last_buffered;
+	uint64_t _last_written;
+	double _throughput;
+	int64_t _queue_delay_ms;
+
+	int _congested_periods;
+	int _clear_periods;
+};
@@ -0,0 +1,142 @@
+#include "block_compressor.h"
+#include "lz4_block.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+namespace {
+	void write32(uint8_t *p, uint32_t value)
+	{
+		memcpy(p, &value, sizeof(value));
+	}
+
+	uint32_t read32(const uint8_t *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+}
+
+BlockCompressor::BlockCompressor(TaskPool *pool, int block_size)
+	: _pool(pool)
+	, _block_size(std::max(1024, block_size))
+	, _input_bytes(0)
+	, _output_bytes(0)
+	, _elapsed_us(0)
+{
+}
+
+std::vector<uint8_t>& BlockCompressor::compress(const uint8_t *data, size_t size, size_t prefix_size)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	const auto block_count = (int)((size + _block_size - 1) / _block_size);
+	if ((int)_blocks.size() < block_count)
+		_blocks.resize(block_count);
+	_block_sizes.resize(block_count);
+
+	// A block that would not be smaller than its input is stored, so the scratch buffers never need more than a block.
+	_pool->run(block_count, [&](int i) {
+		auto &block = _blocks[i];
+		block.resize(_block_size);
+		auto offset = (size_t)i * _block_size;
+		auto length = (int)std::min<size_t>(_block_size, size - offset);
+		auto compressed = lz4_compress_block(data + offset, length, block.data(), length - 1);
+		_block_sizes[i] = compressed > 0 ? (uint32_t)compressed : (uint32_t)length | stored_block_flag;
+	});
+
+	const auto table_size = (2 + block_count) * sizeof(uint32_t);
+	auto total = prefix_size + table_size;
+	for (auto block_size : _block_sizes) {
+		total += block_size & ~stored_block_flag;
+	}
+	_output.resize(total);
+
+	auto *table = _output.data() + prefix_size;
+	write32(table, (uint32_t)block_count);
+	write32(table + sizeof(uint32_t), (uint32_t)_block_size);
+	std::vector<size_t> offsets(block_count);
+	auto offset = prefix_size + table_size;
+	for (auto i = 0; i < block_count; ++i) {
+		write32(table + (2 + i) * sizeof(uint32_t), _block_sizes[i]);
+		offsets[i] = offset;
+		offset += _block_sizes[i] & ~stored_block_flag;
+	}
+
+	_pool->run(block_count, [&](int i) {
+		auto length = _block_sizes[i] & ~stored_block_flag;
+		auto *source = (_block_sizes[i] & stored_block_flag) ? data + (size_t)i * _block_size : _blocks[i].data();
+		memcpy(_output.data() + offsets[i], source, length);
+	});
+
+	if (_input_bytes > throughput_window_bytes) {
+		_input_bytes = 0;
+		_output_bytes = 0;
+		_elapsed_us = 0;
+	}
+	_input_bytes += size;
+	_output_bytes += total - prefix_size;
+	_elapsed_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return _output;
+}
+
+double BlockCompressor::throughput() const
+{
+	return _elapsed_us > 0 ? _input_bytes * 1000000.0 / _elapsed_us : 0.0;
+}
+
+double BlockCompressor::ratio() const
+{
+	return _input_bytes > 0 ? (double)_output_bytes / _input_bytes : 0.0;
+}
+
+bool BlockCompressor::decompress(const uint8_t *data, size_t data_size, uint8_t *output, size_t size, TaskPool *pool)
+{
+	if (data_size < 2 * sizeof(uint32_t))
+		return false;
+
+	const auto block_count = read32(data);
+	const auto block_size = read32(data + sizeof(uint32_t));
+	if (block_size == 0 || block_count != (size + block_size - 1) / block_size)
+		return false;
+
+	const auto table_size = (2 + (uint64_t)block_count) * sizeof(uint32_t);
+	if (data_size < table_size)
+		return false;
+
+	std::vector<size_t> offsets(block_count);
+	uint64_t offset = table_size;
+	for (uint32_t i = 0; i < block_count; ++i) {
+		offsets[i] = (size_t)offset;
+		offset += read32(data + (2 + i) * sizeof(uint32_t)) & ~stored_block_flag;
+	}
+	if (offset != data_size)
+		return false;
+
+	std::atomic<bool> valid(true);
+	auto decompress_block = [&](int i) {
+		auto block = read32(data + (2 + i) * sizeof(uint32_t));
+		auto length = block & ~stored_block_flag;
+		auto *destination = output + (size_t)i * block_size;
+		auto expected = (int)std::min<size_t>(block_size, size - (size_t)i * block_size);
+		if (block & stored_block_flag) {
+			if ((int)length != expected)
+				valid = false;
+			else
+				memcpy(destination, data + offsets[i], length);
+		} else if (lz4_decompress_block(data + offsets[i], (int)length, destination, expected) != expected) {
+			valid = false;
+		}
+	};
+
+	if (pool != nullptr) {
+		pool->run((int)block_count, decompress_block);
+	} else {
+		for (uint32_t i = 0; i < block_count; ++i) {
+			decompress_block((int)i);
+		}
+	}
+	return valid;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "task_pool.h"
+#include <cstdint>
+#include <vector>
+
+// Splits a buffer in independent LZ4 blocks compressed in parallel on a task pool it does not own.
+// The output is the block count, the block size and the size of every block as uint32,
+// followed by the blocks. Blocks that do not compress are stored as is, flagged by stored_block_flag.
+class BlockCompressor
+{
+public:
+	static constexpr int default_block_size = 256 * 1024;
+	static constexpr uint32_t stored_block_flag = 0x80000000u;
+
+	explicit BlockCompressor(TaskPool *pool, int block_size = default_block_size);
+
+	// Compresses size bytes after prefix_size bytes left to the caller, at the start of the returned buffer.
+	// The buffer is reused by the next call.
+	std::vector<uint8_t>& compress(const uint8_t *data, size_t size, size_t prefix_size);
+
+	int thread_count() const { return _pool->thread_count(); }
+	// Input bytes per second of the last compressed buffers, and their compressed to input size ratio.
+	double throughput() const;
+	double ratio() const;
+
+	// Decompresses the output of compress, without its prefix, into size bytes. Returns false for malformed input.
+	static bool decompress(const uint8_t *data, size_t data_size, uint8_t *output, size_t size, TaskPool *pool = nullptr);
+private:
+	TaskPool *_pool;
+	int _block_size;
+
+	std::vector<uint8_t> _output;
+	std::vector<std::vector<uint8_t>> _blocks;
+	std::vector<uint32_t> _block_sizes;
+
+	// Accumulated since the last throughput_window_bytes, as a short benchmark of the current content.
+	static constexpr uint64_t throughput_window_bytes = 256 * 1024 * 1024;
+	uint64_t _input_bytes;
+	uint64_t _output_bytes;
+	int64_t _elapsed_us;
+};
@@ -0,0 +1,358 @@
+#include "color_conversion.h"
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/cpu.h>
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ENABLE_SIMD_CONVERSION
+#include <immintrin.h>
+#endif
+
+// MSVC emits any intrinsic, gcc and clang need the target enabled per function.
+#if defined(_MSC_VER)
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// BT.601 limited range, the matrix libswscale uses by default for RGB to YUV.
+// Y = ((66 R + 129 G + 25 B + 128) >> 8) + 16
+// U and V use the sum of the 2x2 block: ((c0 R4 + c1 G4 + c2 B4 + 512) >> 10) + 128
+constexpr int y_coefficients[3] = { 66, 129, 25 };
+constexpr int u_coefficients[3] = { -38, -74, 112 };
+constexpr int v_coefficients[3] = { 112, -94, -18 };
+
+struct ChannelLayout
+{
+	int r;
+	int g;
+	int b;
+	int bpp;
+};
+
+static ChannelLayout channel_layout(SourceFormat format)
+{
+	switch (format) {
+	case SourceFormat::RGB24:
+		return { 0, 1, 2, 3 };
+	case SourceFormat::BGRA:
+		return { 2, 1, 0, 4 };
+	case SourceFormat::RGBA:
+	default:
+		return { 0, 1, 2, 4 };
+	}
+}
+
+struct RowPair
+{
+	const uint8_t *top;
+	const uint8_t *bottom;
+	uint8_t *y_top;
+	uint8_t *y_bottom;
+	uint8_t *u;
+	uint8_t *v;
+};
+
+static RowPair row_pair(const SourceImage &src, const YuvImage &dst, int row)
+{
+	// Rows past the source are replicated from the last one.
+	const auto top_row = std::min(row, src.height - 1);
+	const auto bottom_row = std::min(row + 1, src.height - 1);
+
+	RowPair rows;
+	rows.top = src.data + top_row * src.stride;
+	rows.bottom = src.data + bottom_row * src.stride;
+	rows.y_top = dst.data[0] + row * dst.linesize[0];
+	rows.y_bottom = dst.data[0] + (row + 1) * dst.linesize[0];
+	rows.u = dst.data[1] + (row / 2) * dst.linesize[1];
+	rows.v = dst.data[2] + (row / 2) * dst.linesize[2];
+	return rows;
+}
+
+static inline uint8_t luma(const uint8_t *p, const ChannelLayout &l)
+{
+	return (uint8_t)(((y_coefficients[0] * p[l.r] + y_coefficients[1] * p[l.g] + y_coefficients[2] * p[l.b] + 128) >> 8) + 16);
+}
+
+static inline uint8_t chroma(const int *coefficients, int r, int g, int b)
+{
+	return (uint8_t)(((coefficients[0] * r + coefficients[1] * g + coefficients[2] * b + 512) >> 10) + 128);
+}
+
+// Converts the columns [first_column, dst.width) of a row pair, replicating the last source column.
+static void convert_columns_scalar(const RowPair &rows, const SourceImage &src, const YuvImage &dst, const ChannelLayout &l, int first_column)
+{
+	for (auto x = first_column; x < dst.width; x += 2) {
+		const auto x0 = std::min(x, src.width - 1);
+		const auto x1 = std::min(x + 1, src.width - 1);
+		const auto *t0 = rows.top + x0 * l.bpp;
+		const auto *t1 = rows.top + x1 * l.bpp;
+		const auto *b0 = rows.bottom + x0 * l.bpp;
+		const auto *b1 = rows.bottom + x1 * l.bpp;
+
+		rows.y_top[x] = luma(t0, l);
+		rows.y_top[x + 1] = luma(t1, l);
+		rows.y_bottom[x] = luma(b0, l);
+		rows.y_bottom[x + 1] = luma(b1, l);
+
+		const auto r = t0[l.r] + t1[l.r] + b0[l.r] + b1[l.r];
+		const auto g = t0[l.g] + t1[l.g] + b0[l.g] + b1[l.g];
+		const auto b = t0[l.b] + t1[l.b] + b0[l.b] + b1[l.b];
+		rows.u[x / 2] = chroma(u_coefficients, r, g, b);
+		rows.v[x / 2] = chroma(v_coefficients, r, g, b);
+	}
+}
+
+static void rgb_to_yuv420p_scalar(const SourceImage &src, const YuvImage &dst, int first_row, int last_row)
+{
+	const auto layout = channel_layout(src.format);
+	for (auto row = first_row; row < last_row; row += 2) {
+		convert_columns_scalar(row_pair(src, dst, row), src, dst, layout, 0);
+	}
+}
+
+#ifdef ENABLE_SIMD_CONVERSION
+
+// Number of pixels a block must leave in the row so that 16 byte loads of RGB24 stay inside it.
+static int simd_row_margin(SourceFormat format)
+{
+	return format == SourceFormat::RGB24 ? 2 : 0;
+}
+
+// Coefficients laid out as the 16-bit channels of one pixel, alpha gets a zero weight.
+static void coefficient_pattern(const int *coefficients, const ChannelLayout &l, int16_t pattern[4])
+{
+	pattern[l.r] = (int16_t)coefficients[0];
+	pattern[l.g] = (int16_t)coefficients[1];
+	pattern[l.b] = (int16_t)coefficients[2];
+	pattern[3] = 0;
+}
+
+TARGET_SSE41 static inline __m128i load_4_pixels_sse41(const uint8_t *p, bool rgb24)
+{
+	if (!rgb24)
+		return _mm_loadu_si128((const __m128i*)p);
+
+	// Expand RGBRGBRGBRGB to RGB0RGB0RGB0RGB0
+	const auto expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), expand);
+}
+
+TARGET_SSE41 static inline __m128i luma_4_pixels_sse41(__m128i pixels, __m128i coefficients)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefficients);
+	const auto hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefficients);
+	return _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(lo, hi), _mm_set1_epi32(128)), 8);
+}
+
+TARGET_SSE41 static inline void store_luma_8_pixels_sse41(uint8_t *dst, __m128i p0, __m128i p1, __m128i coefficients)
+{
+	auto y = _mm_packs_epi32(luma_4_pixels_sse41(p0, coefficients), luma_4_pixels_sse41(p1, coefficients));
+	y = _mm_add_epi16(y, _mm_set1_epi16(16));
+	_mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(y, y));
+}
+
+// Sums 8 columns of chroma contributions into 4 values, one per 2x2 block.
+TARGET_SSE41 static inline __m128i chroma_sums_sse41(const __m128i sums[4], __m128i coefficients)
+{
+	const auto h0 = _mm_hadd_epi32(_mm_madd_epi16(sums[0], coefficients), _mm_madd_epi16(sums[1], coefficients));
+	const auto h1 = _mm_hadd_epi32(_mm_madd_epi16(sums[2], coefficients), _mm_madd_epi16(sums[3], coefficients));
+	return _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(h0, h1), _mm_set1_epi32(512)), 10);
+}
+
+TARGET_SSE41 static void rgb_to_yuv420p_sse41(const SourceImage &src, const YuvImage &dst, int first_row, int last_row)
+{
+	const auto layout = channel_layout(src.format);
+	const auto rgb24 = src.format == SourceFormat::RGB24;
+	const auto pixel_stride = rgb24 ? 12 : 16;
+	const auto simd_width = src.width - simd_row_margin(src.format);
+
+	int16_t y_pattern[4], u_pattern[4], v_pattern[4];
+	coefficient_pattern(y_coefficients, layout, y_pattern);
+	coefficient_pattern(u_coefficients, layout, u_pattern);
+	coefficient_pattern(v_coefficients, layout, v_pattern);
+	const auto y_coef = _mm_setr_epi16(y_pattern[0], y_pattern[1], y_pattern[2], y_pattern[3], y_pattern[0], y_pattern[1], y_pattern[2], y_pattern[3]);
+	const auto u_coef = _mm_setr_epi16(u_pattern[0], u_pattern[1], u_pattern[2], u_pattern[3], u_pattern[0], u_pattern[1], u_pattern[2], u_pattern[3]);
+	const auto v_coef = _mm_setr_epi16(v_pattern[0], v_pattern[1], v_pattern[2], v_pattern[3], v_pattern[0], v_pattern[1], v_pattern[2], v_pattern[3]);
+	const auto zero = _mm_setzero_si128();
+
+	for (auto row = first_row; row < last_row; row += 2) {
+		const auto rows = row_pair(src, dst, row);
+
+		auto x = 0;
+		for (; x + 8 <= simd_width; x += 8) {
+			const auto *top = rows.top + x * layout.bpp;
+			const auto *bottom = rows.bottom + x * layout.bpp;
+			const auto t0 = load_4_pixels_sse41(top, rgb24);
+			const auto t1 = load_4_pixels_sse41(top + pixel_stride, rgb24);
+			const auto b0 = load_4_pixels_sse41(bottom, rgb24);
+			const auto b1 = load_4_pixels_sse41(bottom + pixel_stride, rgb24);
+
+			store_luma_8_pixels_sse41(rows.y_top + x, t0, t1, y_coef);
+			store_luma_8_pixels_sse41(rows.y_bottom + x, b0, b1, y_coef);
+
+			// Vertical sums of the 16-bit channels, two pixels per register.
+			const __m128i sums[4] = {
+				_mm_add_epi16(_mm_unpacklo_epi8(t0, zero), _mm_unpacklo_epi8(b0, zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(b0, zero)),
+				_mm_add_epi16(_mm_unpacklo_epi8(t1, zero), _mm_unpacklo_epi8(b1, zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(t1, zero), _mm_unpackhi_epi8(b1, zero))
+			};
+			auto uv = _mm_packs_epi32(chroma_sums_sse41(sums, u_coef), chroma_sums_sse41(sums, v_coef));
+			uv = _mm_packus_epi16(_mm_add_epi16(uv, _mm_set1_epi16(128)), zero);
+
+			const auto u = _mm_cvtsi128_si32(uv);
+			const auto v = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+			memcpy(rows.u + x / 2, &u, 4);
+			memcpy(rows.v + x / 2, &v, 4);
+		}
+
+		convert_columns_scalar(rows, src, dst, layout, x);
+	}
+}
+
+TARGET_AVX2 static inline __m256i load_8_pixels_avx2(const uint8_t *p, bool rgb24)
+{
+	if (!rgb24)
+		return _mm256_loadu_si256((const __m256i*)p);
+
+	const auto expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const auto lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), expand);
+	const auto hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), expand);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// Returns the luma of 8 pixels in order, the in-lane unpacks and horizontal adds cancel out.
+TARGET_AVX2 static inline __m256i luma_8_pixels_avx2(__m256i pixels, __m256i coefficients)
+{
+	const auto zero = _mm256_setzero_si256();
+	const auto lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coefficients);
+	const auto hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coefficients);
+	return _mm256_srai_epi32(_mm256_add_epi32(_mm256_hadd_epi32(lo, hi), _mm256_set1_epi32(128)), 8);
+}
+
+TARGET_AVX2 static inline void store_luma_16_pixels_avx2(uint8_t *dst, __m256i p0, __m256i p1, __m256i coefficients)
+{
+	auto y = _mm256_packs_epi32(luma_8_pixels_avx2(p0, coefficients), luma_8_pixels_avx2(p1, coefficients));
+	y = _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3, 1, 2, 0));
+	y = _mm256_add_epi16(y, _mm256_set1_epi16(16));
+	y = _mm256_permute4x64_epi64(_mm256_packus_epi16(y, y), _MM_SHUFFLE(3, 1, 2, 0));
+	_mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(y));
+}
+
+// Sums 16 columns of chroma contributions into 8 values, one per 2x2 block, in order.
+TARGET_AVX2 static inline __m256i chroma_sums_avx2(const __m256i sums[4], __m256i coefficients)
+{
+	const auto h0 = _mm256_hadd_epi32(_mm256_madd_epi16(sums[0], coefficients), _mm256_madd_epi16(sums[1], coefficients));
+	const auto h1 = _mm256_hadd_epi32(_mm256_madd_epi16(sums[2], coefficients), _mm256_madd_epi16(sums[3], coefficients));
+	const auto c = _mm256_srai_epi32(_mm256_add_epi32(_mm256_hadd_epi32(h0, h1), _mm256_set1_epi32(512)), 10);
+	return _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+}
+
+TARGET_AVX2 static void rgb_to_yuv420p_avx2(const SourceImage &src, const YuvImage &dst, int first_row, int last_row)
+{
+	const auto layout = channel_layout(src.format);
+	const auto rgb24 = src.format == SourceFormat::RGB24;
+	const auto pixel_stride = rgb24 ? 24 : 32;
+	const auto simd_width = src.width - simd_row_margin(src.format);
+
+	int16_t y_pattern[4], u_pattern[4], v_pattern[4];
+	coefficient_pattern(y_coefficients, layout, y_pattern);
+	coefficient_pattern(u_coefficients, layout, u_pattern);
+	coefficient_pattern(v_coefficients, layout, v_pattern);
+	int64_t y_packed, u_packed, v_packed;
+	memcpy(&y_packed, y_pattern, sizeof(y_packed));
+	memcpy(&u_packed, u_pattern, sizeof(u_packed));
+	memcpy(&v_packed, v_pattern, sizeof(v_packed));
+	const auto y_coef = _mm256_set1_epi64x(y_packed);
+	const auto u_coef = _mm256_set1_epi64x(u_packed);
+	const auto v_coef = _mm256_set1_epi64x(v_packed);
+	const auto zero = _mm256_setzero_si256();
+
+	for (auto row = first_row; row < last_row; row += 2) {
+		const auto rows = row_pair(src, dst, row);
+
+		auto x = 0;
+		for (; x + 16 <= simd_width; x += 16) {
+			const auto *top = rows.top + x * layout.bpp;
+			const auto *bottom = rows.bottom + x * layout.bpp;
+			const auto t0 = load_8_pixels_avx2(top, rgb24);
+			const auto t1 = load_8_pixels_avx2(top + pixel_stride, rgb24);
+			const auto b0 = load_8_pixels_avx2(bottom, rgb24);
+			const auto b1 = load_8_pixels_avx2(bottom + pixel_stride, rgb24);
+
+			store_luma_16_pixels_avx2(rows.y_top + x, t0, t1, y_coef);
+			store_luma_16_pixels_avx2(rows.y_bottom + x, b0, b1, y_coef);
+
+			const __m256i sums[4] = {
+				_mm256_add_epi16(_mm256_unpacklo_epi8(t0, zero), _mm256_unpacklo_epi8(b0, zero)),
+				_mm256_add_epi16(_mm256_unpackhi_epi8(t0, zero), _mm256_unpackhi_epi8(b0, zero)),
+				_mm256_add_epi16(_mm256_unpacklo_epi8(t1, zero), _mm256_unpacklo_epi8(b1, zero)),
+				_mm256_add_epi16(_mm256_unpackhi_epi8(t1, zero), _mm256_unpackhi_epi8(b1, zero))
+			};
+			auto uv = _mm256_packs_epi32(chroma_sums_avx2(sums, u_coef), chroma_sums_avx2(sums, v_coef));
+			uv = _mm256_packus_epi16(_mm256_add_epi16(uv, _mm256_set1_epi16(128)), zero);
+			// Gather the 8 U bytes in the low qword and the 8 V bytes in the next one.
+			uv = _mm256_permutevar8x32_epi32(uv, _mm256_setr_epi32(0, 4, 1, 5, 2, 3, 6, 7));
+
+			const auto uv128 = _mm256_castsi256_si128(uv);
+			_mm_storel_epi64((__m128i*)(rows.u + x / 2), uv128);
+			_mm_storel_epi64((__m128i*)(rows.v + x / 2), _mm_srli_si128(uv128, 8));
+		}
+
+		convert_columns_scalar(rows, src, dst, layout, x);
+	}
+}
+
+#endif
+
+RgbToYuvFunction select_rgb_to_yuv420p()
+{
+#ifdef ENABLE_SIMD_CONVERSION
+	const auto flags = av_get_cpu_flags();
+	if (flags & AV_CPU_FLAG_AVX2)
+		return rgb_to_yuv420p_avx2;
+	if (flags & AV_CPU_FLAG_SSE4)
+		return rgb_to_yuv420p_sse41;
+#endif
+	return rgb_to_yuv420p_scalar;
+}
+
+std::vector<RgbToYuvFunction> supported_rgb_to_yuv420p()
+{
+	std::vector<RgbToYuvFunction> functions = { rgb_to_yuv420p_scalar };
+#ifdef ENABLE_SIMD_CONVERSION
+	const auto flags = av_get_cpu_flags();
+	if (flags & AV_CPU_FLAG_SSE4)
+		functions.push_back(rgb_to_yuv420p_sse41);
+	if (flags & AV_CPU_FLAG_AVX2)
+		functions.push_back(rgb_to_yuv420p_avx2);
+#endif
+	return functions;
+}
+
+const char* rgb_to_yuv420p_name(RgbToYuvFunction function)
+{
+#ifdef ENABLE_SIMD_CONVERSION
+	if (function == rgb_to_yuv420p_avx2)
+		return "avx2";
+	if (function == rgb_to_yuv420p_sse41)
+		return "sse4.1";
+#endif
+	return "scalar";
+}
+
+bool can_convert_without_scaling(const SourceImage &src, int dst_width, int dst_height)
+{
+	if (src.width <= 0 || src.height <= 0)
+		return false;
+
+	return dst_width == src.width + (src.width & 1) && dst_height == src.height + (src.height & 1);
+}
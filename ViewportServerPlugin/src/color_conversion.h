@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+enum class SourceFormat
+{
+	RGB24 = 0,
+	RGBA = 1,
+	BGRA = 2
+};
+
+struct SourceImage
+{
+	const uint8_t *data;
+	int stride;
+	int width;
+	int height;
+	SourceFormat format;
+};
+
+struct YuvImage
+{
+	uint8_t *data[3];
+	int linesize[3];
+	int width;
+	int height;
+};
+
+// Converts the destination rows [first_row, last_row) from RGB to BT.601 YUV420P.
+// Both bounds must be even. When the destination is larger than the source, the
+// last source row and column are replicated instead of rescaling the image.
+using RgbToYuvFunction = void(*)(const SourceImage &src, const YuvImage &dst, int first_row, int last_row);
+
+// Returns the fastest implementation supported by the running CPU (AVX2, SSE4.1 or scalar).
+RgbToYuvFunction select_rgb_to_yuv420p();
+// Every implementation the running CPU supports, slowest first, to compare them.
+std::vector<RgbToYuvFunction> supported_rgb_to_yuv420p();
+
+const char* rgb_to_yuv420p_name(RgbToYuvFunction function);
+
+// Only the padding is done by the converter, the image cannot be scaled.
+bool can_convert_without_scaling(const SourceImage &src, int dst_width, int dst_height);
@@ -22,6 +22,15 @@ class ViewportClient;
 constexpr const char *PLUGIN_NAME = "Viewport Server Plugin";
 constexpr const char *H264_NAME = "libx264";
 constexpr const char *NVENC_H264_NAME = "h264_nvenc";
+// Output format written by the streamer without going through libavformat.
+constexpr const char *RAW_H264_FORMAT = "h264";
+
+// Streamer options that are consumed by the pipeline instead of the codec.
+constexpr const char *FRAME_POLICY_OPTION = "frame_policy";
+constexpr const char *CONVERSION_THREADS_OPTION = "conversion_threads";
+constexpr const char *SKIP_UNCHANGED_OPTION = "skip_unchanged";
+constexpr const char *KEEP_ALIVE_OPTION = "keep_alive_ms";
+constexpr const char *SESSION_CACHE_OPTION = "session_cache_mb";
 
 using EncodingOptions = std::map<std::string, std::string>;
 
@@ -49,4 +58,8 @@ struct CommunicationHandlers
 	std::function<void(const std::string&)> error;
 	std::function<void(websocketpp::connection_hdl, void *, int)> send_binary;
 	std::function<void(websocketpp::connection_hdl, const std::string&)> send_text;
+	// Sends both buffers in one binary message, the header first.
+	std::function<void(websocketpp::connection_hdl, const void*, size_t, const void*, size_t)> send_framed;
+	// Bytes queued on the connection and not yet written to the socket.
+	std::function<size_t(websocketpp::connection_hdl)> buffered_amount;
 };
@@ -0,0 +1,234 @@
+#include "delta_tiles.h"
+#include "lz4_block.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace delta_tiles;
+
+namespace {
+	// More tasks than threads so a few busy tiles do not hold up a whole thread.
+	constexpr int batches_per_thread = 4;
+
+	void write32(uint8_t *p, uint32_t value)
+	{
+		memcpy(p, &value, sizeof(value));
+	}
+
+	uint32_t read32(const uint8_t *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	struct TileRect
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+	};
+
+	TileRect tile_rect(int index, int columns, int width, int height)
+	{
+		auto x = (index % columns) * tile_size;
+		auto y = (index / columns) * tile_size;
+		return { x, y, std::min(tile_size, width - x), std::min(tile_size, height - y) };
+	}
+
+	void xor_bytes(uint8_t *destination, const uint8_t *source, size_t size)
+	{
+		size_t i = 0;
+		for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+			uint64_t a, b;
+			memcpy(&a, destination + i, sizeof(a));
+			memcpy(&b, source + i, sizeof(b));
+			a ^= b;
+			memcpy(destination + i, &a, sizeof(a));
+		}
+		for (; i < size; ++i) {
+			destination[i] ^= source[i];
+		}
+	}
+}
+
+DeltaTileEncoder::DeltaTileEncoder(TaskPool *pool)
+	: _pool(pool)
+	, _width(0)
+	, _height(0)
+	, _depth(0)
+	, _columns(0)
+	, _key_frame(true)
+	, _changed_tiles(0)
+	, _input_bytes(0)
+	, _output_bytes(0)
+{
+	_batches.resize(_pool->thread_count() * batches_per_thread);
+}
+
+void DeltaTileEncoder::reset()
+{
+	_key_frame = true;
+}
+
+bool DeltaTileEncoder::encode(const uint8_t *frame, int width, int height, short depth, size_t prefix_size)
+{
+	if (width != _width || height != _height || depth != _depth) {
+		_width = width;
+		_height = height;
+		_depth = depth;
+		_columns = (width + tile_size - 1) / tile_size;
+		_key_frame = true;
+	}
+	// Key frames are deltas against black, every tile of the frame is sent.
+	if (_key_frame)
+		_previous.assign((size_t)width * height * depth, 0);
+
+	const auto tile_count = _columns * ((height + tile_size - 1) / tile_size);
+	const auto batch_count = std::min((int)_batches.size(), tile_count);
+	_pool->run(batch_count, [&](int i) {
+		encode_batch(_batches[i], tile_count * i / batch_count, tile_count * (i + 1) / batch_count, frame);
+	});
+
+	_changed_tiles = 0;
+	size_t data_size = 0;
+	for (auto i = 0; i < batch_count; ++i) {
+		_changed_tiles += (int)_batches[i].entries.size();
+		data_size += _batches[i].data.size();
+	}
+	_input_bytes += (size_t)width * height * depth;
+	if (_changed_tiles == 0 && !_key_frame)
+		return false;
+
+	const auto table_size = (3 + 2 * (size_t)_changed_tiles) * sizeof(uint32_t);
+	_output.resize(prefix_size + table_size + data_size);
+	auto *table = _output.data() + prefix_size;
+	write32(table, _key_frame ? key_frame_flag : 0);
+	write32(table + 4, tile_size);
+	write32(table + 8, (uint32_t)_changed_tiles);
+
+	std::vector<size_t> offsets(batch_count);
+	auto *entry = table + 12;
+	auto offset = prefix_size + table_size;
+	for (auto i = 0; i < batch_count; ++i) {
+		for (const auto &tile : _batches[i].entries) {
+			write32(entry, tile.index);
+			write32(entry + 4, tile.size);
+			entry += 8;
+		}
+		offsets[i] = offset;
+		offset += _batches[i].data.size();
+	}
+	_pool->run(batch_count, [&](int i) {
+		memcpy(_output.data() + offsets[i], _batches[i].data.data(), _batches[i].data.size());
+	});
+
+	_output_bytes += table_size + data_size;
+	_key_frame = false;
+	return true;
+}
+
+void DeltaTileEncoder::encode_batch(TileBatch &batch, int first_tile, int last_tile, const uint8_t *frame)
+{
+	batch.data.clear();
+	batch.entries.clear();
+
+	const auto stride = (size_t)_width * _depth;
+	for (auto index = first_tile; index < last_tile; ++index) {
+		const auto rect = tile_rect(index, _columns, _width, _height);
+		const auto row_bytes = (size_t)rect.width * _depth;
+		const auto tile_bytes = row_bytes * rect.height;
+		const auto first_byte = rect.y * stride + rect.x * _depth;
+
+		// The comparison is exact rather than hashed, a missed change would stay on screen for good.
+		auto changed = false;
+		for (auto y = 0; y < rect.height && !changed; ++y) {
+			changed = memcmp(frame + first_byte + y * stride, _previous.data() + first_byte + y * stride, row_bytes) != 0;
+		}
+		if (!changed)
+			continue;
+
+		batch.residual.resize(tile_bytes);
+		for (auto y = 0; y < rect.height; ++y) {
+			auto *residual = batch.residual.data() + y * row_bytes;
+			auto *previous = _previous.data() + first_byte + y * stride;
+			memcpy(residual, frame + first_byte + y * stride, row_bytes);
+			xor_bytes(residual, previous, row_bytes);
+			memcpy(previous, frame + first_byte + y * stride, row_bytes);
+		}
+
+		const auto start = batch.data.size();
+		batch.data.resize(start + tile_bytes);
+		auto compressed = lz4_compress_block(batch.residual.data(), (int)tile_bytes, batch.data.data() + start, (int)tile_bytes - 1);
+		if (compressed > 0) {
+			batch.data.resize(start + compressed);
+			batch.entries.push_back({ (uint32_t)index, (uint32_t)compressed });
+		} else {
+			memcpy(batch.data.data() + start, batch.residual.data(), tile_bytes);
+			batch.entries.push_back({ (uint32_t)index, (uint32_t)tile_bytes | stored_tile_flag });
+		}
+	}
+}
+
+DeltaTileDecoder::DeltaTileDecoder()
+	: _width(0)
+	, _height(0)
+	, _depth(0)
+	, _valid(false)
+{
+}
+
+bool DeltaTileDecoder::decode(const uint8_t *data, size_t size, int width, int height, short depth)
+{
+	if (size < 3 * sizeof(uint32_t) || width <= 0 || height <= 0 || depth <= 0)
+		return false;
+
+	const auto flags = read32(data);
+	if (read32(data + 4) != tile_size)
+		return _valid = false;
+	if (flags & key_frame_flag) {
+		_width = width;
+		_height = height;
+		_depth = depth;
+		_frame.assign((size_t)width * height * depth, 0);
+		_valid = true;
+	}
+	if (!_valid || width != _width || height != _height || depth != _depth)
+		return _valid = false;
+
+	const auto columns = (width + tile_size - 1) / tile_size;
+	const auto tile_count = (uint32_t)(columns * ((height + tile_size - 1) / tile_size));
+	const auto changed_tiles = read32(data + 8);
+	const auto table_size = (3 + 2 * (uint64_t)changed_tiles) * sizeof(uint32_t);
+	if (changed_tiles > tile_count || table_size > size)
+		return _valid = false;
+
+	const auto stride = (size_t)width * depth;
+	auto offset = (size_t)table_size;
+	for (uint32_t i = 0; i < changed_tiles; ++i) {
+		const auto index = read32(data + 12 + i * 8);
+		const auto entry = read32(data + 16 + i * 8);
+		const auto length = entry & ~stored_tile_flag;
+		if (index >= tile_count || length > size - offset)
+			return _valid = false;
+
+		const auto rect = tile_rect(index, columns, width, height);
+		const auto row_bytes = (size_t)rect.width * depth;
+		const auto tile_bytes = (int)(row_bytes * rect.height);
+		_residual.resize(tile_bytes);
+		if (entry & stored_tile_flag) {
+			if ((int)length != tile_bytes)
+				return _valid = false;
+			memcpy(_residual.data(), data + offset, length);
+		} else if (lz4_decompress_block(data + offset, (int)length, _residual.data(), tile_bytes) != tile_bytes) {
+			return _valid = false;
+		}
+		offset += length;
+
+		const auto first_byte = rect.y * stride + rect.x * depth;
+		for (auto y = 0; y < rect.height; ++y) {
+			xor_bytes(_frame.data() + first_byte + y * stride, _residual.data() + y * row_bytes, row_bytes);
+		}
+	}
+	return _valid = offset == size;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "task_pool.h"
+#include <cstdint>
+#include <vector>
+
+// Lossless delta frames. Each tile that changed since the previous frame is sent as the XOR
+// of its pixels with the previous ones, LZ4 compressed. Unchanged pixels XOR to zero runs
+// that compress to almost nothing.
+//
+// The encoded frame is, as uint32: flags, tile size, changed tile count, then the index and
+// the size of every changed tile, followed by the tiles. Tiles are row major in the frame,
+// the pixels of a tile row major in the tile. Tiles that do not compress are stored as is,
+// flagged by stored_tile_flag.
+namespace delta_tiles {
+	static constexpr int tile_size = 64;
+	static constexpr uint32_t key_frame_flag = 0x01;
+	static constexpr uint32_t stored_tile_flag = 0x80000000u;
+}
+
+class DeltaTileEncoder
+{
+public:
+	// Tiles are encoded in parallel on pool, which the encoder does not own.
+	explicit DeltaTileEncoder(TaskPool *pool);
+
+	// The next frame is sent whole, as a delta against a black frame.
+	void reset();
+
+	// Encodes the frame after prefix_size bytes left to the caller at the start of output().
+	// Returns false when no tile changed, there is then nothing to send.
+	bool encode(const uint8_t *frame, int width, int height, short depth, size_t prefix_size);
+	std::vector<uint8_t>& output() { return _output; }
+
+	int thread_count() const { return _pool->thread_count(); }
+	int changed_tiles() const { return _changed_tiles; }
+	// Encoded to captured size ratio of the frames encoded so far, unchanged frames included.
+	double ratio() const { return _input_bytes > 0 ? (double)_output_bytes / _input_bytes : 0.0; }
+private:
+	struct TileEntry
+	{
+		uint32_t index;
+		uint32_t size;
+	};
+
+	// Tiles of a range of the frame, encoded by one task.
+	struct TileBatch
+	{
+		std::vector<uint8_t> residual;
+		std::vector<uint8_t> data;
+		std::vector<TileEntry> entries;
+	};
+
+	void encode_batch(TileBatch &batch, int first_tile, int last_tile, const uint8_t *frame);
+
+	TaskPool *_pool;
+	std::vector<TileBatch> _batches;
+	std::vector<uint8_t> _previous;
+	std::vector<uint8_t> _output;
+	int _width;
+	int _height;
+	short _depth;
+	int _columns;
+	bool _key_frame;
+	int _changed_tiles;
+	uint64_t _input_bytes;
+	uint64_t _output_bytes;
+};
+
+// Rebuilds the frames of a DeltaTileEncoder.
+class DeltaTileDecoder
+{
+public:
+	DeltaTileDecoder();
+
+	// Applies the encoded frame to the current one. Returns false for malformed input or a delta
+	// without its reference, the frame is then invalid until the next key frame.
+	bool decode(const uint8_t *data, size_t size, int width, int height, short depth);
+	const std::vector<uint8_t>& frame() const { return _frame; }
+private:
+	std::vector<uint8_t> _frame;
+	std::vector<uint8_t> _residual;
+	int _width;
+	int _height;
+	short _depth;
+	bool _valid;
+};
@@ -0,0 +1,153 @@
+#include "dirty_tiles.h"
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/cpu.h>
+}
+
+// The crc32 instruction on 64 bits words only exists in 64 bits mode.
+#if defined(_M_X64) || defined(__x86_64__)
+#define ENABLE_SIMD_HASH
+#include <nmmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define TARGET_SSE42
+#else
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+constexpr uint64_t hash_prime = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rotate_left(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t load_word(const uint8_t *data)
+{
+	uint64_t word;
+	memcpy(&word, data, sizeof(word));
+	return word;
+}
+
+// Four independent lanes so the multiplications of a 32 bytes block overlap.
+static uint64_t hash_span_scalar(const uint8_t *data, size_t size, uint64_t seed)
+{
+	uint64_t lanes[4] = { seed, seed ^ 1, seed ^ 2, seed ^ 3 };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		for (auto lane = 0; lane < 4; ++lane) {
+			lanes[lane] = (lanes[lane] ^ load_word(data + i + lane * 8)) * hash_prime;
+		}
+	}
+
+	auto hash = lanes[0] ^ rotate_left(lanes[1], 17) ^ rotate_left(lanes[2], 31) ^ rotate_left(lanes[3], 47);
+	for (; i < size; ++i) {
+		hash = (hash ^ data[i]) * hash_prime;
+	}
+	return hash ^ (hash >> 29);
+}
+
+#ifdef ENABLE_SIMD_HASH
+
+// Hardware crc32 on four interleaved streams, hiding the latency of the instruction.
+TARGET_SSE42 static uint64_t hash_span_crc32(const uint8_t *data, size_t size, uint64_t seed)
+{
+	uint64_t a = seed & 0xffffffff;
+	uint64_t b = seed >> 32;
+	uint64_t c = ~a & 0xffffffff;
+	uint64_t d = ~b & 0xffffffff;
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		a = _mm_crc32_u64(a, load_word(data + i));
+		b = _mm_crc32_u64(b, load_word(data + i + 8));
+		c = _mm_crc32_u64(c, load_word(data + i + 16));
+		d = _mm_crc32_u64(d, load_word(data + i + 24));
+	}
+	for (; i < size; ++i) {
+		a = _mm_crc32_u8((uint32_t)a, data[i]);
+	}
+
+	const uint64_t low = _mm_crc32_u64(_mm_crc32_u64(a, c), b);
+	const uint64_t high = _mm_crc32_u64(_mm_crc32_u64(b, d), a);
+	return (high << 32) | low;
+}
+
+#endif
+
+DirtyTileDetector::DirtyTileDetector()
+	: _width(0)
+	, _height(0)
+	, _depth(0)
+	, _columns(0)
+	, _rows(0)
+	, _dirty_count(0)
+	, _has_reference(false)
+	, _hash(hash_span_scalar)
+{
+#ifdef ENABLE_SIMD_HASH
+	if (av_get_cpu_flags() & AV_CPU_FLAG_SSE42)
+		_hash = hash_span_crc32;
+#endif
+}
+
+void DirtyTileDetector::reset()
+{
+	_has_reference = false;
+}
+
+bool DirtyTileDetector::detect(const uint8_t *frame, int width, int height, short depth)
+{
+	if (width != _width || height != _height || depth != _depth) {
+		_width = width;
+		_height = height;
+		_depth = depth;
+		_columns = (width + tile_size - 1) / tile_size;
+		_rows = (height + tile_size - 1) / tile_size;
+		_reference.assign(_columns * _rows, 0);
+		_current.assign(_columns * _rows, 0);
+		_dirty.assign(_columns * _rows, 1);
+		_has_reference = false;
+	}
+
+	// Walk the image row by row for sequential memory access, chaining the hash
+	// of each tile across the rows it covers.
+	const auto stride = static_cast<size_t>(width) * depth;
+	const auto tile_bytes = static_cast<size_t>(tile_size) * depth;
+	for (auto y = 0; y < height; ++y) {
+		auto *hashes = _current.data() + (y / tile_size) * _columns;
+		if (y % tile_size == 0)
+			std::fill(hashes, hashes + _columns, 0);
+
+		const auto *row = frame + y * stride;
+		for (auto x = 0; x < _columns; ++x) {
+			const auto offset = x * tile_bytes;
+			hashes[x] = _hash(row + offset, std::min(tile_bytes, stride - offset), hashes[x]);
+		}
+	}
+
+	_dirty_count = 0;
+	for (size_t i = 0; i < _current.size(); ++i) {
+		_dirty[i] = !_has_reference || _current[i] != _reference[i];
+		_dirty_count += _dirty[i];
+	}
+	return _dirty_count > 0;
+}
+
+void DirtyTileDetector::commit()
+{
+	_reference.swap(_current);
+	_has_reference = true;
+}
+
+const char* DirtyTileDetector::hash_name() const
+{
+#ifdef ENABLE_SIMD_HASH
+	if (_hash == hash_span_crc32)
+		return "crc32";
+#endif
+	return "scalar";
+}
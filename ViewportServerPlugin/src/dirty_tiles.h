@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Finds which tiles of a captured frame changed since the last committed frame,
+// comparing a hash of every tile instead of keeping a copy of the previous image.
+class DirtyTileDetector
+{
+public:
+	static constexpr int tile_size = 64;
+
+	DirtyTileDetector();
+
+	// Forgets the reference frame, the next frame is reported entirely dirty.
+	void reset();
+
+	// Hashes the frame and fills the dirty mask against the reference frame.
+	// Returns true when at least one tile changed.
+	bool detect(const uint8_t *frame, int width, int height, short depth);
+	// Makes the frame given to the last detect call the reference for the next one.
+	void commit();
+
+	// One byte per tile, row major, non zero when the tile changed.
+	const std::vector<uint8_t>& dirty_tiles() const { return _dirty; }
+	int columns() const { return _columns; }
+	int rows() const { return _rows; }
+	int dirty_count() const { return _dirty_count; }
+
+	const char* hash_name() const;
+private:
+	using SpanHashFunction = uint64_t(*)(const uint8_t *data, size_t size, uint64_t seed);
+
+	std::vector<uint64_t> _reference;
+	std::vector<uint64_t> _current;
+	std::vector<uint8_t> _dirty;
+	int _width;
+	int _height;
+	short _depth;
+	int _columns;
+	int _rows;
+	int _dirty_count;
+	bool _has_reference;
+	SpanHashFunction _hash;
+};
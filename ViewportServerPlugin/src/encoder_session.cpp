@@ -0,0 +1,118 @@
+#include "encoder_session.h"
+#include <algorithm>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+#include <libavcodec/avcodec.h>
+}
+
+// The encoder keeps its reference, lookahead and reconstructed pictures on top of the pool.
+constexpr size_t encoder_frame_estimate = 4;
+
+bool operator == (const EncoderSessionKey &lhs, const EncoderSessionKey &rhs)
+{
+	return same_encoder(lhs, rhs) &&
+		lhs.source_width == rhs.source_width &&
+		lhs.source_height == rhs.source_height &&
+		lhs.depth == rhs.depth &&
+		lhs.conversion_threads == rhs.conversion_threads;
+}
+
+bool same_encoder(const EncoderSessionKey &lhs, const EncoderSessionKey &rhs)
+{
+	return lhs.width == rhs.width &&
+		lhs.height == rhs.height &&
+		lhs.codec == rhs.codec &&
+		lhs.options == rhs.options;
+}
+
+EncoderSession::EncoderSession()
+	: codec(nullptr)
+	, codec_context(nullptr)
+	, convert(nullptr)
+	, needs_key_frame(false)
+{
+}
+
+EncoderSession::~EncoderSession()
+{
+	release_conversion();
+	frame_pool.release();
+	avcodec_free_context(&codec_context);
+}
+
+void EncoderSession::release_conversion()
+{
+	for (auto &band : bands) {
+		if (band.scale_context != nullptr)
+			sws_freeContext(band.scale_context);
+	}
+	bands.clear();
+	convert = nullptr;
+}
+
+size_t EncoderSession::memory_size() const
+{
+	// YUV420P, one and a half byte per pixel.
+	const auto frame_size = static_cast<size_t>(key.width) * key.height * 3 / 2;
+	size_t frames = encoder_frame_estimate;
+	if (frame_pool.initialized())
+		frames += (size_t)frame_pool.size();
+	return frame_size * frames;
+}
+
+EncoderSessionCache::EncoderSessionCache(size_t budget)
+	: _budget(budget)
+	, _memory_size(0)
+{
+}
+
+EncoderSessionCache::~EncoderSessionCache()
+{
+	clear();
+}
+
+void EncoderSessionCache::set_budget(size_t budget)
+{
+	_budget = budget;
+	evict();
+}
+
+EncoderSession* EncoderSessionCache::take(const EncoderSessionKey &key)
+{
+	auto it = std::find_if(_sessions.begin(), _sessions.end(), [&key](EncoderSession *session) { return session->key == key; });
+	if (it == _sessions.end())
+		return nullptr;
+
+	auto *session = *it;
+	_sessions.erase(it);
+	_memory_size -= session->memory_size();
+	return session;
+}
+
+void EncoderSessionCache::put(EncoderSession *session)
+{
+	_sessions.push_front(session);
+	_memory_size += session->memory_size();
+	evict();
+}
+
+void EncoderSessionCache::clear()
+{
+	for (auto *session : _sessions) {
+		delete session;
+	}
+	_sessions.clear();
+	_memory_size = 0;
+}
+
+void EncoderSessionCache::evict()
+{
+	while (!_sessions.empty() && _memory_size > _budget) {
+		auto *session = _sessions.back();
+		_sessions.pop_back();
+		_memory_size -= session->memory_size();
+		delete session;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <list>
+#include <vector>
+#include <string>
+#include "common.h"
+#include "frame_pool.h"
+#include "color_conversion.h"
+
+struct AVCodec;
+struct AVCodecContext;
+struct SwsContext;
+
+// Everything an encoder session depends on, two sessions with the same key are interchangeable.
+struct EncoderSessionKey
+{
+	int source_width;
+	int source_height;
+	short depth;
+	int width;	// encoded size
+	int height;
+	std::string codec;
+	EncodingOptions options;
+	int conversion_threads;
+};
+
+bool operator == (const EncoderSessionKey &lhs, const EncoderSessionKey &rhs);
+// True when both keys can share the same codec context, only the conversion differs.
+bool same_encoder(const EncoderSessionKey &lhs, const EncoderSessionKey &rhs);
+
+// Destination rows [first_row, last_row) converted by one task of the conversion pool.
+struct ConversionBand
+{
+	int first_row;
+	int last_row;
+	// Each band scales its own slice, sws_scale keeps state between slices of a context.
+	SwsContext *scale_context;
+};
+
+// Ready to use encoder and conversion for one source size and codec configuration.
+struct EncoderSession
+{
+	EncoderSession();
+	~EncoderSession();
+	EncoderSession(const EncoderSession&) = delete;
+	EncoderSession& operator = (const EncoderSession&) = delete;
+
+	void release_conversion();
+	// Rough footprint of the encoder and its frames, used for the cache budget.
+	size_t memory_size() const;
+
+	EncoderSessionKey key;
+	AVCodec *codec;
+	AVCodecContext *codec_context;
+	RgbToYuvFunction convert;
+	std::vector<ConversionBand> bands;
+	FramePool frame_pool;
+	// Set when the session was parked, the encoder still references older frames of another size.
+	bool needs_key_frame;
+};
+
+// Least recently used set of parked encoder sessions, bounded by an estimated memory budget.
+class EncoderSessionCache
+{
+public:
+	explicit EncoderSessionCache(size_t budget);
+	~EncoderSessionCache();
+
+	void set_budget(size_t budget);
+
+	// Removes the session matching the key from the cache, nullptr when there is none.
+	EncoderSession* take(const EncoderSessionKey &key);
+	// Keeps a session that is not used anymore, evicting the oldest ones over the budget.
+	void put(EncoderSession *session);
+	void clear();
+
+	size_t size() const { return _sessions.size(); }
+	size_t memory_size() const { return _memory_size; }
+private:
+	void evict();
+
+	// Most recently used first.
+	std::list<EncoderSession*> _sessions;
+	size_t _budget;
+	size_t _memory_size;
+};
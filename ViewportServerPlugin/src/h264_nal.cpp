@@ -0,0 +1,43 @@
+#include "h264_nal.h"
+
+namespace {
+	// Returns the offset of the first byte after the next 00 00 01 start code, or size.
+	size_t next_start_code(const uint8_t *data, size_t size, size_t offset)
+	{
+		for (auto i = offset; i + 2 < size; ++i) {
+			if (data[i + 2] > 1) {
+				i += 2;
+			} else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+				return i + 3;
+			}
+		}
+		return size;
+	}
+}
+
+void for_each_nal(const uint8_t *data, size_t size, const std::function<void(const uint8_t *nal, size_t size)> &visit)
+{
+	auto begin = next_start_code(data, size, 0);
+	while (begin < size) {
+		auto next = next_start_code(data, size, begin);
+		auto end = next == size ? size : next - 3;
+		// The zero byte of a four byte start code belongs to the next NAL unit.
+		while (end > begin && data[end - 1] == 0 && next != size)
+			--end;
+		if (end > begin)
+			visit(data + begin, end - begin);
+		begin = next;
+	}
+}
+
+bool is_reference_access_unit(const uint8_t *data, size_t size)
+{
+	auto reference = false;
+	for_each_nal(data, size, [&reference](const uint8_t *nal, size_t)
+	{
+		auto type = nal_type(nal);
+		if ((type == NalType::SLICE || type == NalType::IDR_SLICE) && nal_ref_idc(nal) != 0)
+			reference = true;
+	});
+	return reference;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+// NAL unit types of an H.264 Annex-B stream used by the server.
+enum class NalType : uint8_t
+{
+	SLICE = 1,
+	IDR_SLICE = 5,
+	SEI = 6,
+	SPS = 7,
+	PPS = 8,
+	ACCESS_UNIT_DELIMITER = 9
+};
+
+// Calls visit with every NAL unit of an Annex-B buffer, the start code excluded.
+void for_each_nal(const uint8_t *data, size_t size, const std::function<void(const uint8_t *nal, size_t size)> &visit);
+
+inline NalType nal_type(const uint8_t *nal) { return (NalType)(nal[0] & 0x1f); }
+inline int nal_ref_idc(const uint8_t *nal) { return (nal[0] >> 5) & 0x03; }
+
+// True when a slice of the access unit can be referenced by later frames,
+// dropping an access unit that is not leaves the decoder in sync.
+bool is_reference_access_unit(const uint8_t *data, size_t size);
@@ -0,0 +1,69 @@
+#include "latency_histogram.h"
+#include <algorithm>
+
+namespace {
+	int most_significant_bit(uint32_t value)
+	{
+		auto bit = 0;
+		while (value >>= 1)
+			++bit;
+		return bit;
+	}
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+void LatencyHistogram::reset()
+{
+	_buckets.fill(0);
+	_count = 0;
+}
+
+void LatencyHistogram::add(int64_t duration_us)
+{
+	auto value = (uint32_t)std::min<int64_t>(std::max<int64_t>(duration_us, 0), UINT32_MAX);
+	++_buckets[bucket_index(value)];
+	++_count;
+}
+
+int64_t LatencyHistogram::percentile(double fraction) const
+{
+	if (_count == 0)
+		return 0;
+
+	auto rank = std::max<int64_t>(1, (int64_t)(fraction * _count + 0.5));
+	int64_t seen = 0;
+	for (auto i = 0; i < bucket_count; ++i) {
+		seen += _buckets[i];
+		if (seen >= rank)
+			return bucket_value(i);
+	}
+	return bucket_value(bucket_count - 1);
+}
+
+int LatencyHistogram::bucket_index(uint32_t value)
+{
+	// Values below sub_bucket_count have a bucket each, larger ones keep their
+	// sub_bucket_bits most significant bits after the leading one.
+	if (value < sub_bucket_count)
+		return value;
+
+	auto msb = most_significant_bit(value);
+	auto shift = msb - sub_bucket_bits;
+	return (shift + 1) * sub_bucket_count + ((value >> shift) & (sub_bucket_count - 1));
+}
+
+int64_t LatencyHistogram::bucket_value(int index)
+{
+	if (index < sub_bucket_count)
+		return index;
+
+	// Middle of the range covered by the bucket.
+	auto shift = index / sub_bucket_count - 1;
+	auto sub_bucket = index % sub_bucket_count;
+	auto low = (int64_t)(sub_bucket_count + sub_bucket) << shift;
+	return low + ((int64_t)1 << shift) / 2;
+}
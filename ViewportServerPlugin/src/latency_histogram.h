@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <array>
+
+// Histogram of durations in microseconds with log-linear buckets, eight per power of two,
+// so percentiles are within 12.5% of the recorded values for a fixed amount of memory.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void add(int64_t duration_us);
+	void reset();
+
+	int64_t count() const { return _count; }
+	// Duration under which the given fraction of the samples fall, 0 without samples.
+	int64_t percentile(double fraction) const;
+private:
+	static constexpr int sub_bucket_bits = 3;
+	static constexpr int sub_bucket_count = 1 << sub_bucket_bits;
+	static constexpr int bucket_count = (32 - sub_bucket_bits + 1) * sub_bucket_count;
+
+	static int bucket_index(uint32_t value);
+	static int64_t bucket_value(int index);
+
+	std::array<uint32_t, bucket_count> _buckets;
+	int64_t _count;
+};
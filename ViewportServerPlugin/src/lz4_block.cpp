@@ -0,0 +1,173 @@
+#include "lz4_block.h"
+#include <cstring>
+
+namespace {
+	constexpr int min_match = 4;
+	// The last match starts at least match_find_limit bytes before the end and the block ends with last_literals literals.
+	constexpr int match_find_limit = 12;
+	constexpr int last_literals = 5;
+	constexpr int max_offset = 65535;
+	constexpr int hash_bits = 12;
+	// Positions are skipped faster the longer no match is found, incompressible data goes through quickly.
+	constexpr int skip_trigger = 6;
+
+	uint32_t read32(const uint8_t *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	uint32_t hash(uint32_t sequence)
+	{
+		return (sequence * 2654435761u) >> (32 - hash_bits);
+	}
+
+	bool write_length(uint8_t *&op, const uint8_t *oend, int length)
+	{
+		for (length -= 15; length >= 255; length -= 255) {
+			if (op >= oend)
+				return false;
+			*op++ = 255;
+		}
+		if (op >= oend)
+			return false;
+		*op++ = (uint8_t)length;
+		return true;
+	}
+
+	bool read_length(const uint8_t *&ip, const uint8_t *iend, int limit, int &length)
+	{
+		uint8_t byte;
+		do {
+			if (ip >= iend || length > limit)
+				return false;
+			byte = *ip++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	// Literals followed by a match, or the final literals when match_length is 0.
+	bool write_sequence(uint8_t *&op, const uint8_t *oend, const uint8_t *literals, int literal_length, int offset, int match_length)
+	{
+		if (op >= oend)
+			return false;
+		auto *token = op++;
+		*token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+		if (literal_length >= 15 && !write_length(op, oend, literal_length))
+			return false;
+		if (oend - op < literal_length)
+			return false;
+		memcpy(op, literals, literal_length);
+		op += literal_length;
+
+		if (match_length == 0)
+			return true;
+
+		if (oend - op < 2)
+			return false;
+		*op++ = (uint8_t)offset;
+		*op++ = (uint8_t)(offset >> 8);
+		auto length = match_length - min_match;
+		*token |= (uint8_t)(length >= 15 ? 15 : length);
+		return length < 15 || write_length(op, oend, length);
+	}
+}
+
+int lz4_compress_block(const uint8_t *source, int size, uint8_t *destination, int capacity)
+{
+	auto *op = destination;
+	const auto *oend = destination + capacity;
+	auto anchor = 0;
+
+	if (size > match_find_limit) {
+		uint32_t table[1 << hash_bits] = {};
+		const auto match_limit = size - match_find_limit;
+		const auto match_end = size - last_literals;
+
+		auto ip = 1;
+		auto attempts = 1 << skip_trigger;
+		while (ip < match_limit) {
+			auto sequence = read32(source + ip);
+			auto h = hash(sequence);
+			auto candidate = (int)table[h];
+			table[h] = ip;
+
+			if (ip - candidate > max_offset || read32(source + candidate) != sequence) {
+				ip += attempts++ >> skip_trigger;
+				continue;
+			}
+
+			while (ip > anchor && candidate > 0 && source[ip - 1] == source[candidate - 1]) {
+				--ip;
+				--candidate;
+			}
+			auto match_length = min_match;
+			while (ip + match_length < match_end && source[ip + match_length] == source[candidate + match_length]) {
+				++match_length;
+			}
+
+			if (!write_sequence(op, oend, source + anchor, ip - anchor, ip - candidate, match_length))
+				return 0;
+			ip += match_length;
+			anchor = ip;
+			attempts = 1 << skip_trigger;
+		}
+	}
+
+	if (!write_sequence(op, oend, source + anchor, size - anchor, 0, 0))
+		return 0;
+	return (int)(op - destination);
+}
+
+int lz4_decompress_block(const uint8_t *source, int compressed_size, uint8_t *destination, int capacity)
+{
+	const auto *ip = source;
+	const auto *iend = source + compressed_size;
+	auto *op = destination;
+	const auto *oend = destination + capacity;
+
+	while (ip < iend) {
+		auto token = *ip++;
+
+		auto literal_length = token >> 4;
+		if (literal_length == 15 && !read_length(ip, iend, capacity, literal_length))
+			return -1;
+		if (literal_length > iend - ip || literal_length > oend - op)
+			return -1;
+		memcpy(op, ip, literal_length);
+		ip += literal_length;
+		op += literal_length;
+
+		// The last sequence has no match.
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		auto offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - destination)
+			return -1;
+
+		auto match_length = token & 15;
+		if (match_length == 15 && !read_length(ip, iend, capacity, match_length))
+			return -1;
+		match_length += min_match;
+		if (match_length > oend - op)
+			return -1;
+
+		// Overlapping matches repeat the bytes just written.
+		const auto *match = op - offset;
+		if (offset >= match_length) {
+			memcpy(op, match, match_length);
+			op += match_length;
+		} else {
+			for (auto i = 0; i < match_length; ++i) {
+				*op++ = *match++;
+			}
+		}
+	}
+	return (int)(op - destination);
+}
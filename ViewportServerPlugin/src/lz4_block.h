@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdint>
+
+// LZ4 block format, https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// Blocks are independent, matches never reach before the start of the block.
+
+// Returns the compressed size, or 0 when the block does not fit in capacity bytes.
+int lz4_compress_block(const uint8_t *source, int size, uint8_t *destination, int capacity);
+
+// Returns the decompressed size, or -1 for malformed input or output larger than capacity.
+int lz4_decompress_block(const uint8_t *source, int compressed_size, uint8_t *destination, int capacity);
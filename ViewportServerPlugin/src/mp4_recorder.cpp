@@ -0,0 +1,339 @@
+#include "mp4_recorder.h"
+#include "h264_nal.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+
+namespace {
+	// The SPS and PPS NAL units of an access unit, each after a four byte start code.
+	std::vector<uint8_t> in_band_parameter_sets(const uint8_t *data, size_t size)
+	{
+		static const uint8_t start_code[] = { 0, 0, 0, 1 };
+		std::vector<uint8_t> parameter_sets;
+		for_each_nal(data, size, [&parameter_sets](const uint8_t *nal, size_t nal_size)
+		{
+			auto type = nal_type(nal);
+			if (type != NalType::SPS && type != NalType::PPS)
+				return;
+			parameter_sets.insert(parameter_sets.end(), start_code, start_code + sizeof(start_code));
+			parameter_sets.insert(parameter_sets.end(), nal, nal + nal_size);
+		});
+		return parameter_sets;
+	}
+}
+
+Mp4Recorder::Mp4Recorder(std::function<void(const std::string&)> info, std::function<void(const std::string&)> error)
+	: _info(info)
+	, _error(error)
+	, _opened(false)
+	, _quit(false)
+	, _waiting_for_key_frame(true)
+	, _io_thread(nullptr)
+	, _file(nullptr)
+	, _format_context(nullptr)
+	, _video_stream(nullptr)
+	, _file_count(0)
+	, _start_time_us(0)
+	, _last_pts(-1)
+	, _written_bytes(0)
+	, _dropped_packets(0)
+{
+	_queue.reserve(max_queued_packets);
+}
+
+Mp4Recorder::~Mp4Recorder()
+{
+	close();
+}
+
+bool Mp4Recorder::open(const std::string &path)
+{
+	close();
+
+	_path = path;
+	_parameter_sets.clear();
+	_file_count = 0;
+	_written_bytes = 0;
+	_dropped_packets = 0;
+	{
+		critical_section_holder csh(_queue_mutex);
+		_opened = true;
+		_quit = false;
+		_waiting_for_key_frame = true;
+	}
+	_io_thread = new std::thread(&Mp4Recorder::run_io_thread, this);
+	return true;
+}
+
+void Mp4Recorder::close()
+{
+	if (_io_thread == nullptr)
+		return;
+
+	{
+		critical_section_holder csh(_queue_mutex);
+		_opened = false;
+		_quit = true;
+	}
+	_packet_queued.notify_one();
+	_io_thread->join();
+	delete _io_thread;
+	_io_thread = nullptr;
+}
+
+bool Mp4Recorder::opened() const
+{
+	critical_section_holder csh(_queue_mutex);
+	return _opened;
+}
+
+void Mp4Recorder::write(const AVPacket *packet, int64_t time_us, const AVCodecContext *context)
+{
+	auto key_frame = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+	{
+		critical_section_holder csh(_queue_mutex);
+		if (!_opened)
+			return;
+
+		// A file must not miss a frame between two IDR frames, once one is dropped the following wait for the next IDR frame.
+		if ((_waiting_for_key_frame && !key_frame) || _queue.size() >= max_queued_packets) {
+			_waiting_for_key_frame = true;
+			++_dropped_packets;
+			return;
+		}
+	}
+
+	// The packet data is shared with the live stream, only the reference is new.
+	QueuedPacket queued;
+	auto *reference = av_packet_alloc();
+	if (reference == nullptr || av_packet_ref(reference, packet) < 0) {
+		av_packet_free(&reference);
+		++_dropped_packets;
+		return;
+	}
+	queued.packet = std::shared_ptr<AVPacket>(reference, [](AVPacket *p) { av_packet_free(&p); });
+	queued.time_us = time_us;
+	if (key_frame) {
+		auto *parameters = avcodec_parameters_alloc();
+		if (parameters != nullptr && avcodec_parameters_from_context(parameters, context) >= 0)
+			queued.parameters = std::shared_ptr<AVCodecParameters>(parameters, [](AVCodecParameters *p) { avcodec_parameters_free(&p); });
+		else
+			avcodec_parameters_free(&parameters);
+	}
+
+	{
+		critical_section_holder csh(_queue_mutex);
+		if (!_opened)
+			return;
+		if (key_frame)
+			_waiting_for_key_frame = false;
+		_queue.push_back(std::move(queued));
+	}
+	_packet_queued.notify_one();
+}
+
+void Mp4Recorder::run_io_thread()
+{
+	std::vector<QueuedPacket> batch;
+	batch.reserve(max_queued_packets);
+	auto quit = false;
+	while (!quit) {
+		{
+			std::unique_lock<std::mutex> lock(_queue_mutex);
+			_packet_queued.wait_for(lock, std::chrono::milliseconds(sync_interval_ms), [this]() { return _quit || !_queue.empty(); });
+			batch.swap(_queue);
+			quit = _quit;
+		}
+
+		for (const auto &queued : batch) {
+			mux(queued);
+		}
+		batch.clear();
+
+		// The stdio buffer takes the small fragment writes, the disk only sees them on this schedule.
+		if (_file != nullptr && std::chrono::steady_clock::now() - _last_sync >= std::chrono::milliseconds(sync_interval_ms))
+			sync_file();
+	}
+	close_file();
+}
+
+void Mp4Recorder::mux(const QueuedPacket &queued)
+{
+	auto *packet = queued.packet.get();
+	if ((packet->flags & AV_PKT_FLAG_KEY) && queued.parameters != nullptr) {
+		auto parameter_sets = in_band_parameter_sets(packet->data, packet->size);
+		if (parameter_sets.empty() && queued.parameters->extradata_size > 0)
+			parameter_sets.assign(queued.parameters->extradata, queued.parameters->extradata + queued.parameters->extradata_size);
+
+		if (!parameter_sets.empty() && parameter_sets != _parameter_sets) {
+			close_file();
+			_parameter_sets = std::move(parameter_sets);
+			if (!open_file(queued.parameters.get())) {
+				_parameter_sets.clear();
+				return;
+			}
+			_start_time_us = queued.time_us;
+			_last_pts = -1;
+		}
+	}
+
+	// Waits for an IDR frame with its parameter sets.
+	if (_format_context == nullptr)
+		return;
+
+	AVPacket output;
+	av_init_packet(&output);
+	if (av_packet_ref(&output, packet) < 0)
+		return;
+
+	// Streams are encoded without B-frames, the capture time is both the presentation and the decoding time.
+	auto pts = av_rescale_q(queued.time_us - _start_time_us, AVRational{ 1, 1000000 }, _video_stream->time_base);
+	pts = std::max(pts, _last_pts + 1);
+	output.pts = pts;
+	output.dts = pts;
+	output.duration = 0;
+	output.stream_index = _video_stream->index;
+	_last_pts = pts;
+
+	auto result = av_write_frame(_format_context, &output);
+	av_packet_unref(&output);
+	if (result < 0) {
+		_error("Could not write to recording " + file_path(_file_count - 1));
+		// The next IDR frame starts a new file.
+		close_file();
+		_parameter_sets.clear();
+	}
+}
+
+bool Mp4Recorder::open_file(const AVCodecParameters *parameters)
+{
+	auto path = file_path(_file_count);
+	if (fopen_s(&_file, path.c_str(), "wb") != 0 || _file == nullptr) {
+		_error("Could not open recording " + path);
+		_file = nullptr;
+		return false;
+	}
+	setvbuf(_file, nullptr, _IOFBF, write_buffer_size);
+
+	avformat_alloc_output_context2(&_format_context, nullptr, "mp4", nullptr);
+	if (_format_context == nullptr) {
+		_error("Failed to allocate format context with format mp4");
+		close_file();
+		return false;
+	}
+
+	_video_stream = avformat_new_stream(_format_context, nullptr);
+	auto *io_buffer = (unsigned char*)av_malloc(io_buffer_size);
+	if (_video_stream == nullptr || io_buffer == nullptr || avcodec_parameters_copy(_video_stream->codecpar, parameters) < 0) {
+		_error("Failed to open video stream of recording " + path);
+		av_free(io_buffer);
+		close_file();
+		return false;
+	}
+
+	auto *codecpar = _video_stream->codecpar;
+	av_freep(&codecpar->extradata);
+	codecpar->extradata = (uint8_t*)av_mallocz(_parameter_sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	codecpar->extradata_size = codecpar->extradata != nullptr ? (int)_parameter_sets.size() : 0;
+	if (codecpar->extradata != nullptr)
+		memcpy(codecpar->extradata, _parameter_sets.data(), _parameter_sets.size());
+	_video_stream->time_base = AVRational{ 1, 90000 };
+
+	_format_context->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, (void*)this, nullptr, [](void *opaque, uint8_t *buf, int buf_size)
+	{
+		auto self = static_cast<Mp4Recorder*>(opaque);
+		auto written = fwrite(buf, 1, buf_size, self->_file);
+		self->_written_bytes += written;
+		return written == (size_t)buf_size ? buf_size : AVERROR(EIO);
+	}, nullptr);
+	if (_format_context->pb == nullptr) {
+		_error("Could not open output of recording " + path);
+		av_free(io_buffer);
+		close_file();
+		return false;
+	}
+
+	// Every fragment is playable on its own, a recording cut short by a crash keeps its written fragments.
+	AVDictionary *options = nullptr;
+	av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+	av_dict_set(&options, "frag_duration", "1000000", 0);
+	auto result = avformat_write_header(_format_context, &options);
+	av_dict_free(&options);
+	if (result < 0) {
+		_error("Could not write header of recording " + path);
+		free_muxer();
+		close_file();
+		return false;
+	}
+
+	++_file_count;
+	_last_sync = std::chrono::steady_clock::now();
+	_info("Recording to " + path);
+	return true;
+}
+
+void Mp4Recorder::close_file()
+{
+	// Only files whose header was written still have a muxer here.
+	if (_format_context != nullptr && _format_context->pb != nullptr) {
+		av_write_trailer(_format_context);
+		avio_flush(_format_context->pb);
+	}
+	free_muxer();
+
+	if (_file != nullptr) {
+		sync_file();
+		fclose(_file);
+		_file = nullptr;
+	}
+}
+
+void Mp4Recorder::free_muxer()
+{
+	if (_format_context == nullptr)
+		return;
+
+	if (_format_context->pb != nullptr) {
+		av_freep(&_format_context->pb->buffer);
+		av_freep(&_format_context->pb);
+	}
+	avformat_free_context(_format_context);
+	_format_context = nullptr;
+	_video_stream = nullptr;
+}
+
+void Mp4Recorder::sync_file()
+{
+	fflush(_file);
+#ifdef _WIN32
+	_commit(_fileno(_file));
+#else
+	fsync(fileno(_file));
+#endif
+	_last_sync = std::chrono::steady_clock::now();
+}
+
+std::string Mp4Recorder::file_path(int index) const
+{
+	if (index == 0)
+		return _path;
+
+	auto separator = _path.find_last_of("/\\");
+	auto extension = _path.find_last_of('.');
+	if (extension == std::string::npos || (separator != std::string::npos && extension < separator))
+		extension = _path.size();
+	return _path.substr(0, extension) + "_" + std::to_string(index) + _path.substr(extension);
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+struct AVPacket;
+struct AVFormatContext;
+struct AVStream;
+struct AVCodecContext;
+struct AVCodecParameters;
+
+// Writes the packets of a live stream to fragmented MP4 files, without encoding them a second time.
+// The encoder thread only queues references to its packets, a thread of the recorder muxes them and
+// writes to disk. A file starts with an IDR frame and a new one is started when the SPS or PPS change.
+class Mp4Recorder
+{
+public:
+	Mp4Recorder(std::function<void(const std::string&)> info, std::function<void(const std::string&)> error);
+	~Mp4Recorder();
+
+	// The first file is path, the following ones path_1, path_2, ... before the extension.
+	bool open(const std::string &path);
+	// Writes the queued packets and the end of the file before returning.
+	void close();
+	bool opened() const;
+
+	// Called from the encoder thread with the context that encoded the packet, never waits for the disk.
+	// time_us is the capture time of the frame, the recording plays at the pace it was captured.
+	void write(const AVPacket *packet, int64_t time_us, const AVCodecContext *context);
+
+	int64_t written_bytes() const { return _written_bytes; }
+	// Packets not recorded because the disk fell behind, the recording resumes on the next IDR frame.
+	int64_t dropped_packets() const { return _dropped_packets; }
+private:
+	static constexpr size_t max_queued_packets = 240;
+	static constexpr int write_buffer_size = 1024 * 1024;
+	static constexpr int io_buffer_size = 64 * 1024;
+	static constexpr int sync_interval_ms = 2000;
+
+	struct QueuedPacket
+	{
+		std::shared_ptr<AVPacket> packet;
+		int64_t time_us;
+		// Codec parameters of IDR frames, a new file is started from them when the SPS or PPS change.
+		std::shared_ptr<AVCodecParameters> parameters;
+	};
+
+	void run_io_thread();
+	void mux(const QueuedPacket &queued);
+	bool open_file(const AVCodecParameters *parameters);
+	void close_file();
+	void free_muxer();
+	void sync_file();
+	std::string file_path(int index) const;
+
+	std::function<void(const std::string&)> _info;
+	std::function<void(const std::string&)> _error;
+	std::string _path;
+
+	// Guarded by _queue_mutex, the recorder thread takes every queued packet at once.
+	mutable std::mutex _queue_mutex;
+	std::condition_variable _packet_queued;
+	std::vector<QueuedPacket> _queue;
+	bool _opened;
+	bool _quit;
+	bool _waiting_for_key_frame;
+	std::thread *_io_thread;
+
+	// Only used by the recorder thread.
+	FILE *_file;
+	AVFormatContext *_format_context;
+	AVStream *_video_stream;
+	// In-band SPS and PPS of the current file, or the extradata of streams with global headers.
+	std::vector<uint8_t> _parameter_sets;
+	int _file_count;
+	int64_t _start_time_us;
+	int64_t _last_pts;
+	std::chrono::steady_clock::time_point _last_sync;
+
+	std::atomic<int64_t> _written_bytes;
+	std::atomic<int64_t> _dropped_packets;
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Unbounded lock-free queue for any number of producer threads and one consumer thread.
+// Producers link a new node with one atomic exchange, the consumer never waits on them.
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue()
+		: _head(new Node())
+		, _tail(_head.load())
+	{
+	}
+
+	~MpscQueue()
+	{
+		T item;
+		while (pop(item)) {}
+		delete _tail;
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	// Called from any thread.
+	void push(T item)
+	{
+		auto *node = new Node();
+		node->item = std::move(item);
+		auto *previous = _head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	// Called from the consumer thread only. An item being pushed is seen by the next call.
+	bool pop(T &item)
+	{
+		auto *tail = _tail;
+		auto *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return false;
+
+		// The popped node becomes the new empty tail.
+		item = std::move(next->item);
+		_tail = next;
+		delete tail;
+		return true;
+	}
+
+private:
+	struct Node
+	{
+		Node() : next(nullptr) {}
+
+		std::atomic<Node*> next;
+		T item;
+	};
+
+	static constexpr size_t cache_line_size = 64;
+
+	// The producer and consumer ends are kept on their own cache lines with padding rather than alignas,
+	// the queue lives in objects allocated with a plain new.
+	std::atomic<Node*> _head;
+	char _head_padding[cache_line_size - sizeof(std::atomic<Node*>)];
+	Node *_tail;
+	char _tail_padding[cache_line_size - sizeof(Node*)];
+};
@@ -0,0 +1,372 @@
+#include "shared_stream.h"
+#include "viewport_client.h"
+#include "viewport_server.h"
+#include <engine_plugin_api/plugin_api.h>
+#include <plugin_foundation/id_string.h>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <tuple>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+using namespace stingray_plugin_foundation;
+
+struct StreamingStrategy
+{
+	std::string format;
+	std::string path;
+
+	StreamingStrategy(const std::string &&_format, const std::string &&_path)
+		: format(_format)
+		, path(_path)
+	{}
+};
+
+StreamingStrategy file_strategy("mp4", "../../HTML5/live/video.mp4");
+StreamingStrategy rtsp_strategy("rtsp", "rtsp://127.0.0.1:54321/live.sdp");
+StreamingStrategy rtmp_strategy("rtmp", "rtmp://127.0.0.1:54321/live.sdp");
+StreamingStrategy mpegts_strategy("mpegts", "udp://127.0.0.1:54321");
+StreamingStrategy http_strategy("hls", "../../HTML5/live/index.m3u8");
+StreamingStrategy dash_strategy("stream_segment", "../../HTML5/live/video.mp4");
+StreamingStrategy raw_h264_strategy("h264", "video.h264");
+auto &current_strategy = raw_h264_strategy;
+// Every shared stream is also recorded to this directory when set, from the packets of the live stream.
+const char *recording_directory = nullptr; // "../../HTML5/live/recordings"
+int recording_count = 0;
+
+namespace {
+	int64_t now_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+bool operator < (const StreamKey &lhs, const StreamKey &rhs)
+{
+	return std::tie(lhs.win, lhs.buffer_name, lhs.codec, lhs.options) < std::tie(rhs.win, rhs.buffer_name, rhs.codec, rhs.options);
+}
+
+bool operator == (const StreamKey &lhs, const StreamKey &rhs)
+{
+	return std::tie(lhs.win, lhs.buffer_name, lhs.codec, lhs.options) == std::tie(rhs.win, rhs.buffer_name, rhs.codec, rhs.options);
+}
+
+SharedStream::SharedStream(ViewportServer *server, const StreamKey &key)
+	: _server(server)
+	, _key(key)
+	, _streamer(nullptr)
+	, _written_bytes(0)
+	, _reconfigure_stream(false)
+	, _resize_requested_us(0)
+	, _resize_latency_ms(-1)
+	, _last_key_frame_request_us(0)
+	, _capture_buffer(new SC_Buffer())
+	, _captured(false)
+{
+	_streamer = new Streamer({
+		[this](uint8_t* buffer, int size) { broadcast_buffer(buffer, size); },
+		[this](const std::string &msg) { _server->info(msg); },
+		[this](const std::string &msg) { _server->warning(msg); },
+		[this](const std::string &msg) { _server->error(msg); },
+		[this](const PacketRef &packet, const FrameHeader &header) { broadcast_packet(packet, header); }
+	});
+	_streamer->init();
+	if (recording_directory != nullptr)
+		_streamer->start_recording(std::string(recording_directory) + "/viewport_" + std::to_string(std::time(nullptr)) + "_" + std::to_string(recording_count++) + ".mp4");
+
+	if (window_valid())
+		_server->apis().stream_capture_api->enable_capture(_key.win, 1, (uint32_t*)&_key.buffer_name);
+}
+
+SharedStream::~SharedStream()
+{
+	// Stops the encoder thread, no packet is broadcast past this point.
+	if (_streamer->stream_opened())
+		_streamer->close_stream();
+	_streamer->shutdown();
+	delete _streamer;
+
+	if (window_valid())
+		_server->apis().stream_capture_api->disable_capture(_key.win, 1, (uint32_t*)&_key.buffer_name);
+	delete _capture_buffer;
+}
+
+void SharedStream::subscribe(ViewportClient *client)
+{
+	{
+		critical_section_holder csh(_subscriber_mutex);
+		if (std::find(_subscribers.begin(), _subscribers.end(), client) != _subscribers.end())
+			return;
+
+		// The cached frame shows the viewport at once, the frames following it were not seen by
+		// this client so it only resumes on the next IDR frame.
+		client->start_from_key_frame();
+		if (_key_frame != nullptr)
+			client->send_cached_frame(_key_frame_header, _key_frame->data, _key_frame->size);
+		_subscribers.push_back(client);
+	}
+
+	// Requests are coalesced until the encoder takes them, a burst of joins gets a single IDR frame.
+	_streamer->request_key_frame();
+}
+
+void SharedStream::unsubscribe(ViewportClient *client)
+{
+	critical_section_holder csh(_subscriber_mutex);
+	_subscribers.erase(std::remove(_subscribers.begin(), _subscribers.end(), client), _subscribers.end());
+}
+
+int SharedStream::subscriber_count() const
+{
+	critical_section_holder csh(_subscriber_mutex);
+	return (int)_subscribers.size();
+}
+
+void SharedStream::request_reconfigure()
+{
+	_resize_requested_us = now_us();
+	_reconfigure_stream = true;
+}
+
+void SharedStream::request_key_frame()
+{
+	auto now = now_us();
+	auto last = _last_key_frame_request_us.load();
+	if (now - last < key_frame_request_interval_us || !_last_key_frame_request_us.compare_exchange_strong(last, now))
+		return;
+
+	_streamer->request_key_frame();
+}
+
+void SharedStream::run()
+{
+	if (capture()) {
+		encode_captured();
+		release_capture();
+	}
+}
+
+bool SharedStream::capture()
+{
+	if (!_streamer->initialized() || !window_valid())
+		return false;
+
+	_server->apis().profiler_api->profile_start("SharedStream:capture_buffer");
+	_captured = _server->apis().stream_capture_api->capture_buffer(_key.win, _key.buffer_name, _server->allocator(), _capture_buffer) != 0;
+	_server->apis().profiler_api->profile_stop();
+	return _captured;
+}
+
+void SharedStream::encode_captured()
+{
+	if (!_captured)
+		return;
+
+	const auto &capture_buffer = *_capture_buffer;
+	auto num_byte = _server->apis().render_buffer_api->num_bits(capture_buffer.format) >> 3;
+	if (!_streamer->stream_opened()) {
+		_streamer->open_stream(capture_buffer.width, capture_buffer.height, num_byte, current_strategy.format, _key.codec, _key.options);
+		_bitrate_controller.reset(_streamer->bitrate());
+	} else if (_reconfigure_stream || _streamer->streaming_info() != StreamingInfo{ (int)capture_buffer.width, (int)capture_buffer.height, (short)num_byte }) {
+		if (!_streamer->reconfigure(capture_buffer.width, capture_buffer.height, num_byte, _key.codec, _key.options)) {
+			_streamer->close_stream();
+			_streamer->open_stream(capture_buffer.width, capture_buffer.height, num_byte, current_strategy.format, _key.codec, _key.options);
+			_bitrate_controller.reset(_streamer->bitrate());
+		}
+	}
+	_reconfigure_stream = false;
+	_streamer->stream_frame((uint8_t*)capture_buffer.data, capture_buffer.width, capture_buffer.height, num_byte);
+	update_bitrate();
+}
+
+void SharedStream::release_capture()
+{
+	if (!_captured)
+		return;
+
+	_server->apis().allocator_api->deallocate(_server->allocator(), _capture_buffer->data);
+	_captured = false;
+}
+
+void SharedStream::update_bitrate()
+{
+	if (!_streamer->stream_opened())
+		return;
+
+	// Every subscriber receives the same packets, the most congested one sets the rate.
+	// Subscribers past their high water mark drop frames instead of slowing down the others.
+	size_t buffered = 0;
+	auto settings = _bitrate_controller.settings();
+	{
+		critical_section_holder csh(_subscriber_mutex);
+		auto first = true;
+		for (auto *client : _subscribers) {
+			if (client->lagging())
+				continue;
+			buffered = std::max(buffered, client->buffered_amount());
+			auto client_settings = client->rate_control();
+			if (first) {
+				settings = client_settings;
+				first = false;
+			} else {
+				settings.min_bitrate = std::max(settings.min_bitrate, client_settings.min_bitrate);
+				settings.max_bitrate = std::min(settings.max_bitrate, client_settings.max_bitrate);
+				settings.target_latency_ms = std::min(settings.target_latency_ms, client_settings.target_latency_ms);
+			}
+		}
+	}
+	// A floor asked by one subscriber does not override the ceiling of another.
+	settings.min_bitrate = std::min(settings.min_bitrate, settings.max_bitrate);
+	const auto &current = _bitrate_controller.settings();
+	if (settings.min_bitrate != current.min_bitrate || settings.max_bitrate != current.max_bitrate || settings.target_latency_ms != current.target_latency_ms)
+		_bitrate_controller.set_settings(settings);
+	if (!_bitrate_controller.update(buffered, _written_bytes, BitrateController::clock::now()))
+		return;
+
+	const auto &decision = _bitrate_controller.decision();
+	_streamer->set_bitrate(decision.bitrate);
+	_streamer->set_output_scale(decision.scale_percent);
+}
+
+void SharedStream::on_packet_written(int size)
+{
+	_written_bytes += size;
+
+	auto requested = _resize_requested_us.exchange(0);
+	if (requested != 0) {
+		_resize_latency_ms = (now_us() - requested) / 1000;
+		_server->info("Resize to first frame: " + std::to_string(_resize_latency_ms) + " ms");
+	}
+}
+
+void SharedStream::broadcast_packet(const PacketRef &packet, const FrameHeader &header)
+{
+	on_packet_written(packet->size);
+
+	critical_section_holder csh(_subscriber_mutex);
+	if (header.flags & FRAME_FLAG_KEY_FRAME) {
+		_key_frame = packet;
+		_key_frame_header = header;
+	}
+	for (auto *client : _subscribers) {
+		client->send_frame(header, packet->data, packet->size);
+	}
+}
+
+void SharedStream::broadcast_buffer(uint8_t *buffer, int size)
+{
+	on_packet_written(size);
+
+	critical_section_holder csh(_subscriber_mutex);
+	for (auto *client : _subscribers) {
+		client->send_binary(buffer, size);
+	}
+}
+
+void SharedStream::append_stats(std::stringstream &ss) const
+{
+	ss << ",\"subscribers\":" << subscriber_count();
+	if (_streamer->stream_opened()) {
+		ss << ",\"dropped_frames\":" << _streamer->dropped_frames()
+			<< ",\"skipped_frames\":" << _streamer->skipped_frames()
+			<< ",\"dirty_tiles\":" << _streamer->tile_detector().dirty_count()
+			<< ",\"frame_allocations\":" << _streamer->frame_allocations()
+			<< ",\"bitrate\":" << _streamer->bitrate()
+			<< ",\"output_scale\":" << _streamer->output_scale()
+			<< ",\"queue_delay_ms\":" << _bitrate_controller.queue_delay_ms()
+			<< ",\"throughput\":" << (int64_t)_bitrate_controller.throughput()
+			<< ",\"resize_latency_ms\":" << _resize_latency_ms
+			<< ",\"session_cache_hits\":" << _streamer->session_cache_hits()
+			<< ",\"session_cache_misses\":" << _streamer->session_cache_misses()
+			<< ",\"conversion_us\":[";
+		auto timings = _streamer->conversion_timings();
+		for (size_t i = 0; i < timings.size(); ++i) {
+			ss << (i == 0 ? "" : ",") << timings[i];
+		}
+		ss << "]";
+	}
+	if (_streamer->recording()) {
+		ss << ",\"recorded_bytes\":" << _streamer->recorder().written_bytes()
+			<< ",\"recording_dropped_packets\":" << _streamer->recorder().dropped_packets();
+	}
+}
+
+bool SharedStream::window_valid() const
+{
+	if (_key.win == nullptr)
+		return false;
+
+	if (_server->apis().script_api == nullptr)
+		return false;
+
+	if (!_server->apis().script_api->Window->has_window((WindowPtr)_key.win) ||
+		_server->apis().script_api->Window->is_closing((WindowPtr)_key.win))
+		return false;
+
+	return true;
+}
+
+StreamRegistry::StreamRegistry(ViewportServer *server)
+	: _server(server)
+{
+}
+
+StreamRegistry::~StreamRegistry()
+{
+	clear();
+}
+
+SharedStream* StreamRegistry::subscribe(const StreamKey &key, ViewportClient *client)
+{
+	auto it = _streams.find(key);
+	if (it == _streams.end()) {
+		it = _streams.emplace(key, new SharedStream(_server, key)).first;
+		_server->info("Shared streams: " + std::to_string(_streams.size()));
+	}
+
+	it->second->subscribe(client);
+	return it->second;
+}
+
+void StreamRegistry::unsubscribe(SharedStream *stream, ViewportClient *client)
+{
+	stream->unsubscribe(client);
+	if (stream->subscriber_count() > 0)
+		return;
+
+	_streams.erase(stream->key());
+	delete stream;
+	_server->info("Shared streams: " + std::to_string(_streams.size()));
+}
+
+void StreamRegistry::run_all(TaskPool *pool)
+{
+	_server->apis().profiler_api->profile_start("ViewportServer:run_all_streams");
+	std::vector<SharedStream*> captured;
+	for (auto &entry : _streams) {
+		if (entry.second->capture())
+			captured.push_back(entry.second);
+	}
+
+	// Streams only share the engine thread, their frames are handed to their encoders in parallel.
+	// The pool returns once every job is done, no capture buffer is read past this point.
+	pool->run((int)captured.size(), [&captured](int i) { captured[i]->encode_captured(); });
+
+	for (auto *stream : captured) {
+		stream->release_capture();
+	}
+	_server->apis().profiler_api->profile_stop();
+}
+
+void StreamRegistry::clear()
+{
+	for (auto &entry : _streams) {
+		delete entry.second;
+	}
+	_streams.clear();
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "common.h"
+#include "streamer.h"
+#include "bitrate_controller.h"
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+
+class ViewportServer;
+class TaskPool;
+struct SC_Buffer;
+
+// What is captured and how it is encoded, clients with equal keys watch the same stream.
+struct StreamKey
+{
+	void *win;
+	unsigned buffer_name;
+	std::string codec;
+	EncodingOptions options;
+};
+
+bool operator < (const StreamKey &lhs, const StreamKey &rhs);
+bool operator == (const StreamKey &lhs, const StreamKey &rhs);
+
+// One capture and one encoder for every client subscribed to the same key.
+// Subscribers are managed from the main thread, packets are sent to them from the encoder thread.
+class SharedStream
+{
+public:
+	SharedStream(ViewportServer *server, const StreamKey &key);
+	~SharedStream();
+
+	const StreamKey& key() const { return _key; }
+
+	// A new subscriber is sent the last IDR frame right away and waits for the next one,
+	// which the encoder is asked for. Joins before that frame is encoded share it.
+	void subscribe(ViewportClient *client);
+	void unsubscribe(ViewportClient *client);
+	int subscriber_count() const;
+
+	// Captures and encodes the next frame of the viewport, once per update whatever the number of subscribers.
+	void run();
+	// run in three steps. capture and release_capture are called on the engine thread,
+	// encode_captured on any thread, in parallel with the other streams.
+	bool capture();
+	void encode_captured();
+	void release_capture();
+	// The encoder is reconfigured with the next captured frame.
+	void request_reconfigure();
+	// Asks the encoder for an IDR frame for a subscriber that lost the stream. Every other subscriber
+	// receives the larger frame too, so requests are limited to one every 500 ms.
+	// Can be called from the encoder thread.
+	void request_key_frame();
+
+	// Writes the encoder statistics as members of the "stats" json message.
+	void append_stats(std::stringstream &ss) const;
+private:
+	static constexpr int64_t key_frame_request_interval_us = 500000;
+
+	bool window_valid() const;
+	void update_bitrate();
+	void on_packet_written(int size);
+	void broadcast_packet(const PacketRef &packet, const FrameHeader &header);
+	void broadcast_buffer(uint8_t *buffer, int size);
+
+	ViewportServer *_server;
+	StreamKey _key;
+	Streamer *_streamer;
+
+	mutable std::mutex _subscriber_mutex;
+	std::vector<ViewportClient*> _subscribers;
+	// Last IDR access unit with its in-band SPS and PPS, guarded by _subscriber_mutex.
+	PacketRef _key_frame;
+	FrameHeader _key_frame_header;
+
+	// Paced by the most congested subscriber that still keeps up, within the most restrictive of their limits.
+	// Fed from the packets written by the encoder thread.
+	BitrateController _bitrate_controller;
+	std::atomic<uint64_t> _written_bytes;
+
+	bool _reconfigure_stream;
+	// Time of the last reconfiguration request in microseconds, 0 once its first packet was written.
+	std::atomic<int64_t> _resize_requested_us;
+	std::atomic<int64_t> _resize_latency_ms;
+	std::atomic<int64_t> _last_key_frame_request_us;
+
+	// Captured by capture and held until release_capture.
+	SC_Buffer *_capture_buffer;
+	bool _captured;
+};
+
+// Shared streams by key, refcounted by their subscribers. Only used from the main thread.
+class StreamRegistry
+{
+public:
+	explicit StreamRegistry(ViewportServer *server);
+	~StreamRegistry();
+
+	// Returns the stream of the key, created for its first subscriber.
+	SharedStream* subscribe(const StreamKey &key, ViewportClient *client);
+	// The stream is destroyed with its last subscriber.
+	void unsubscribe(SharedStream *stream, ViewportClient *client);
+
+	// Captures every stream on the calling thread and hands their frames to the encoders as jobs of the pool.
+	void run_all(TaskPool *pool);
+	void clear();
+
+	int stream_count() const { return (int)_streams.size(); }
+private:
+	ViewportServer *_server;
+	std::map<StreamKey, SharedStream*> _streams;
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+public:
+	SpscQueue()
+		: _head(0)
+		, _tail(0)
+	{
+	}
+
+	// Called from the producer thread only.
+	bool push(const T &item)
+	{
+		const auto tail = _tail.load(std::memory_order_relaxed);
+		const auto next = increment(tail);
+		if (next == _head.load(std::memory_order_acquire))
+			return false;
+
+		_items[tail] = item;
+		_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Called from the consumer thread only.
+	bool pop(T &item)
+	{
+		const auto head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return false;
+
+		item = _items[head];
+		_head.store(increment(head), std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+	}
+
+	static constexpr size_t capacity() { return Capacity; }
+
+private:
+	static constexpr size_t cache_line_size = 64;
+
+	static size_t increment(size_t index) { return (index + 1) % (Capacity + 1); }
+
+	// One slot is kept empty to tell a full queue from an empty one.
+	T _items[Capacity + 1];
+	// The indices are kept on their own cache lines with padding rather than alignas,
+	// the queue lives in objects allocated with a plain new.
+	char _items_padding[cache_line_size];
+	std::atomic<size_t> _head;
+	char _head_padding[cache_line_size - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> _tail;
+	char _tail_padding[cache_line_size - sizeof(std::atomic<size_t>)];
+};
@@ -1,6 +1,10 @@
 #include "streamer.h"
 #include "common.h"
 #include <websocketpp/config/asio_no_tls.hpp>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 
 extern "C"
 {
@@ -12,7 +16,14 @@ extern "C"
 #include <libavutil/error.h>
 }
 
+using critical_section_holder = std::lock_guard<std::mutex>;
+
 constexpr int io_buffer_size = 4 * 1024;
+constexpr int frame_pool_size = 3;
+// Bands smaller than this cost more in synchronization than they gain.
+constexpr int min_band_rows = 64;
+constexpr int default_keep_alive_ms = 1000;
+constexpr int default_session_cache_mb = 128;
 
 //#define WRITE_FILE
 #ifdef WRITE_FILE
@@ -24,6 +35,23 @@ int round_to_higher_multiple_of_two(int value)
 	return (value & 0x01) ? value + 1 : value;
 }
 
+SourceFormat source_format(short depth)
+{
+	return depth == 3 ? SourceFormat::RGB24 : SourceFormat::RGBA;
+}
+
+// Removes an option handled by the pipeline so that it is not forwarded to the codec.
+static bool take_option(EncodingOptions &options, const char *name, std::string &value)
+{
+	auto it = options.find(name);
+	if (it == options.end())
+		return false;
+
+	value = it->second;
+	options.erase(it);
+	return true;
+}
+
 bool operator != (const StreamingInfo &lhs, const StreamingInfo rhs)
 {
 	return lhs.width != rhs.width ||
@@ -32,16 +60,36 @@ bool operator != (const StreamingInfo &lhs, const StreamingInfo rhs)
 }
 
 Streamer::Streamer(StreamConfig config)
-	: _scale_context(nullptr)
-	, _codec(nullptr)
-	, _format_context(nullptr)
+	: _format_context(nullptr)
 	, _video_stream(nullptr)
-	, _codec_context(nullptr)
 	, _io_buffer(nullptr)
+	, _session(nullptr)
+	, _session_cache((size_t)default_session_cache_mb * 1024 * 1024)
+	, _session_cache_hits(0)
+	, _session_cache_misses(0)
+	, _frame_allocations(0)
+	, _input_frame(nullptr)
+	, _conversion_pool(nullptr)
 	, _initialized(false)
 	, _stream_opened(false)
 	, _frame_counter(0)
 	, _config(config)
+	, _recorder(config.info, config.error)
+	, _frame_policy(FramePolicy::KEEP_LATEST)
+	, _latest_frame(nullptr)
+	, _encoding_thread(nullptr)
+	, _quit_thread(false)
+	, _dropped_frames(0)
+	, _skip_unchanged(true)
+	, _keep_alive(default_keep_alive_ms)
+	, _skipped_frames(0)
+	, _captured_frames(0)
+	, _requested_bitrate(0)
+	, _requested_scale(0)
+	, _bitrate(0)
+	, _output_scale(100)
+	, _key_frame_requested(false)
+	, _reconfiguration_pending(false)
 {
 }
 
@@ -75,46 +123,145 @@ void Streamer::shutdown()
 
 bool Streamer::open_stream(int width, int height, short depth, const std::string &format, const std::string &codec, const EncodingOptions &options)
 {
-	_options = options;
+	_configured_options = options;
+	_configured_codec = codec;
 	_frame_counter = 0;
 
-	auto new_width = round_to_higher_multiple_of_two(width);
-	auto new_height = round_to_higher_multiple_of_two(height);
+	PipelineOptions pipeline;
+	take_pipeline_options(_configured_options, pipeline);
+	apply_pipeline_options(pipeline);
+	_session_cache.set_budget(pipeline.session_cache_budget);
+
+	_streaming_info.width = width;
+	_streaming_info.height = height;
+	_streaming_info.depth = depth;
+	_encoder_info = _streaming_info;
+	_output_scale = 100;
 
-	_codec = avcodec_find_encoder_by_name(codec.c_str());
-	if (!_codec) {
+	auto *av_codec = avcodec_find_encoder_by_name(codec.c_str());
+	if (!av_codec) {
 		_config.error("Codec not found");
 		return false;
 	}
 	_config.info(codec + " codec found");
 
-	avformat_alloc_output_context2(&_format_context, nullptr, format.c_str(), nullptr);
-	if (_format_context == nullptr) {
-		_config.error("Failed to allocate format context with format " + format);
-		return false;
+	// Raw H.264 needs no muxing, the Annex-B packets of the encoder are the stream.
+	_format_context = nullptr;
+	_video_stream = nullptr;
+	if (format != RAW_H264_FORMAT) {
+		avformat_alloc_output_context2(&_format_context, nullptr, format.c_str(), nullptr);
+		if (_format_context == nullptr) {
+			_config.error("Failed to allocate format context with format " + format);
+			return false;
+		}
+
+		_video_stream = avformat_new_stream(_format_context, av_codec);
+		if (_video_stream == nullptr) {
+			_config.info("Failed to open video stream with format " + format);
+			avformat_free_context(_format_context);
+			_format_context = nullptr;
+			return false;
+		}
 	}
 
-	_video_stream = avformat_new_stream(_format_context, _codec);
-	if (_video_stream == nullptr) {
-		_config.info("Failed to open video stream with format " + format);
+	_conversion_pool = new TaskPool(pipeline.conversion_threads);
+	_session = create_session(session_key(_streaming_info, _output_scale, codec, _configured_options));
+	_input_frame = av_frame_alloc();
+	if (_session == nullptr || _input_frame == nullptr) {
+		av_frame_free(&_input_frame);
+		delete _session;
+		_session = nullptr;
+		delete _conversion_pool;
+		_conversion_pool = nullptr;
 		avformat_free_context(_format_context);
+		_format_context = nullptr;
 		return false;
 	}
 
-	_codec_context = avcodec_alloc_context3(_codec);
-	if (_codec_context == nullptr) {
-		_config.error("Could not alocate codec context");
+	if (_format_context != nullptr && !open_muxer()) {
+		av_frame_free(&_input_frame);
+		delete _session;
+		_session = nullptr;
+		delete _conversion_pool;
+		_conversion_pool = nullptr;
 		avformat_free_context(_format_context);
+		_format_context = nullptr;
 		return false;
 	}
 
-	if (!initialize_codec_context(_codec_context, new_width, new_height)) {
-		_config.error("Could not initialize codec context");
-		avformat_free_context(_format_context);
-		return false;
+#ifdef WRITE_FILE
+	fopen_s(&test_file, "zeVideo.mp4", "wb");
+#endif
+
+	_reconfiguration_pending = false;
+
+
+	FrameInfo *slot;
+	while (_pending_frames.pop(slot)) {}
+	while (_free_frames.pop(slot)) {}
+	_latest_frame = nullptr;
+	for (auto &frame_slot : _frame_slots) {
+		_free_frames.push(&frame_slot);
+	}
+	_dropped_frames = 0;
+	_skipped_frames = 0;
+	_captured_frames = 0;
+	for (auto &timing : _frame_timings) {
+		timing.pts = AV_NOPTS_VALUE;
+	}
+	_session_cache_hits = 0;
+	_session_cache_misses = 0;
+	_requested_bitrate = 0;
+	_requested_scale = 0;
+	_bitrate = _session->codec_context->bit_rate;
+	_tile_detector.reset();
+	_quit_thread = false;
+	_encoding_thread = new std::thread(&Streamer::run_encoding_thread, this);
+
+	_stream_opened = true;
+	return true;
+}
+
+void Streamer::close_stream()
+{
+	if (_encoding_thread != nullptr) {
+		{
+			critical_section_holder csh(_wake_mutex);
+			_quit_thread = true;
+		}
+		_frame_pending.notify_one();
+		_frame_freed.notify_one();
+		_encoding_thread->join();
+		delete _encoding_thread;
+		_encoding_thread = nullptr;
 	}
 
-	avcodec_parameters_from_context(_video_stream->codecpar, _codec_context);
+	/* get the delayed frames */
+	encode_frame(nullptr, _session->codec_context);
+
+#ifdef WRITE_FILE
+	fclose(test_file);
+#endif
+
+	close_muxer();
+	_stream_opened = false;
+
+	delete _session;
+	_session = nullptr;
+	_session_cache.clear();
+	delete _conversion_pool;
+	_conversion_pool = nullptr;
+	{
+		critical_section_holder csh(_timings_mutex);
+		_conversion_timings.clear();
+	}
+
+	av_frame_free(&_input_frame);
+}
+
+bool Streamer::open_muxer()
+{
+	avcodec_parameters_from_context(_video_stream->codecpar, _session->codec_context);
 
 	if ((_format_context->oformat->flags & AVFMT_NOFILE) == 0) {
 		_io_buffer = (unsigned char*)av_malloc(io_buffer_size);
@@ -132,8 +279,8 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 		}, nullptr);
 		if (_format_context->pb == nullptr) {
 			_config.error("Could not open output");
-			avcodec_close(_codec_context);
-			avformat_free_context(_format_context);
+			av_free(_io_buffer);
+			_io_buffer = nullptr;
 			return false;
 		}
 	}
@@ -142,60 +289,105 @@ bool Streamer::open_stream(int width, int height, short depth, const std::string
 		_config.error("Could not write header");
 		av_free(_format_context->pb);
 		av_free(_io_buffer);
-		avcodec_close(_codec_context);
-		avformat_free_context(_format_context);
-		return false;
-	}
-
-	_scale_context = sws_getContext(
-		width, // src width
-		height, // src height
-		depth == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA, // src format
-		new_width, // dest width
-		new_height, // dest height
-		AV_PIX_FMT_YUV420P, // dest format
-		SWS_FAST_BILINEAR, // scaling flag
-		nullptr, // src filter
-		nullptr, // dest filter
-		nullptr // params
-		);
-	if (_scale_context == nullptr) {
-		_config.error("Failed to allocate scale context");
-		av_free(_format_context->pb);
-		av_free(_io_buffer);
-		avcodec_close(_codec_context);
-		avformat_free_context(_format_context);
+		_io_buffer = nullptr;
 		return false;
 	}
-
-#ifdef WRITE_FILE
-	fopen_s(&test_file, "zeVideo.mp4", "wb");
-#endif
-
-	_stream_opened = true;
 	return true;
 }
 
-void Streamer::close_stream()
+void Streamer::close_muxer()
 {
-	/* get the delayed frames */
-	encode_frame(nullptr, _codec_context);
-
-#ifdef WRITE_FILE
-	fclose(test_file);
-#endif
+	if (_format_context == nullptr)
+		return;
 
 	av_free(_format_context->pb);
 	av_free(_io_buffer);
 	_io_buffer = nullptr;
 	avformat_free_context(_format_context);
-	avcodec_close(_codec_context);
-	_stream_opened = false;
+	_format_context = nullptr;
+	_video_stream = nullptr;
+}
+
+bool Streamer::global_header() const
+{
+	return _format_context != nullptr && (_format_context->oformat->flags & AVFMT_GLOBALHEADER);
+}
+
+bool Streamer::reconfigure(int width, int height, short depth, const std::string &codec, const EncodingOptions &options)
+{
+	if (!_stream_opened)
+		return false;
 
-	if (_scale_context != nullptr) {
-		sws_freeContext(_scale_context);
-		_scale_context = nullptr;
+	if (codec != _configured_codec && avcodec_find_encoder_by_name(codec.c_str()) == nullptr) {
+		_config.error("Codec not found");
+		return false;
+	}
+
+	Reconfiguration reconfiguration;
+	reconfiguration.info.width = width;
+	reconfiguration.info.height = height;
+	reconfiguration.info.depth = depth;
+	reconfiguration.codec = codec;
+
+	PipelineOptions pipeline;
+	reconfiguration.codec_options = options;
+	take_pipeline_options(reconfiguration.codec_options, pipeline);
+	reconfiguration.conversion_threads = pipeline.conversion_threads;
+	reconfiguration.session_cache_budget = pipeline.session_cache_budget;
+	auto new_encoder =
+		round_to_higher_multiple_of_two(width) != round_to_higher_multiple_of_two(_streaming_info.width) ||
+		round_to_higher_multiple_of_two(height) != round_to_higher_multiple_of_two(_streaming_info.height) ||
+		codec != _configured_codec ||
+		reconfiguration.codec_options != _configured_options;
+
+	// The encoder parameters of these formats are in the header written when the stream opened.
+	if (new_encoder && global_header()) {
+		_config.info("Format " + std::string(_format_context->oformat->name) + " cannot change encoder parameters on the fly");
+		return false;
+	}
+
+	apply_pipeline_options(pipeline);
+	_streaming_info = reconfiguration.info;
+	_configured_codec = codec;
+	_configured_options = reconfiguration.codec_options;
+
+	{
+		critical_section_holder csh(_reconfiguration_mutex);
+		_reconfiguration = reconfiguration;
+		_reconfiguration_pending = true;
 	}
+	return true;
+}
+
+void Streamer::take_pipeline_options(EncodingOptions &options, PipelineOptions &pipeline)
+{
+	std::string value;
+	pipeline.frame_policy = FramePolicy::KEEP_LATEST;
+	if (take_option(options, FRAME_POLICY_OPTION, value) && value == "block")
+		pipeline.frame_policy = FramePolicy::BLOCK;
+
+	pipeline.conversion_threads = 1;
+	if (take_option(options, CONVERSION_THREADS_OPTION, value))
+		pipeline.conversion_threads = std::max(1, atoi(value.c_str()));
+
+	pipeline.skip_unchanged = true;
+	if (take_option(options, SKIP_UNCHANGED_OPTION, value))
+		pipeline.skip_unchanged = value != "0" && value != "false";
+
+	pipeline.keep_alive = std::chrono::milliseconds(default_keep_alive_ms);
+	if (take_option(options, KEEP_ALIVE_OPTION, value))
+		pipeline.keep_alive = std::chrono::milliseconds(std::max(0, atoi(value.c_str())));
+
+	pipeline.session_cache_budget = (size_t)default_session_cache_mb * 1024 * 1024;
+	if (take_option(options, SESSION_CACHE_OPTION, value))
+		pipeline.session_cache_budget = (size_t)std::max(0, atoi(value.c_str())) * 1024 * 1024;
+}
+
+void Streamer::apply_pipeline_options(const PipelineOptions &pipeline)
+{
+	_frame_policy = pipeline.frame_policy;
+	_skip_unchanged = pipeline.skip_unchanged;
+	_keep_alive = pipeline.keep_alive;
 }
 
 void Streamer::stream_frame(const uint8_t* frame, int width, int height, short depth)
@@ -204,42 +396,407 @@ void Streamer::stream_frame(const uint8_t* frame, int width, int height, short d
 		return;
 	}
 
-	AVFrame* inpic = av_frame_alloc(); // mandatory frame allocation
+	const auto frame_number = _captured_frames++;
+	const auto capture_time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	// Idle viewports are the common case, check for changes before paying for the copy.
+	const auto now = std::chrono::steady_clock::now();
+	if (_skip_unchanged) {
+		auto changed = _tile_detector.detect(frame, width, height, depth);
+		auto keep_alive_due = _keep_alive.count() > 0 && now - _last_queued_frame >= _keep_alive;
+		if (!changed && !keep_alive_due && !_key_frame_requested) {
+			++_skipped_frames;
+			return;
+		}
+	}
 
-	auto input_format = depth == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA;
-	inpic->format = input_format;
-	inpic->width = width;
-	inpic->height = height;
-	auto success = av_image_fill_arrays(inpic->data, inpic->linesize, frame, input_format, width, height, 1);
-	if (success < 0) {
-		_config.error("Error transforming data into frame");
-		av_frame_free(&inpic);
+	const auto keep_latest = _frame_policy == FramePolicy::KEEP_LATEST;
+	// A frame the encoder did not pick up yet is overwritten, its changes are kept with the new ones.
+	FrameInfo *slot = keep_latest ? _latest_frame.exchange(nullptr) : nullptr;
+	const auto replaced = slot != nullptr;
+	if (replaced) {
+		++_dropped_frames;
+	} else if (!_free_frames.pop(slot)) {
+		if (keep_latest) {
+			// Only when the policy just changed and the queue still holds every slot.
+			++_dropped_frames;
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(_wake_mutex);
+		_frame_freed.wait(lock, [this, &slot]() { return _quit_thread || _free_frames.pop(slot); });
+		if (slot == nullptr) {
+			return;
+		}
+	}
+
+	// The capture buffer is released by the caller, keep a copy for the encoder thread.
+	const auto frame_size = static_cast<size_t>(width) * height * depth;
+	slot->info.width = width;
+	slot->info.height = height;
+	slot->info.depth = depth;
+	slot->frame_number = frame_number;
+	slot->capture_time_us = capture_time_us;
+	slot->captured = now;
+	slot->data.resize(frame_size);
+	memcpy(slot->data.data(), frame, frame_size);
+
+	// Only a queued frame becomes the reference, changes in dropped frames are still pending.
+	if (_skip_unchanged) {
+		const auto &dirty_tiles = _tile_detector.dirty_tiles();
+		if (replaced && slot->dirty_tiles.size() == dirty_tiles.size()) {
+			for (size_t i = 0; i < dirty_tiles.size(); ++i) {
+				slot->dirty_tiles[i] |= dirty_tiles[i];
+			}
+		} else {
+			slot->dirty_tiles = dirty_tiles;
+		}
+		_tile_detector.commit();
+	} else {
+		slot->dirty_tiles.clear();
+	}
+	_last_queued_frame = now;
+
+	if (keep_latest)
+		_latest_frame.store(slot);
+	else
+		_pending_frames.push(slot);
+	{
+		critical_section_holder csh(_wake_mutex);
+	}
+	_frame_pending.notify_one();
+}
+
+void Streamer::set_bitrate(int64_t bitrate)
+{
+	_requested_bitrate = bitrate;
+}
+
+void Streamer::set_output_scale(int percent)
+{
+	_requested_scale = std::min(100, std::max(1, percent));
+}
+
+void Streamer::convert_and_encode(const FrameInfo &frame)
+{
+	apply_encoder_settings();
+	if (_session->bands.empty())
+		return;
+
+	if (frame.info != _encoder_info) {
+		_config.warning("Frame size does not match the stream, skipping it");
 		return;
 	}
 
-	AVFrame* outpic = av_frame_alloc();
-	outpic->format = AV_PIX_FMT_YUV420P;
-	outpic->width = _codec_context->width;
-	outpic->height = _codec_context->height;
-	outpic->pts = _frame_counter++;
-	success = av_image_alloc(outpic->data, outpic->linesize, _codec_context->width, _codec_context->height, _codec_context->pix_fmt, 32);
-	if (success < 0) {
+	// Frames come back to the pool once the encoder is done with them.
+	auto *outpic = _session->frame_pool.acquire();
+	_frame_allocations = _session->frame_pool.allocations();
+	if (outpic == nullptr) {
 		_config.error("Error allocating new frame");
-		av_frame_free(&inpic);
-		av_frame_free(&outpic);
 		return;
 	}
+	outpic->pts = _frame_counter++;
+
+	auto &timing = _frame_timings[outpic->pts % timing_history_size];
+	timing.pts = outpic->pts;
+	timing.frame_number = frame.frame_number;
+	timing.capture_time_us = frame.capture_time_us;
+	timing.captured = frame.captured;
+	timing.encode_start = std::chrono::steady_clock::now();
+	timing.conversion_end = timing.encode_start;
+
+	// A resumed session must not predict from the pictures it encoded before it was parked.
+	if (_key_frame_requested.exchange(false))
+		_session->needs_key_frame = true;
+	outpic->pict_type = _session->needs_key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+	_session->needs_key_frame = false;
+
+	if (_session->convert == nullptr) {
+		auto input_format = frame.info.depth == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA;
+		_input_frame->format = input_format;
+		_input_frame->width = frame.info.width;
+		_input_frame->height = frame.info.height;
+		auto success = av_image_fill_arrays(_input_frame->data, _input_frame->linesize, frame.data.data(), input_format, frame.info.width, frame.info.height, 1);
+		if (success < 0) {
+			_config.error("Error transforming data into frame");
+			return;
+		}
+	}
+
+	const auto &bands = _session->bands;
+	std::vector<int64_t> timings(bands.size());
+	_conversion_pool->run((int)bands.size(), [this, &bands, &frame, outpic, &timings](int index) {
+		auto start = std::chrono::high_resolution_clock::now();
+		convert_band(bands[index], frame, outpic);
+		timings[index] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	});
+
+	{
+		critical_section_holder csh(_timings_mutex);
+		_conversion_timings.swap(timings);
+	}
+
+	timing.conversion_end = std::chrono::steady_clock::now();
+	encode_frame(outpic, _session->codec_context);
+}
+
+void Streamer::convert_band(const ConversionBand &band, const FrameInfo &frame, AVFrame *outpic)
+{
+	if (_session->convert != nullptr) {
+		SourceImage source = { frame.data.data(), frame.info.width * frame.info.depth, frame.info.width, frame.info.height, source_format(frame.info.depth) };
+		YuvImage destination = { { outpic->data[0], outpic->data[1], outpic->data[2] }, { outpic->linesize[0], outpic->linesize[1], outpic->linesize[2] }, outpic->width, outpic->height };
+		_session->convert(source, destination, band.first_row, band.last_row);
+		return;
+	}
+
+	// The band context only sees its own source rows, offset both images to the band.
+	auto source_first_row = (int)((int64_t)band.first_row * frame.info.height / outpic->height);
+	const uint8_t *source[4] = { _input_frame->data[0] + (ptrdiff_t)source_first_row * _input_frame->linesize[0], nullptr, nullptr, nullptr };
+	uint8_t *destination[4] = {
+		outpic->data[0] + (ptrdiff_t)band.first_row * outpic->linesize[0],
+		outpic->data[1] + (ptrdiff_t)(band.first_row / 2) * outpic->linesize[1],
+		outpic->data[2] + (ptrdiff_t)(band.first_row / 2) * outpic->linesize[2],
+		nullptr
+	};
+	auto source_last_row = (int)((int64_t)band.last_row * frame.info.height / outpic->height);
+	sws_scale(band.scale_context, source, _input_frame->linesize, 0, source_last_row - source_first_row, destination, outpic->linesize);          // converting frame size and format
+}
+
+void Streamer::apply_encoder_settings()
+{
+	Reconfiguration reconfiguration;
+	auto reconfigure = false;
+	{
+		critical_section_holder csh(_reconfiguration_mutex);
+		if (_reconfiguration_pending) {
+			reconfiguration = _reconfiguration;
+			_reconfiguration_pending = false;
+			reconfigure = true;
+		}
+	}
+	if (reconfigure)
+		apply_reconfiguration(reconfiguration);
+
+	auto scale = _requested_scale.exchange(0);
+	if (scale != 0 && scale != _output_scale) {
+		// A raw stream can change resolution on the next key frame, containers with
+		// global headers would need a new header.
+		if (global_header()) {
+			_config.warning("Output resolution cannot change with format " + std::string(_format_context->oformat->name));
+		} else if (switch_session(session_key(_encoder_info, scale, _session->key.codec, _session->key.options))) {
+			_output_scale = scale;
+			_config.info("Encoding at " + std::to_string(_session->key.width) + "x" + std::to_string(_session->key.height));
+		}
+	}
+
+	auto bitrate = _requested_bitrate.exchange(0);
+	if (bitrate != 0 && bitrate != _bitrate)
+		apply_bitrate(bitrate);
+}
 
-	sws_scale(_scale_context, inpic->data, inpic->linesize, 0, height, outpic->data, outpic->linesize);          // converting frame size and format
+void Streamer::apply_reconfiguration(const Reconfiguration &reconfiguration)
+{
+	_encoder_info = reconfiguration.info;
+	_session_cache.set_budget(reconfiguration.session_cache_budget);
 
-	encode_frame(outpic, _codec_context);
+	if (reconfiguration.conversion_threads != _conversion_pool->thread_count()) {
+		delete _conversion_pool;
+		_conversion_pool = new TaskPool(reconfiguration.conversion_threads);
+	}
 
-	av_freep(&outpic->data[0]);
-	av_frame_free(&inpic);
-	av_frame_free(&outpic);
+	auto key = session_key(_encoder_info, _output_scale, reconfiguration.codec, reconfiguration.codec_options);
+	if (switch_session(key))
+		_config.info("Encoder reconfigured to " + std::to_string(key.width) + "x" + std::to_string(key.height));
 }
 
-bool Streamer::initialize_codec_context(AVCodecContext* codec_context, int width, int height)
+EncoderSessionKey Streamer::session_key(const StreamingInfo &info, int scale, const std::string &codec, const EncodingOptions &options) const
+{
+	EncoderSessionKey key;
+	key.source_width = info.width;
+	key.source_height = info.height;
+	key.depth = info.depth;
+	key.width = round_to_higher_multiple_of_two(std::max(2, info.width * scale / 100));
+	key.height = round_to_higher_multiple_of_two(std::max(2, info.height * scale / 100));
+	key.codec = codec;
+	key.options = options;
+	key.conversion_threads = _conversion_pool->thread_count();
+	return key;
+}
+
+bool Streamer::switch_session(const EncoderSessionKey &key)
+{
+	if (_session->key == key)
+		return true;
+
+	// Same encoder, only the conversion depends on the source size and format.
+	if (same_encoder(_session->key, key)) {
+		_session->release_conversion();
+		_session->key = key;
+		if (!initialize_conversion(*_session)) {
+			_config.error("Failed to reinitialize conversion");
+			return false;
+		}
+		return true;
+	}
+
+	auto *session = _session_cache.take(key);
+	if (session != nullptr) {
+		++_session_cache_hits;
+	} else {
+		++_session_cache_misses;
+		session = create_session(key);
+		if (session == nullptr)
+			return false;
+	}
+
+	// The new encoder starts on an IDR frame preceded by its SPS and PPS. The parked one
+	// keeps its state, with zero latency settings it has no delayed frames to flush.
+	_session->needs_key_frame = true;
+	_session_cache.put(_session);
+	_session = session;
+	if (_video_stream != nullptr)
+		avcodec_parameters_from_context(_video_stream->codecpar, _session->codec_context);
+
+	// Sessions are opened with the bitrate of the options, keep the one the stream was running at.
+	if (_session->codec_context->bit_rate != _bitrate)
+		apply_bitrate(_bitrate);
+	return true;
+}
+
+EncoderSession* Streamer::create_session(const EncoderSessionKey &key)
+{
+	auto *session = new EncoderSession();
+	session->key = key;
+	session->codec = avcodec_find_encoder_by_name(key.codec.c_str());
+	if (session->codec == nullptr) {
+		_config.error("Codec not found");
+		delete session;
+		return nullptr;
+	}
+
+	session->codec_context = avcodec_alloc_context3(session->codec);
+	if (session->codec_context == nullptr) {
+		_config.error("Could not alocate codec context");
+		delete session;
+		return nullptr;
+	}
+
+	if (!initialize_codec_context(session->codec_context, session->codec, key.options, key.width, key.height)) {
+		_config.error("Could not initialize codec context");
+		delete session;
+		return nullptr;
+	}
+
+	if (!initialize_conversion(*session) || !session->frame_pool.init(key.width, key.height, AV_PIX_FMT_YUV420P, frame_pool_size)) {
+		_config.error("Failed to allocate frame pool");
+		delete session;
+		return nullptr;
+	}
+
+	return session;
+}
+
+void Streamer::apply_bitrate(int64_t bitrate)
+{
+	// libx264 reconfigures its rate control when these change between two frames,
+	// other encoders only read them when opened.
+	if (strcmp(_session->codec->name, H264_NAME) != 0) {
+		_config.warning("Bitrate cannot be changed on a running " + std::string(_session->codec->name) + " encoder");
+		return;
+	}
+
+	// Same proportions as the initial maxrate and bufsize.
+	auto *codec_context = _session->codec_context;
+	codec_context->bit_rate = bitrate;
+	codec_context->rc_max_rate = bitrate * 2;
+	codec_context->rc_buffer_size = (int)std::min<int64_t>(INT_MAX, bitrate * 5 / 2);
+	_bitrate = bitrate;
+}
+
+std::vector<int64_t> Streamer::conversion_timings() const
+{
+	critical_section_holder csh(_timings_mutex);
+	return _conversion_timings;
+}
+
+bool Streamer::initialize_conversion(EncoderSession &session)
+{
+	const auto &key = session.key;
+
+	// Bands start on even rows so that each one owns whole chroma rows.
+	auto band_count = std::max(1, std::min(key.conversion_threads, key.height / min_band_rows));
+	for (auto i = 0; i < band_count; ++i) {
+		ConversionBand band;
+		band.first_row = (key.height * i / band_count) & ~1;
+		band.last_row = i + 1 == band_count ? key.height : (key.height * (i + 1) / band_count) & ~1;
+		band.scale_context = nullptr;
+		session.bands.push_back(band);
+	}
+
+	// Source and destination only differ by the padding to even sizes, which the
+	// vectorized converter handles. libswscale is kept for actual rescaling.
+	SourceImage source = { nullptr, key.source_width * key.depth, key.source_width, key.source_height, source_format(key.depth) };
+	if ((key.depth == 3 || key.depth == 4) && can_convert_without_scaling(source, key.width, key.height)) {
+		session.convert = select_rgb_to_yuv420p();
+		_config.info(std::string("Using ") + rgb_to_yuv420p_name(session.convert) + " color conversion");
+	} else {
+		for (auto &band : session.bands) {
+			auto source_first_row = (int)((int64_t)band.first_row * key.source_height / key.height);
+			auto source_last_row = (int)((int64_t)band.last_row * key.source_height / key.height);
+			band.scale_context = sws_getContext(
+				key.source_width, // src width
+				source_last_row - source_first_row, // src height
+				key.depth == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA, // src format
+				key.width, // dest width
+				band.last_row - band.first_row, // dest height
+				AV_PIX_FMT_YUV420P, // dest format
+				SWS_FAST_BILINEAR, // scaling flag
+				nullptr, // src filter
+				nullptr, // dest filter
+				nullptr // params
+				);
+			if (band.scale_context == nullptr) {
+				_config.error("Failed to allocate scale context");
+				session.release_conversion();
+				return false;
+			}
+		}
+	}
+
+	_config.info("Converting frames in " + std::to_string(band_count) + " band(s)");
+	return true;
+}
+
+void Streamer::run_encoding_thread()
+{
+	for (;;) {
+		FrameInfo *frame = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(_wake_mutex);
+			_frame_pending.wait(lock, [this]() { return _quit_thread || !_pending_frames.empty() || _latest_frame.load() != nullptr; });
+		}
+
+		// Queued frames first, they were captured before a change of policy.
+		if (!_pending_frames.pop(frame))
+			frame = _latest_frame.exchange(nullptr);
+
+		if (frame == nullptr) {
+			if (_quit_thread)
+				break;
+			continue;
+		}
+
+		convert_and_encode(*frame);
+
+		_free_frames.push(frame);
+		{
+			critical_section_holder csh(_wake_mutex);
+		}
+		_frame_freed.notify_one();
+	}
+}
+
+bool Streamer::initialize_codec_context(AVCodecContext* codec_context, AVCodec *codec, const EncodingOptions &options, int width, int height)
 {
 	AVDictionary *dict = nullptr;
 
@@ -268,15 +825,17 @@ bool Streamer::initialize_codec_context(AVCodecContext* codec_context, int width
 	codec_context->codec_id = AV_CODEC_ID_H264;
 	codec_context->codec_type = AVMEDIA_TYPE_VIDEO;
 
-	if (_codec->name == H264_NAME) {
+	// Compare the names, the codec descriptors do not share the plugin string literals.
+	if (strcmp(codec->name, H264_NAME) == 0) {
 		av_dict_set(&dict, "preset", "ultrafast", 0);
 		av_dict_set(&dict, "profile", "baseline", 0);
 		av_dict_set(&dict, "level", "3.0", 0);
 		av_dict_set(&dict, "tune", "zerolatency", 0);
+		av_dict_set(&dict, "forced-idr", "1", 0);				// frames flagged as I become IDR frames
 		//	//av_dict_set(&dict, "frag_duration", "100000", 0);
 		//	//av_dict_set(&dict, "movflags", "frag_keyframe+empty_moov+default_base_moof+faststart+dash", 0);
 	}
-	else if (_codec->name == NVENC_H264_NAME) {
+	else if (strcmp(codec->name, NVENC_H264_NAME) == 0) {
 		av_dict_set(&dict, "preset", "llhp", 0);
 		av_dict_set(&dict, "profile", "baseline", 0);
 		//av_dict_set(&dict, "level", "5.1", 0); // Cannot use 3.0 with hd resolution with nvenc
@@ -286,18 +845,18 @@ bool Streamer::initialize_codec_context(AVCodecContext* codec_context, int width
 	}
 
 	/* Some formats want stream headers to be separate. */
-	if (_format_context->oformat->flags & AVFMT_GLOBALHEADER) {
+	if (global_header()) {
 		// Get flags and append to it.
 		av_dict_set(&dict, "flags", "global_header", 0);
 		codec_context->flags |= CODEC_FLAG_GLOBAL_HEADER;
 	}
 
 	// Apply options
-	for (auto kvp : _options) {
+	for (auto kvp : options) {
 		av_dict_set(&dict, kvp.first.c_str(), kvp.second.c_str(), 0);
 	}
 
-	if (avcodec_open2(codec_context, _codec, &dict) < 0) {
+	if (avcodec_open2(codec_context, codec, &dict) < 0) {
 		_config.error("Could not open codec"); // opening the codec
 		return false;
 	}
@@ -321,7 +880,12 @@ int Streamer::encode_frame(AVFrame *frame, AVCodecContext *context)
 	while(success == 0) {
 		success = avcodec_receive_packet(context, &packet);
 		if (success == 0) {
-			success = write_frame(_format_context, &_video_stream->time_base, _video_stream, &packet);
+			// Before write_frame, which rescales the timestamps of the packet.
+			_recorder.write(&packet, capture_time_us(&packet), context);
+			if (_format_context != nullptr)
+				success = write_frame(_format_context, &_video_stream->time_base, _video_stream, &packet);
+			else
+				success = write_packet(&packet);
 		}
 	}
 
@@ -331,6 +895,53 @@ int Streamer::encode_frame(AVFrame *frame, AVCodecContext *context)
 	return success;
 }
 
+int64_t Streamer::capture_time_us(const AVPacket *packet) const
+{
+	if (packet->pts >= 0) {
+		const auto &timing = _frame_timings[packet->pts % timing_history_size];
+		if (timing.pts == packet->pts)
+			return timing.capture_time_us;
+	}
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int Streamer::write_packet(AVPacket *packet)
+{
+	if (!_config.on_packet) {
+		_config.on_packet_write(packet->data, packet->size);
+		return 0;
+	}
+
+	FrameHeader header = {};
+	header.magic = FRAME_HEADER_MAGIC;
+	header.header_size = sizeof(FrameHeader);
+	header.flags = (packet->flags & AV_PKT_FLAG_KEY) ? FRAME_FLAG_KEY_FRAME : 0;
+	header.pts = packet->pts;
+	const auto *timing = packet->pts >= 0 ? &_frame_timings[packet->pts % timing_history_size] : nullptr;
+	const auto now = std::chrono::steady_clock::now();
+	auto microseconds = [](std::chrono::steady_clock::duration duration) { return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); };
+	if (timing != nullptr && timing->pts == packet->pts) {
+		header.frame_number = timing->frame_number;
+		header.capture_time_us = timing->capture_time_us;
+		header.encode_duration_us = microseconds(now - timing->encode_start);
+		header.queue_us = microseconds(timing->encode_start - timing->captured);
+		header.conversion_us = microseconds(timing->conversion_end - timing->encode_start);
+		header.encode_us = microseconds(now - timing->conversion_end);
+	}
+	// Time of the packet until the message is queued, the sender turns it into mux_us.
+	header.send_time_us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+
+	// Takes a new reference to the encoder buffer, the data is only copied if the packet was not refcounted.
+	auto *reference = av_packet_alloc();
+	if (reference == nullptr || av_packet_ref(reference, packet) < 0) {
+		av_packet_free(&reference);
+		_config.error("Could not reference packet");
+		return AVERROR(ENOMEM);
+	}
+	_config.on_packet(PacketRef(reference, [](AVPacket *p) { av_packet_free(&p); }), header);
+	return 0;
+}
+
 int Streamer::write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
 {
 	/* rescale output packet timestamp values from codec to stream timebase */
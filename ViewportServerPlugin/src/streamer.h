@@ -1,7 +1,19 @@
 #pragma once
 #include <vector>
 #include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include "common.h"
+#include "encoder_session.h"
+#include "spsc_queue.h"
+#include "task_pool.h"
+#include "dirty_tiles.h"
+#include "frame_header.h"
+#include "mp4_recorder.h"
 
 struct AVFrame;
 struct SwsContext;
@@ -23,14 +35,33 @@ struct FrameInfo
 {
 	StreamingInfo info;
 	std::vector<uint8_t> data;
+	// Tiles changed since the previous queued frame, see DirtyTileDetector.
+	std::vector<uint8_t> dirty_tiles;
+	uint32_t frame_number;
+	int64_t capture_time_us;
+	std::chrono::steady_clock::time_point captured;
 };
 
+bool operator != (const StreamingInfo &lhs, const StreamingInfo rhs);
+
+// What stream_frame does when the encoder thread has not consumed the previous frames yet.
+enum class FramePolicy
+{
+	KEEP_LATEST = 0,	// never wait, a frame the encoder did not pick up yet is replaced by the newer one
+	BLOCK = 1			// wait for a free slot, every frame gets encoded
+};
+
+// Encoded packet shared without copy, its data stays valid while a reference is held.
+using PacketRef = std::shared_ptr<AVPacket>;
+
 struct StreamConfig
 {
 	std::function<void(uint8_t*, int)> on_packet_write;
 	std::function<void(const std::string&)> info;
 	std::function<void(const std::string&)> warning;
 	std::function<void(const std::string&)> error;
+	// Receives every access unit of a raw H.264 stream when set, on_packet_write is used otherwise.
+	std::function<void(const PacketRef&, const FrameHeader&)> on_packet;
 };
 
 class Streamer
@@ -44,6 +75,11 @@ public:
 
 	bool open_stream(int width, int height, short depth, const std::string &format, const std::string &codec, const EncodingOptions &options = EncodingOptions());
 	void close_stream();
+	// Changes the source size, codec or options of an opened stream without closing the output.
+	// Only what changed is rebuilt: the conversion for a new depth or thread count, the encoder
+	// (starting on an IDR frame with in-band SPS/PPS) for a new size, codec or codec options.
+	// Returns false when the format would need a new stream header, the stream must then be reopened.
+	bool reconfigure(int width, int height, short depth, const std::string &codec, const EncodingOptions &options = EncodingOptions());
 
 	void stream_frame(const uint8_t *frame, int width, int height, short depth);
 
@@ -51,24 +87,157 @@ public:
 	bool stream_opened() const { return _stream_opened; }
 
 	const StreamingInfo& streaming_info() const { return _streaming_info; }
+
+	// Number of image buffers allocated by the frame pool since the stream was opened.
+	int64_t frame_allocations() const { return _frame_allocations; }
+	// Number of captured frames that were never encoded because the encoder fell behind.
+	int64_t dropped_frames() const { return _dropped_frames; }
+	// Number of captured frames that were not encoded because nothing changed.
+	int64_t skipped_frames() const { return _skipped_frames; }
+	// Dirty mask of the last frame given to stream_frame, only valid on the calling thread.
+	const DirtyTileDetector& tile_detector() const { return _tile_detector; }
+	// Rate control and output size changes are applied by the encoder thread before its next
+	// frame, the stream stays open. The output scale is in percent of the captured size.
+	void set_bitrate(int64_t bitrate);
+	void set_output_scale(int percent);
+	// The next encoded frame is an IDR frame, even when the viewport did not change.
+	void request_key_frame() { _key_frame_requested = true; }
+	int64_t bitrate() const { return _bitrate; }
+	int output_scale() const { return _output_scale; }
+
+	// Time spent converting each band of the last frame, in microseconds.
+	std::vector<int64_t> conversion_timings() const;
+
+	// Encoder sessions found in the cache, and created, when the size or options changed.
+	int64_t session_cache_hits() const { return _session_cache_hits; }
+	int64_t session_cache_misses() const { return _session_cache_misses; }
+
+	// Tees the encoded packets to fragmented MP4 files, see Mp4Recorder.
+	// The recording goes on through reconfigurations and reopenings of the stream.
+	bool start_recording(const std::string &path) { return _recorder.open(path); }
+	void stop_recording() { _recorder.close(); }
+	bool recording() const { return _recorder.opened(); }
+	const Mp4Recorder& recorder() const { return _recorder; }
 private:
-	bool initialize_codec_context(AVCodecContext *codec_context, int width, int height);
+	static constexpr size_t frame_queue_size = 3;
+	// Frames between the conversion and their packet, more than the encoder can hold back.
+	static constexpr size_t timing_history_size = 8;
+
+	struct FrameTiming
+	{
+		int64_t pts;
+		uint32_t frame_number;
+		int64_t capture_time_us;
+		std::chrono::steady_clock::time_point captured;
+		std::chrono::steady_clock::time_point encode_start;
+		std::chrono::steady_clock::time_point conversion_end;
+	};
+
+	// Options consumed by the pipeline instead of the codec.
+	struct PipelineOptions
+	{
+		FramePolicy frame_policy;
+		int conversion_threads;
+		bool skip_unchanged;
+		std::chrono::milliseconds keep_alive;
+		size_t session_cache_budget;
+	};
+
+	// Handed from reconfigure to the encoder thread.
+	struct Reconfiguration
+	{
+		StreamingInfo info;
+		std::string codec;
+		EncodingOptions codec_options;
+		int conversion_threads;
+		size_t session_cache_budget;
+	};
+
+	bool initialize_codec_context(AVCodecContext *codec_context, AVCodec *codec, const EncodingOptions &options, int width, int height);
+	bool initialize_conversion(EncoderSession &session);
+	EncoderSession* create_session(const EncoderSessionKey &key);
+	// Makes the session matching the key the active one, from the cache or freshly created.
+	bool switch_session(const EncoderSessionKey &key);
+	EncoderSessionKey session_key(const StreamingInfo &info, int scale, const std::string &codec, const EncodingOptions &options) const;
+	void convert_band(const ConversionBand &band, const FrameInfo &frame, AVFrame *outpic);
+	static void take_pipeline_options(EncodingOptions &options, PipelineOptions &pipeline);
+	void apply_pipeline_options(const PipelineOptions &pipeline);
+	void apply_encoder_settings();
+	void apply_reconfiguration(const Reconfiguration &reconfiguration);
+	void apply_bitrate(int64_t bitrate);
+	void convert_and_encode(const FrameInfo &frame);
 	int encode_frame(AVFrame *frame, AVCodecContext *context);
+	int64_t capture_time_us(const AVPacket *packet) const;
+	void run_encoding_thread();
 
+	bool open_muxer();
+	void close_muxer();
+	bool global_header() const;
+	int write_packet(AVPacket *packet);
 	int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt);
 
-	SwsContext *_scale_context;
-	AVCodec *_codec;
 	AVFormatContext *_format_context;
 	AVStream *_video_stream;
-	AVCodecContext *_codec_context;
 	unsigned char *_io_buffer;
 
+	// Encoder and conversion currently used by the encoder thread. Sessions of recent
+	// sizes are parked in the cache, switching back to them skips opening a new encoder.
+	EncoderSession *_session;
+	EncoderSessionCache _session_cache;
+	std::atomic<int64_t> _session_cache_hits;
+	std::atomic<int64_t> _session_cache_misses;
+	std::atomic<int64_t> _frame_allocations;
+	FrameTiming _frame_timings[timing_history_size];
+
+	AVFrame *_input_frame;
+	TaskPool *_conversion_pool;
+	std::vector<int64_t> _conversion_timings;
+	mutable std::mutex _timings_mutex;
+
 	StreamingInfo _streaming_info;
 	bool _initialized;
 	bool _stream_opened;
 	int64_t _frame_counter;
 
 	StreamConfig _config;
-	EncodingOptions _options;
+	Mp4Recorder _recorder;
+	// What the caller last asked for, the encoder thread catches up through _reconfiguration.
+	EncodingOptions _configured_options;
+	std::string _configured_codec;
+	// Source of the frames the encoder thread currently converts, _streaming_info is the configured one.
+	StreamingInfo _encoder_info;
+
+	// Encoder thread, frames travel from stream_frame through _pending_frames (BLOCK) or _latest_frame (KEEP_LATEST)
+	// and come back through _free_frames. With one slot encoded and one waiting, stream_frame always has a free one.
+	std::atomic<FramePolicy> _frame_policy;
+	FrameInfo _frame_slots[frame_queue_size];
+	SpscQueue<FrameInfo*, frame_queue_size> _free_frames;
+	SpscQueue<FrameInfo*, frame_queue_size> _pending_frames;
+	std::atomic<FrameInfo*> _latest_frame;
+	std::thread *_encoding_thread;
+	std::atomic<bool> _quit_thread;
+	std::atomic<int64_t> _dropped_frames;
+	std::mutex _wake_mutex;
+	std::condition_variable _frame_pending;
+	std::condition_variable _frame_freed;
+
+	// Unchanged frames are not encoded, a frame is still sent every _keep_alive
+	// so that late decoders and lossy encodings eventually catch up.
+	DirtyTileDetector _tile_detector;
+	bool _skip_unchanged;
+	std::chrono::milliseconds _keep_alive;
+	std::chrono::steady_clock::time_point _last_queued_frame;
+	int64_t _skipped_frames;
+	uint32_t _captured_frames;
+
+	// Requested by set_bitrate and set_output_scale, 0 when there is nothing to apply.
+	std::atomic<int64_t> _requested_bitrate;
+	std::atomic<int> _requested_scale;
+	std::atomic<int64_t> _bitrate;
+	std::atomic<int> _output_scale;
+	std::atomic<bool> _key_frame_requested;
+
+	std::mutex _reconfiguration_mutex;
+	Reconfiguration _reconfiguration;
+	bool _reconfiguration_pending;
 };
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "task_pool.h"
+
+using critical_section_holder = std::lock_guard<std::mutex>;
+
+TaskPool::TaskPool(int thread_count)
+	: _job(nullptr)
+	, _task_count(0)
+	, _next_task(0)
+	, _remaining_tasks(0)
+	, _active_workers(0)
+	, _generation(0)
+	, _quit(false)
+{
+	for (auto i = 1; i < thread_count; ++i) {
+		_threads.emplace_back(&TaskPool::run_worker, this);
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		critical_section_holder csh(_mutex);
+		_quit = true;
+	}
+	_work_available.notify_all();
+	for (auto &thread : _threads) {
+		thread.join();
+	}
+}
+
+void TaskPool::run(int count, const std::function<void(int)> &job)
+{
+	if (_threads.empty() || count <= 1) {
+		for (auto i = 0; i < count; ++i) {
+			job(i);
+		}
+		return;
+	}
+
+	critical_section_holder run_lock(_run_mutex);
+	{
+		critical_section_holder csh(_mutex);
+		_job = &job;
+		_task_count = count;
+		_next_task = 0;
+		_remaining_tasks = count;
+		++_generation;
+	}
+	_work_available.notify_all();
+
+	auto done = run_tasks(job, count);
+
+	// Workers still inside run_tasks could otherwise pick up tasks of the next run.
+	std::unique_lock<std::mutex> lock(_mutex);
+	_remaining_tasks -= done;
+	_work_done.wait(lock, [this]() { return _remaining_tasks == 0 && _active_workers == 0; });
+	_job = nullptr;
+}
+
+void TaskPool::run_worker()
+{
+	uint64_t generation = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;) {
+		_work_available.wait(lock, [this, generation]() { return _quit || _generation != generation; });
+		if (_quit)
+			return;
+
+		generation = _generation;
+		if (_job == nullptr)
+			continue;
+
+		auto &job = *_job;
+		auto count = _task_count;
+		++_active_workers;
+		lock.unlock();
+
+		auto done = run_tasks(job, count);
+
+		lock.lock();
+		--_active_workers;
+		_remaining_tasks -= done;
+		if (_remaining_tasks == 0 && _active_workers == 0)
+			_work_done.notify_all();
+	}
+}
+
+int TaskPool::run_tasks(const std::function<void(int)> &job, int count)
+{
+	auto done = 0;
+	for (auto task = _next_task++; task < count; task = _next_task++) {
+		job(task);
+		++done;
+	}
+	return done;
+}
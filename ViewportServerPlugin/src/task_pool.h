@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Small set of persistent worker threads for splitting a job in independent tasks.
+class TaskPool
+{
+public:
+	// The thread calling run takes part in the work, so thread_count - 1 workers are started.
+	explicit TaskPool(int thread_count);
+	~TaskPool();
+
+	int thread_count() const { return (int)_threads.size() + 1; }
+
+	// Runs job(0) to job(count - 1) and returns once every task is done.
+	// Runs from several threads are done one after the other, a job must not run on its own pool.
+	void run(int count, const std::function<void(int)> &job);
+private:
+	void run_worker();
+	int run_tasks(const std::function<void(int)> &job, int count);
+
+	std::vector<std::thread> _threads;
+	std::mutex _run_mutex;
+	std::mutex _mutex;
+	std::condition_variable _work_available;
+	std::condition_variable _work_done;
+
+	const std::function<void(int)> *_job;
+	int _task_count;
+	std::atomic<int> _next_task;
+	int _remaining_tasks;
+	int _active_workers;
+	uint64_t _generation;
+	bool _quit;
+};
@@ -1,34 +1,33 @@
 #include "viewport_client.h"
 #include "viewport_server.h"
+#include "shared_stream.h"
+#include "h264_nal.h"
+#include "block_compressor.h"
+#include "delta_tiles.h"
 #include "nflibs.h"
 #include <engine_plugin_api/plugin_api.h>
+#include <algorithm>
+#include <chrono>
 
 using critical_section_holder = std::lock_guard<std::mutex>;
 using namespace stingray_plugin_foundation;
 
-struct StreamingStrategy
-{
-	std::string format;
-	std::string path;
-	std::string codec;
+IdString32 buffer_name("final");
 
-	StreamingStrategy(const std::string &&_format, const std::string &&_path)
-		: format(_format)
-		, path(_path)
-		, codec(H264_NAME)
-	{}
-};
+constexpr size_t default_send_high_water_mark = 1024 * 1024;
 
-StreamingStrategy file_strategy("mp4", "../../HTML5/live/video.mp4");
-StreamingStrategy rtsp_strategy("rtsp", "rtsp://127.0.0.1:54321/live.sdp");
-StreamingStrategy rtmp_strategy("rtmp", "rtmp://127.0.0.1:54321/live.sdp");
-StreamingStrategy mpegts_strategy("mpegts", "udp://127.0.0.1:54321");
-StreamingStrategy http_strategy("hls", "../../HTML5/live/index.m3u8");
-StreamingStrategy dash_strategy("stream_segment", "../../HTML5/live/video.mp4");
-StreamingStrategy raw_h264_strategy("h264", "video.h264");
-auto &current_strategy = raw_h264_strategy;
+int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-IdString32 buffer_name("final");
+int64_t system_now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+const char *latency_stage_names[] = { "queue", "conversion", "encode", "mux", "network", "decode", "present", "end_to_end" };
+static_assert(sizeof(latency_stage_names) / sizeof(latency_stage_names[0]) == (size_t)LatencyStage::COUNT, "Every latency stage needs a name");
 
 void *config_data_reallocator(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
 {
@@ -64,24 +63,32 @@ ViewportClient::ViewportClient(ViewportServer *server, CommunicationHandlers com
 	, _quit(false)
 	, _thread_id(nullptr)
 	, _comm(comm)
-	, _streamer(nullptr)
+	, _stream(nullptr)
+	, _codec(H264_NAME)
+	, _block_compressor(nullptr)
+	, _delta_encoder(nullptr)
+	, _capture_buffer(new SC_Buffer())
+	, _captured(false)
+	, _capture_bytes(0)
+	, _rate_control(BitrateController::default_settings())
 {
-	_streamer = new Streamer({
-		[this](uint8_t* buffer, int size) { send_binary(buffer, size); },
-		[this](const std::string &msg) { info(msg); },
-		[this](const std::string &msg) { warning(msg); },
-		[this](const std::string &msg) { error(msg); }
-	});
-	_streamer->init();
+	_send_queue.high_water_mark = default_send_high_water_mark;
+	_send_queue.lagging = false;
+	_send_queue.waiting_for_key_frame = false;
+	_send_queue.dropped_non_reference = 0;
+	_send_queue.dropped_to_key_frame = 0;
+	_send_queue.key_frame_requests = 0;
+	_send_queue.joined_us = 0;
+	_send_queue.first_frame_ms = -1;
 }
 
 ViewportClient::~ViewportClient()
 {
 	close();
 	stop();
-
-	if (_streamer != nullptr)
-		delete _streamer;
+	delete _block_compressor;
+	delete _delta_encoder;
+	delete _capture_buffer;
 }
 
 void ViewportClient::close()
@@ -92,9 +99,6 @@ void ViewportClient::close()
 	if (_stream_opened)
 		close_stream();
 
-	if (_streamer != nullptr)
-		_streamer->shutdown();
-
 	_closed = true;
 }
 
@@ -105,7 +109,9 @@ void ViewportClient::open_stream(void *win, IdString32 buffer_name)
 	_win = win;
 	_buffer_name = buffer_name;
 
-	if (window_valid())
+	if (_mode == CaptureMode::STREAMED_COMPRESSED_H264)
+		subscribe_stream();
+	else if (window_valid())
 		_server->apis().stream_capture_api->enable_capture(_win, 1, (uint32_t*)(&_buffer_name));
 
 
@@ -120,13 +126,17 @@ void ViewportClient::close_stream()
 
 	_comm.info("closing stream");
 
-	if (_streamer != nullptr && _streamer->stream_opened())
-		_streamer->close_stream();
-
-	if (window_valid())
+	if (_stream != nullptr) {
+		_server->streams().unsubscribe(_stream, this);
+		_stream = nullptr;
+	} else if (window_valid()) {
 		_server->apis().stream_capture_api->disable_capture(_win, 1, (uint32_t*)&_buffer_name);
+	}
 
 	_win = nullptr;
+	if (_delta_encoder != nullptr)
+		_delta_encoder->reset();
+
 	_buffer_name = IdString32((unsigned)0);
 	_stream_opened = false;
 	_comm.info("finished closing stream");
@@ -134,10 +144,27 @@ void ViewportClient::close_stream()
 
 void ViewportClient::resize_stream()
 {
-	auto win = _win;
-	auto buffer = _buffer_name;
-	close_stream();
-	open_stream(win, buffer);
+	// Closing the streamer would drop the output and restart the encoder from scratch,
+	// the next captured frame reconfigures it instead.
+	if (_stream != nullptr)
+		_stream->request_reconfigure();
+	// The client starts over with a new canvas.
+	if (_delta_encoder != nullptr)
+		_delta_encoder->reset();
+}
+
+void ViewportClient::subscribe_stream()
+{
+	StreamKey key{ _win, _buffer_name.id(), _codec, _stream_options };
+	if (_stream != nullptr && _stream->key() == key) {
+		_stream->request_reconfigure();
+		return;
+	}
+
+	// Leaving first lets a stream nobody else watches release its encoder before the new one is opened.
+	if (_stream != nullptr)
+		_server->streams().unsubscribe(_stream, this);
+	_stream = _server->streams().subscribe(key, this);
 }
 
 void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg)
@@ -145,13 +172,14 @@ void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg
 	auto opcode = msg->get_opcode();
 
 	if (opcode == websocketpp::frame::opcode::TEXT) {
-		std::stringstream ss;
-		ss << "on_message called with hdl: " << hdl.lock().get()
-			<< " and message: " << msg->get_payload();
-		info(ss.str());
-
 		static struct nfjp_Settings s = { 1, 1, 1, 1, 1, 1 };
 		auto *cd = nfcd_make(config_data_reallocator, nullptr, 0, 0);
+		// The parser may reallocate cd, the holder frees the last one on every return.
+		struct ConfigDataHolder
+		{
+			ConfigData *&cd;
+			~ConfigDataHolder() { nfcd_free(cd); }
+		} cd_holder{ cd };
 
 		auto *error_code = nfjp_parse_with_settings(msg->get_payload().c_str(), &cd, &s);
 		if (error_code) {
@@ -160,12 +188,21 @@ void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg
 		}
 
 		auto root_loc = nfcd_root(cd);
+		auto message_loc = nfcd_object_lookup(cd, root_loc, "message");
+
+		// Frame timings are echoed for every presented frame, they are not logged.
+		if (nfcd_type(cd, message_loc) == CD_TYPE_NULL || strcmp(nfcd_to_string(cd, message_loc), "frame_timing") != 0) {
+			std::stringstream ss;
+			ss << "on_message called with hdl: " << hdl.lock().get()
+				<< " and message: " << msg->get_payload();
+			info(ss.str());
+		}
 
 		auto parse_codec = [this]()
 		{
 			auto it = _stream_options.find("codec");
 			if (it != _stream_options.end()) {
-				current_strategy.codec = it->second;
+				_codec = it->second;
 
 				// Remove the codec from the options as it is not a real supported options for a codec.
 				_stream_options.erase(it);
@@ -182,7 +219,6 @@ void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg
 		};
 
 		// Check if it is a resize
-		auto message_loc = nfcd_object_lookup(cd, root_loc, "message");
 		if (nfcd_type(cd, message_loc) != CD_TYPE_NULL) {
 			auto type = nfcd_to_string(cd, message_loc);
 			if (strcmp(type, "resize") == 0) {
@@ -190,7 +226,37 @@ void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg
 				send_text("resize_done");
 			} else if (strcmp(type, "options") == 0) {
 				parse_options();
-				resize_stream();
+				// Other options are another stream, possibly already watched by other clients.
+				if (_stream != nullptr)
+					subscribe_stream();
+			} else if (strcmp(type, "rate_control") == 0) {
+				{
+					// Values not given keep their current setting.
+					critical_section_holder csh(_rate_control_mutex);
+					auto min_loc = nfcd_object_lookup(cd, root_loc, "min_bitrate");
+					if (nfcd_type(cd, min_loc) == CD_TYPE_NUMBER)
+						_rate_control.min_bitrate = (int64_t)nfcd_to_number(cd, min_loc);
+					auto max_loc = nfcd_object_lookup(cd, root_loc, "max_bitrate");
+					if (nfcd_type(cd, max_loc) == CD_TYPE_NUMBER)
+						_rate_control.max_bitrate = (int64_t)nfcd_to_number(cd, max_loc);
+					auto latency_loc = nfcd_object_lookup(cd, root_loc, "target_latency");
+					if (nfcd_type(cd, latency_loc) == CD_TYPE_NUMBER)
+						_rate_control.target_latency_ms = (int)nfcd_to_number(cd, latency_loc);
+				}
+				auto queue_loc = nfcd_object_lookup(cd, root_loc, "max_queue_bytes");
+				if (nfcd_type(cd, queue_loc) == CD_TYPE_NUMBER)
+					_send_queue.high_water_mark = (size_t)nfcd_to_number(cd, queue_loc);
+			} else if (strcmp(type, "stats") == 0) {
+				send_text(stream_stats());
+				auto reset_loc = nfcd_object_lookup(cd, root_loc, "reset");
+				if (nfcd_type(cd, reset_loc) == CD_TYPE_TRUE) {
+					critical_section_holder csh(_latency_mutex);
+					for (auto &histogram : _latency) {
+						histogram.reset();
+					}
+				}
+			} else if (strcmp(type, "frame_timing") == 0) {
+				handle_frame_timing(cd, root_loc);
 			}
 			return;
 		}
@@ -219,8 +285,6 @@ void ViewportClient::handle_message(websocketpp::connection_hdl hdl, msg_ptr msg
 
 		parse_options();
 		open_stream(win, buffer_name);
-
-		nfcd_free(cd);
 	}
 }
 
@@ -256,6 +320,73 @@ void ViewportClient::send_text(const std::string &message)
 	_comm.send_text(_socket_handle, message);
 }
 
+void ViewportClient::send_cached_frame(const FrameHeader &header, const void *buffer, int size)
+{
+	_server->apis().profiler_api->profile_start("ViewportClient:send_cached_frame");
+	auto stamped = header;
+	stamped.send_time_us = now_us();
+	_comm.send_framed(_socket_handle, &stamped, sizeof(stamped), buffer, size);
+	_server->apis().profiler_api->profile_stop();
+}
+
+void ViewportClient::start_from_key_frame()
+{
+	_send_queue.joined_us = now_us();
+	_send_queue.first_frame_ms = -1;
+	_send_queue.lagging = false;
+	_send_queue.waiting_for_key_frame = true;
+}
+
+BitrateSettings ViewportClient::rate_control() const
+{
+	critical_section_holder csh(_rate_control_mutex);
+	return _rate_control;
+}
+
+size_t ViewportClient::buffered_amount() const
+{
+	return _comm.buffered_amount(_socket_handle);
+}
+
+std::string ViewportClient::stream_stats() const
+{
+	std::stringstream ss;
+	ss << "{\"message\":\"stats\""
+		<< ",\"queue_bytes\":" << buffered_amount()
+		<< ",\"lagging\":" << (_send_queue.lagging ? "true" : "false")
+		<< ",\"dropped_non_reference\":" << _send_queue.dropped_non_reference
+		<< ",\"dropped_to_key_frame\":" << _send_queue.dropped_to_key_frame
+		<< ",\"key_frame_requests\":" << _send_queue.key_frame_requests
+		<< ",\"first_frame_ms\":" << _send_queue.first_frame_ms;
+	{
+		critical_section_holder csh(_latency_mutex);
+		ss << ",\"latency_us\":{";
+		for (auto i = 0; i < (int)LatencyStage::COUNT; ++i) {
+			const auto &histogram = _latency[i];
+			ss << (i == 0 ? "" : ",") << "\"" << latency_stage_names[i] << "\":{"
+				<< "\"count\":" << histogram.count()
+				<< ",\"p50\":" << histogram.percentile(0.50)
+				<< ",\"p95\":" << histogram.percentile(0.95)
+				<< ",\"p99\":" << histogram.percentile(0.99) << "}";
+		}
+		ss << "}";
+	}
+	if (_stream != nullptr)
+		_stream->append_stats(ss);
+	if (_block_compressor != nullptr) {
+		ss << ",\"compression_threads\":" << _block_compressor->thread_count()
+			<< ",\"compression_ratio\":" << _block_compressor->ratio()
+			<< ",\"compression_throughput\":" << (int64_t)_block_compressor->throughput();
+	}
+	if (_delta_encoder != nullptr) {
+		ss << ",\"compression_threads\":" << _delta_encoder->thread_count()
+			<< ",\"compression_ratio\":" << _delta_encoder->ratio()
+			<< ",\"changed_tiles\":" << _delta_encoder->changed_tiles();
+	}
+	ss << "}";
+	return ss.str();
+}
+
 void ViewportClient::send_binary(void* buffer, int size)
 {
 	_server->apis().profiler_api->profile_start("ViewportClient:send_binary");
@@ -263,72 +394,211 @@ void ViewportClient::send_binary(void* buffer, int size)
 	_server->apis().profiler_api->profile_stop();
 }
 
-void ViewportClient::run()
+void ViewportClient::send_frame(const FrameHeader &header, const void *buffer, int size)
 {
-	_server->apis().profiler_api->profile_start("ViewportServer:run_all_clients");
-	if (!_quit && !closed()) {
-
-		if (!stream_opened() || !_streamer->initialized())
+	const auto buffered = buffered_amount();
+	const size_t high_water_mark = _send_queue.high_water_mark;
+
+	// Once the decoder missed a reference frame only an IDR frame can resync it,
+	// and it is only sent when the queue drained enough to take it.
+	if (_send_queue.waiting_for_key_frame) {
+		if ((header.flags & FRAME_FLAG_KEY_FRAME) == 0 || buffered > high_water_mark / 2) {
+			++_send_queue.dropped_to_key_frame;
+			// A joining client already asked for its IDR frame.
+			if (buffered <= high_water_mark / 2 && _stream != nullptr && _send_queue.joined_us == 0) {
+				++_send_queue.key_frame_requests;
+				_stream->request_key_frame();
+			}
 			return;
-
-		if (!window_valid())
+		}
+		_send_queue.waiting_for_key_frame = false;
+		_send_queue.lagging = false;
+
+		// Reported with the stats, this runs on the encoder thread.
+		auto joined = _send_queue.joined_us.exchange(0);
+		if (joined != 0)
+			_send_queue.first_frame_ms = (now_us() - joined) / 1000;
+	} else if (buffered > high_water_mark) {
+		_send_queue.lagging = true;
+		if (!is_reference_access_unit((const uint8_t*)buffer, size)) {
+			++_send_queue.dropped_non_reference;
 			return;
+		}
+		++_send_queue.dropped_to_key_frame;
+		_send_queue.waiting_for_key_frame = true;
+		return;
+	} else {
+		_send_queue.lagging = false;
+	}
 
-		SC_Buffer capture_buffer;
-		_server->apis().profiler_api->profile_start("ViewportServer:capture_buffer");
-		auto success = _server->apis().stream_capture_api->capture_buffer(_win, _buffer_name.id(), _allocator, &capture_buffer);
-		_server->apis().profiler_api->profile_stop();
-		if (success) {
-			auto num_byte = _server->apis().render_buffer_api->num_bits(capture_buffer.format) >> 3;
-			_server->apis().profiler_api->profile_start("ViewportServer:stream_frame");
-
-			// TODO: Refactor this
-			switch (_mode) {
-			case CaptureMode::STREAMED_COMPRESSED_H264:
-				if (!_streamer->stream_opened()) {
-					_streamer->open_stream(capture_buffer.width, capture_buffer.height, num_byte, current_strategy.format, current_strategy.codec, _stream_options);
-				}
-				_streamer->stream_frame((uint8_t*)capture_buffer.data, capture_buffer.width, capture_buffer.height, num_byte);
-				break;
-			case CaptureMode::STREAMED_UNCOMPRESSED: {
-				struct BinaryDataHeader {
-					unsigned int size;
-					unsigned int width;
-					unsigned int height;
-					unsigned int bpp;
-					unsigned int color_buffer_size;
-					unsigned int compressed_color_buffer_size;
-					unsigned int depth_buffer_size;
-				} bd;
-
-				const auto frame_size = capture_buffer.width * capture_buffer.height * num_byte;
-				const auto binary_data_size = sizeof(BinaryDataHeader) + frame_size;
-				unsigned char *buffer = new unsigned char[binary_data_size];
-				bd.size = sizeof(BinaryDataHeader);
-				bd.width = capture_buffer.width;
-				bd.height = capture_buffer.height;
-				bd.bpp = num_byte;
-				bd.color_buffer_size = frame_size;
-				bd.compressed_color_buffer_size = frame_size;
-				bd.depth_buffer_size = 0;
-
-
-				memmove(buffer, &bd, sizeof(BinaryDataHeader));
-				memmove(buffer + sizeof(BinaryDataHeader), capture_buffer.data, frame_size);
-
-				send_binary(buffer, binary_data_size);
-				delete[] buffer;
-				break;
-			}
-			default:
-				break;
-			}
+	_server->apis().profiler_api->profile_start("ViewportClient:send_frame");
+	auto stamped = header;
+	stamped.send_time_us = now_us();
+	stamped.mux_us = (uint32_t)std::max<int64_t>(0, stamped.send_time_us - header.send_time_us);
+	_comm.send_framed(_socket_handle, &stamped, sizeof(stamped), buffer, size);
+	_server->apis().profiler_api->profile_stop();
 
-			_server->apis().profiler_api->profile_stop();
-			_server->apis().allocator_api->deallocate(_allocator, capture_buffer.data);
-		}
+	critical_section_holder csh(_latency_mutex);
+	_latency[(int)LatencyStage::QUEUE].add(stamped.queue_us);
+	_latency[(int)LatencyStage::CONVERSION].add(stamped.conversion_us);
+	_latency[(int)LatencyStage::ENCODE].add(stamped.encode_us);
+	_latency[(int)LatencyStage::MUX].add(stamped.mux_us);
+}
+
+void ViewportClient::record_latency(LatencyStage stage, int64_t duration_us)
+{
+	critical_section_holder csh(_latency_mutex);
+	_latency[(int)stage].add(duration_us);
+}
+
+void ViewportClient::handle_frame_timing(ConfigData *cd, cd_loc root_loc)
+{
+	// The client times are durations since it received the message, its clock is never compared to ours.
+	// Timestamps are sent as strings, the json parser reads numbers through an int.
+	auto number = [cd, root_loc](const char *key) {
+		auto loc = nfcd_object_lookup(cd, root_loc, key);
+		auto type = nfcd_type(cd, loc);
+		if (type == CD_TYPE_STRING)
+			return (int64_t)strtoll(nfcd_to_string(cd, loc), nullptr, 10);
+		return type == CD_TYPE_NUMBER ? (int64_t)nfcd_to_number(cd, loc) : (int64_t)-1;
+	};
+	auto send_time_us = number("send_us");
+	auto capture_time_us = number("capture_time_us");
+	auto decode_us = number("decode_us");
+	auto present_us = number("present_us");
+	if (send_time_us <= 0 || decode_us < 0 || present_us < decode_us)
+		return;
+
+	// The echo left the client once the frame was presented, what remains of the round trip
+	// is the way there and back, assumed symmetric.
+	auto round_trip_us = now_us() - send_time_us;
+	auto network_us = std::max<int64_t>(0, (round_trip_us - present_us) / 2);
+	record_latency(LatencyStage::NETWORK, network_us);
+	record_latency(LatencyStage::DECODE, decode_us);
+	record_latency(LatencyStage::PRESENT, present_us - decode_us);
+	// Capture times come from the system clock of this machine, the echo took network_us to come back.
+	if (capture_time_us > 0)
+		record_latency(LatencyStage::END_TO_END, system_now_us() - capture_time_us - network_us);
+}
+
+void ViewportClient::run()
+{
+	if (capture()) {
+		send_captured();
+		release_capture();
 	}
+}
+
+bool ViewportClient::capture()
+{
+	// Compressed streams are captured by their SharedStream.
+	if (_quit || closed() || !stream_opened() || _stream != nullptr)
+		return false;
+
+	if (!window_valid())
+		return false;
+
+	_server->apis().profiler_api->profile_start("ViewportServer:capture_buffer");
+	_captured = _server->apis().stream_capture_api->capture_buffer(_win, _buffer_name.id(), _allocator, _capture_buffer) != 0;
 	_server->apis().profiler_api->profile_stop();
+	if (_captured)
+		_capture_bytes = _server->apis().render_buffer_api->num_bits(_capture_buffer->format) >> 3;
+	return _captured;
+}
+
+void ViewportClient::send_captured()
+{
+	if (!_captured)
+		return;
+
+	switch (_mode) {
+	case CaptureMode::STREAMED_UNCOMPRESSED:
+		send_uncompressed(*_capture_buffer, _capture_bytes);
+		break;
+	case CaptureMode::STREAMED_COMPRESSED:
+		send_delta_tiles(*_capture_buffer, _capture_bytes);
+		break;
+	case CaptureMode::STREAMED_COMPRESSED_LZ4:
+		send_lz4(*_capture_buffer, _capture_bytes);
+		break;
+	default:
+		break;
+	}
+}
+
+void ViewportClient::release_capture()
+{
+	if (!_captured)
+		return;
+
+	_server->apis().allocator_api->deallocate(_allocator, _capture_buffer->data);
+	_captured = false;
+}
+
+void ViewportClient::send_uncompressed(const SC_Buffer &capture_buffer, unsigned num_byte)
+{
+	BinaryDataHeader bd;
+	const auto frame_size = capture_buffer.width * capture_buffer.height * num_byte;
+	const auto binary_data_size = sizeof(BinaryDataHeader) + frame_size;
+	unsigned char *buffer = new unsigned char[binary_data_size];
+	bd.size = sizeof(BinaryDataHeader);
+	bd.width = capture_buffer.width;
+	bd.height = capture_buffer.height;
+	bd.bpp = num_byte;
+	bd.color_buffer_size = frame_size;
+	bd.compressed_color_buffer_size = frame_size;
+	bd.depth_buffer_size = 0;
+
+	memmove(buffer, &bd, sizeof(BinaryDataHeader));
+	memmove(buffer + sizeof(BinaryDataHeader), capture_buffer.data, frame_size);
+
+	send_binary(buffer, binary_data_size);
+	delete[] buffer;
+}
+
+void ViewportClient::send_lz4(const SC_Buffer &capture_buffer, unsigned num_byte)
+{
+	if (_block_compressor == nullptr)
+		_block_compressor = new BlockCompressor(_server->compression_pool());
+
+	// The header is written in front of the blocks, the frame goes out without another copy.
+	const auto frame_size = capture_buffer.width * capture_buffer.height * num_byte;
+	auto &buffer = _block_compressor->compress((const uint8_t*)capture_buffer.data, frame_size, sizeof(BinaryDataHeader));
+
+	BinaryDataHeader bd;
+	bd.size = sizeof(BinaryDataHeader);
+	bd.width = capture_buffer.width;
+	bd.height = capture_buffer.height;
+	bd.bpp = num_byte;
+	bd.color_buffer_size = frame_size;
+	bd.compressed_color_buffer_size = (unsigned)(buffer.size() - sizeof(BinaryDataHeader));
+	bd.depth_buffer_size = 0;
+	memcpy(buffer.data(), &bd, sizeof(BinaryDataHeader));
+
+	send_binary(buffer.data(), (int)buffer.size());
+}
+
+void ViewportClient::send_delta_tiles(const SC_Buffer &capture_buffer, unsigned num_byte)
+{
+	if (_delta_encoder == nullptr)
+		_delta_encoder = new DeltaTileEncoder(_server->compression_pool());
+
+	// Nothing is sent for frames without changes, the client keeps showing the last one.
+	if (!_delta_encoder->encode((const uint8_t*)capture_buffer.data, capture_buffer.width, capture_buffer.height, (short)num_byte, sizeof(BinaryDataHeader)))
+		return;
+
+	auto &buffer = _delta_encoder->output();
+	BinaryDataHeader bd;
+	bd.size = sizeof(BinaryDataHeader);
+	bd.width = capture_buffer.width;
+	bd.height = capture_buffer.height;
+	bd.bpp = num_byte;
+	bd.color_buffer_size = capture_buffer.width * capture_buffer.height * num_byte;
+	bd.compressed_color_buffer_size = (unsigned)(buffer.size() - sizeof(BinaryDataHeader));
+	bd.depth_buffer_size = 0;
+	memcpy(buffer.data(), &bd, sizeof(BinaryDataHeader));
+
+	send_binary(buffer.data(), (int)buffer.size());
 }
 
 void ViewportClient::stop()
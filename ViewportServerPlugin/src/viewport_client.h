@@ -1,11 +1,19 @@
 #pragma once
 #include "common.h"
-#include "streamer.h"
+#include "frame_header.h"
+#include "latency_histogram.h"
+#include "bitrate_controller.h"
+#include "config_data.h"
 #include <plugin_foundation/id_string.h>
 
 #include <thread>
+#include <atomic>
 
 class ViewportServer;
+class SharedStream;
+class BlockCompressor;
+class DeltaTileEncoder;
+struct SC_Buffer;
 
 enum class CaptureMode
 {
@@ -16,6 +24,50 @@ enum class CaptureMode
 	STREAMED_COMPRESSED_H264 = 4
 };
 
+// Prefixed to the frames of the captured modes. The color buffer is compressed_color_buffer_size
+// bytes long, sent as the blocks of a BlockCompressor for STREAMED_COMPRESSED_LZ4 and as the
+// changed tiles of a DeltaTileEncoder for STREAMED_COMPRESSED.
+struct BinaryDataHeader
+{
+	unsigned int size;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp;
+	unsigned int color_buffer_size;
+	unsigned int compressed_color_buffer_size;
+	unsigned int depth_buffer_size;
+};
+
+// Stages of a frame from capture to display. The server stages come from the frame header,
+// the client ones from the timings the client echoes back for every displayed frame.
+enum class LatencyStage
+{
+	QUEUE = 0,
+	CONVERSION,
+	ENCODE,
+	MUX,
+	NETWORK,
+	DECODE,
+	PRESENT,
+	END_TO_END,
+	COUNT
+};
+
+// Send queue accounting of one connection. Past the high water mark the frames that
+// are not referenced are dropped first, then everything until the next IDR frame.
+struct SendQueueState
+{
+	std::atomic<size_t> high_water_mark;
+	std::atomic<bool> lagging;
+	std::atomic<bool> waiting_for_key_frame;
+	std::atomic<int64_t> dropped_non_reference;
+	std::atomic<int64_t> dropped_to_key_frame;
+	std::atomic<int64_t> key_frame_requests;
+	// Time the client joined its stream in microseconds, 0 once it received its first live frame.
+	std::atomic<int64_t> joined_us;
+	std::atomic<int64_t> first_frame_ms;
+};
+
 class ViewportClient
 {
 public:
@@ -25,6 +77,7 @@ public:
 	void set_id(int id) { _id = id; }
 
 	bool closed() const { return _closed; }
+	websocketpp::connection_hdl handle() const { return _socket_handle; }
 	bool stream_opened() const { return _stream_opened; }
 
 	void close();
@@ -41,14 +94,42 @@ public:
 	void run();
 	void stop();
 
+	// run in three steps, so the work between the capture and the release of the buffer can be
+	// done in parallel for every client. capture and release_capture are called on the engine thread.
+	bool capture();
+	void send_captured();
+	void release_capture();
+
 	void render(unsigned sch);
 
+	// Used by the SharedStream the client is subscribed to, from its encoder thread.
+	void send_binary(void *buffer, int size);
+	// Drops frames the connection cannot keep up with, see SendQueueState.
+	void send_frame(const FrameHeader &header, const void *buffer, int size);
+	// Sent before the stream to a joining client, frames are then skipped until the next IDR frame.
+	void send_cached_frame(const FrameHeader &header, const void *buffer, int size);
+	void start_from_key_frame();
+	size_t buffered_amount() const;
+	// True while frames are dropped for this client.
+	bool lagging() const { return _send_queue.lagging; }
+	// Limits the client asked for with the "rate_control" message, combined by its stream with the other subscribers.
+	BitrateSettings rate_control() const;
+
 private:
 	void info(const std::string &message);
 	void warning(const std::string &message);
 	void error(const std::string &message);
 	void send_text(const std::string &message);
-	void send_binary(void *buffer, int size);
+	// Joins the shared stream matching the window, buffer and options of the client.
+	void subscribe_stream();
+	// Statistics of the client and of its stream as a json object, sent back for the "stats" message.
+	std::string stream_stats() const;
+	void record_latency(LatencyStage stage, int64_t duration_us);
+	// Handles the "frame_timing" message a client sends once a frame is on screen.
+	void handle_frame_timing(ConfigData *cd, cd_loc root_loc);
+	void send_uncompressed(const SC_Buffer &capture_buffer, unsigned num_byte);
+	void send_lz4(const SC_Buffer &capture_buffer, unsigned num_byte);
+	void send_delta_tiles(const SC_Buffer &capture_buffer, unsigned num_byte);
 
 	bool window_valid() const;
 
@@ -75,7 +156,25 @@ private:
 	// Communication handlers
 	CommunicationHandlers _comm;
 
-	// Stream/Compression engine
-	Streamer *_streamer;
+	// Compressed streams are captured and encoded once for every client watching them.
+	SharedStream *_stream;
+	std::string _codec;
 	EncodingOptions _stream_options;
+	SendQueueState _send_queue;
+	// Set from the game thread, read by the encoder thread of the stream.
+	mutable std::mutex _rate_control_mutex;
+	BitrateSettings _rate_control;
+	// Created with the first frame of the LZ4 mode, its buffers are reused by the next ones.
+	BlockCompressor *_block_compressor;
+	// Holds the previous frame of the delta tile mode, reset with the stream.
+	DeltaTileEncoder *_delta_encoder;
+
+	// Captured by capture and held until release_capture.
+	SC_Buffer *_capture_buffer;
+	bool _captured;
+	unsigned _capture_bytes;
+
+	// Written from the encoder thread for the server stages and from the game thread for the echoed ones.
+	mutable std::mutex _latency_mutex;
+	LatencyHistogram _latency[(int)LatencyStage::COUNT];
 };
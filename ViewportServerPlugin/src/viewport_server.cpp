@@ -3,6 +3,7 @@
 #include <engine_plugin_api/plugin_api.h>
 #include <plugin_foundation/id_string.h>
 #include <iostream>
+#include <algorithm>
 
 using namespace stingray_plugin_foundation;
 
@@ -15,6 +16,19 @@ void send_buffer(websocketpp::connection_hdl h, void *buffer, int size)
 	serv.send(h, buffer, size, websocketpp::frame::opcode::BINARY);
 }
 
+void send_framed(websocketpp::connection_hdl h, const void *header, size_t header_size, const void *buffer, size_t size)
+{
+	websocketpp::lib::error_code ec;
+	auto con = serv.get_con_from_hdl(h, ec);
+	if (ec)
+		return;
+
+	auto msg = con->get_message(websocketpp::frame::opcode::BINARY, header_size + size);
+	msg->append_payload(header, header_size);
+	msg->append_payload(buffer, size);
+	con->send(msg);
+}
+
 void send_text(websocketpp::connection_hdl h, const std::string &message)
 {
 	serv.send(h, message, websocketpp::frame::opcode::TEXT);
@@ -24,7 +38,9 @@ ViewportServer::ViewportServer()
 	: _initialized(false)
 	, _server_started(false)
 	, _allocator(nullptr)
-	, _ws_thread(nullptr)
+	, _streams(this)
+	, _job_pool(nullptr)
+	, _compression_pool(nullptr)
 	, _quit(false)
 	, _ws_ostream(nullptr)
 {
@@ -44,6 +60,8 @@ void ViewportServer::init(EnginePluginApis apis)
 {
 	_apis = apis;
 	_allocator = _apis.allocator_api->make_plugin_allocator(PLUGIN_NAME);
+	_job_pool = new TaskPool(std::max(1, (int)std::thread::hardware_concurrency()));
+	_compression_pool = new TaskPool(std::max(1, (int)std::thread::hardware_concurrency()));
 
 	_initialized = true;
 }
@@ -52,6 +70,11 @@ void ViewportServer::uninit()
 {
 	close_connection();
 
+	delete _job_pool;
+	_job_pool = nullptr;
+	delete _compression_pool;
+	_compression_pool = nullptr;
+
 	_apis.allocator_api->destroy_plugin_allocator(_allocator);
 	_allocator = nullptr;
 
@@ -61,10 +84,10 @@ void ViewportServer::uninit()
 void ViewportServer::update()
 {
 	_apis.profiler_api->profile_start("ViewportServer:update");
-	if (_server_started)
-		serv.poll();
+	process_commands();
 	sweep_clients();
 	run_all_clients();
+	_streams.run_all(_job_pool);
 	_apis.profiler_api->profile_stop();
 }
 
@@ -73,19 +96,20 @@ void ViewportServer::render(unsigned sch)
 
 }
 
-void ViewportServer::open_connection(const char* ip, int port)
+void ViewportServer::open_connection(const char* ip, int port, int io_threads)
 {
-	start_ws_server(ip, port);
+	start_ws_server(ip, port, io_threads);
 }
 
 void ViewportServer::close_connection()
 {
 	_quit = true;
 	close_all_clients();
+	_streams.clear();
 	stop_ws_server();
 }
 
-void ViewportServer::start_ws_server(const char* ip, int port)
+void ViewportServer::start_ws_server(const char* ip, int port, int io_threads)
 {
 
 	try {
@@ -99,54 +123,27 @@ void ViewportServer::start_ws_server(const char* ip, int port)
 		serv.init_asio();
 		serv.set_reuse_addr(true);
 
+		// Handlers run on the network threads, the game thread picks the events up in update.
 		serv.set_fail_handler([this](websocketpp::connection_hdl hdl)
 		{
-			auto con = serv.get_con_from_hdl(hdl);
-			std::stringstream ss;
-			ss << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
-			error(ss.str().c_str());
+			_commands.push({ ServerCommand::Type::FAIL, hdl, nullptr });
 		});
 		serv.set_close_handler([this](websocketpp::connection_hdl hdl)
 		{
-			info("Close handler");
+			_commands.push({ ServerCommand::Type::CLOSE, hdl, nullptr });
 		});
 		serv.set_validate_handler([this](websocketpp::connection_hdl hdl)
 		{
-			auto con = serv.get_con_from_hdl(hdl);
-			auto origin = con->get_origin();
-			info("(Validate) Origin: " + origin);
 			// TODO: check if the connection is for the viewport server.
 			return true;
 		});
 		serv.set_open_handler([this](websocketpp::connection_hdl hdl)
 		{
-			auto con = serv.get_con_from_hdl(hdl);
-			info("Open handler");
-
-			CommunicationHandlers h;
-			h.info = [this](auto msg) {info(msg); };
-			h.warning = [this](auto msg) {warning(msg); };
-			h.error = [this](auto msg) {error(msg); };
-			h.send_binary = [](auto hdl, auto buffer, auto size) {send_buffer(hdl, buffer, size); };
-			h.send_text = [](auto hdl, auto msg) {send_text(hdl, msg); };
-
-			auto *client = new ViewportClient(this, h, hdl, _allocator);
-
-			// Register our message handler
-			con->set_message_handler([client](websocketpp::connection_hdl hdl, msg_ptr msg)
-			{
-				client->handle_message(hdl, msg);
-			});
-			con->set_close_handler([client](websocketpp::connection_hdl hdl)
-			{
-				client->handle_close(hdl);
-			});
-			con->set_fail_handler([client](websocketpp::connection_hdl hdl)
-			{
-				client->handle_fail(hdl);
-			});
-
-			_clients.push_back(client);
+			_commands.push({ ServerCommand::Type::OPEN, hdl, nullptr });
+		});
+		serv.set_message_handler([this](websocketpp::connection_hdl hdl, msg_ptr msg)
+		{
+			_commands.push({ ServerCommand::Type::MESSAGE, hdl, msg });
 		});
 
 		// Listen on port
@@ -155,6 +152,10 @@ void ViewportServer::start_ws_server(const char* ip, int port)
 		// Start the server accept loop
 		serv.start_accept();
 
+		for (auto i = 0; i < std::max(1, io_threads); ++i) {
+			_io_threads.emplace_back(&ViewportServer::run_io_thread, this);
+		}
+
 		_server_started = true;
 	}
 	catch (websocketpp::lib::error_code e) {
@@ -174,7 +175,102 @@ void ViewportServer::stop_ws_server()
 {
 	if (_server_started)
 		serv.stop();
+	for (auto &thread : _io_threads) {
+		thread.join();
+	}
+	_io_threads.clear();
 	_server_started = false;
+
+	// Events of connections that are gone with the server.
+	ServerCommand command;
+	while (_commands.pop(command)) {}
+}
+
+void ViewportServer::run_io_thread()
+{
+	try {
+		serv.run();
+	}
+	catch (websocketpp::lib::error_code e) {
+		error("ws error: " + e.message());
+	}
+	catch (const std::exception & e) {
+		auto s = std::string(e.what());
+		error("std error: " + s);
+	}
+	catch (...) {
+		error("Other exception");
+	}
+}
+
+void ViewportServer::process_commands()
+{
+	_apis.profiler_api->profile_start("ViewportServer:process_commands");
+	ServerCommand command;
+	while (_commands.pop(command)) {
+		if (command.type == ServerCommand::Type::OPEN) {
+			create_client(command.hdl);
+			continue;
+		}
+
+		auto *client = find_client(command.hdl);
+		if (client == nullptr)
+			continue;
+
+		switch (command.type) {
+		case ServerCommand::Type::MESSAGE:
+			client->handle_message(command.hdl, command.msg);
+			break;
+		case ServerCommand::Type::CLOSE:
+			info("Close handler");
+			client->handle_close(command.hdl);
+			break;
+		case ServerCommand::Type::FAIL: {
+			websocketpp::lib::error_code ec;
+			auto con = serv.get_con_from_hdl(command.hdl, ec);
+			if (!ec) {
+				std::stringstream ss;
+				ss << "Fail handler: " << con->get_ec() << " " << con->get_ec().message() << std::endl;
+				error(ss.str().c_str());
+			}
+			client->handle_fail(command.hdl);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	_apis.profiler_api->profile_stop();
+}
+
+void ViewportServer::create_client(websocketpp::connection_hdl hdl)
+{
+	info("Open handler");
+
+	CommunicationHandlers h;
+	h.info = [this](auto msg) {info(msg); };
+	h.warning = [this](auto msg) {warning(msg); };
+	h.error = [this](auto msg) {error(msg); };
+	h.send_binary = [](auto hdl, auto buffer, auto size) {send_buffer(hdl, buffer, size); };
+	h.send_text = [](auto hdl, auto msg) {send_text(hdl, msg); };
+	h.send_framed = [](auto hdl, auto header, auto header_size, auto buffer, auto size) {send_framed(hdl, header, header_size, buffer, size); };
+	h.buffered_amount = [](auto hdl) {
+		websocketpp::lib::error_code ec;
+		auto con = serv.get_con_from_hdl(hdl, ec);
+		return ec ? size_t(0) : con->get_buffered_amount();
+	};
+
+	_clients.push_back(new ViewportClient(this, h, hdl, _allocator));
+}
+
+ViewportClient* ViewportServer::find_client(websocketpp::connection_hdl hdl) const
+{
+	for (auto *client : _clients) {
+		auto other = client->handle();
+		if (!hdl.owner_before(other) && !other.owner_before(hdl))
+			return client;
+	}
+	return nullptr;
 }
 
 void ViewportServer::run_client(ViewportClient *client)
@@ -185,8 +281,17 @@ void ViewportServer::run_client(ViewportClient *client)
 void ViewportServer::run_all_clients()
 {
 	_apis.profiler_api->profile_start("ViewportServer:run_all_clients");
+	std::vector<ViewportClient*> captured;
 	for (auto *c: _clients) {
-		c->run();
+		if (c->capture())
+			captured.push_back(c);
+	}
+
+	// Compression of the captured modes runs as one job per client, joined before the buffers are released.
+	_job_pool->run((int)captured.size(), [&captured](int i) { captured[i]->send_captured(); });
+
+	for (auto *c : captured) {
+		c->release_capture();
 	}
 	_apis.profiler_api->profile_stop();
 }
@@ -1,10 +1,14 @@
 #pragma once
 #include "common.h"
 #include "viewport_client.h"
+#include "shared_stream.h"
 #include "function_stream.h"
+#include "mpsc_queue.h"
+#include "task_pool.h"
 
 #include <vector>
 #include <mutex>
+#include <thread>
 
 class ViewportServer
 {
@@ -17,7 +21,8 @@ public:
 	void update();
 	void render(unsigned sch);
 
-	void open_connection(const char *ip, int port);
+	// The websocket server runs on io_threads threads of its own, each connection on its own strand.
+	void open_connection(const char *ip, int port, int io_threads = default_io_threads);
 	void close_connection();
 
 	bool initialized() const { return _initialized; }
@@ -29,9 +34,33 @@ public:
 
 	EnginePluginApis& apis() { return _apis; }
 	AllocatorObject* allocator() { return _allocator; }
+	StreamRegistry& streams() { return _streams; }
+	TaskPool* compression_pool() { return _compression_pool; }
+	static constexpr int default_io_threads = 2;
 private:
-	void start_ws_server(const char *ip, int port);
+	// Connection events, handed from the network threads to the game thread.
+	struct ServerCommand
+	{
+		enum class Type
+		{
+			OPEN,
+			MESSAGE,
+			CLOSE,
+			FAIL
+		};
+
+		Type type;
+		websocketpp::connection_hdl hdl;
+		msg_ptr msg;
+	};
+
+	void start_ws_server(const char *ip, int port, int io_threads);
 	void stop_ws_server();
+	void run_io_thread();
+
+	void process_commands();
+	void create_client(websocketpp::connection_hdl hdl);
+	ViewportClient* find_client(websocketpp::connection_hdl hdl) const;
 
 	void run_client(ViewportClient *client);
 	void run_all_clients();
@@ -48,9 +77,15 @@ private:
 	EnginePluginApis _apis;
 	AllocatorObject *_allocator;
 
-	std::thread *_ws_thread;
+	std::vector<std::thread> _io_threads;
+	MpscQueue<ServerCommand> _commands;
 	std::mutex _client_mutex;
 	std::vector<ViewportClient*> _clients;
+	StreamRegistry _streams;
+	// Work of the clients and streams between their capture and the release of the capture buffers.
+	TaskPool *_job_pool;
+	// Shared by the clients compressing their captures from their _job_pool job, one at a time.
+	TaskPool *_compression_pool;
 	bool _quit;
 
 	// WSPPLogger
@@ -50,7 +50,9 @@ void console_receiver(void *user_data, int client_id, ConstConfigRootPtr dv, con
 	auto start_command_item = arg_item["start"];
 	if (start_command_item.is_integer()) {
 		auto port = start_command_item.to_integer();
-		viewport_server.open_connection("127.0.0.1", port);
+		auto io_threads_item = arg_item["io_threads"];
+		auto io_threads = io_threads_item.is_integer() ? (int)io_threads_item.to_integer() : ViewportServer::default_io_threads;
+		viewport_server.open_connection("127.0.0.1", port, io_threads);
 	}
 	else {
 		apis.logging_api->error(PLUGIN_NAME, "invalid start command");